@@ -0,0 +1,101 @@
+#!/bin/bash
+# end to end benchmark of parcp, createtar, puntar and GNU tar. Generates a
+# tree with gentree, runs each tool and mode on it with the latencies of
+# slowfs.so and prints files/s and MB/s of all of them in one table.
+#
+# usage: bench.sh [gentree options], e.g.
+#   SLOWFS_OPEN_US=500 SLOWFS_STAT_US=200 ./bench.sh -files 20000
+#
+# environment:
+#   BENCH_DIR       where the tree, the copies and the tar files go
+#                   (default /tmp/parcp-bench), removed and re-created
+#   SLOWFS_OPEN_US, SLOWFS_STAT_US, SLOWFS_READ_US
+#                   latencies added to the tree and the copies, see slowfs.c
+#   PARCP_OPTS      extra options for the parcp sender, e.g. "-threads 64"
+#   PUNTAR_OPTS     extra options for puntar -engine native, e.g. "-threads 16"
+#   DROP_CACHES=1   drop the page cache before each run, needs root
+#   MODES           a regular expression, only modes matching it are run
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+DIR=${BENCH_DIR:-/tmp/parcp-bench}
+PARCP=$HERE/parcp
+CREATETAR=$HERE/createtar
+PUNTAR=$HERE/../puntar/puntar
+SHIM=$HERE/slowfs.so
+
+for tool in "$HERE/gentree" "$PARCP" "$SHIM"; do
+  if [ ! -x "$tool" ] && [ ! -f "$tool" ]; then
+    echo "$tool missing, run make bench-tools" >&2
+    exit 1
+  fi
+done
+
+rm -rf "$DIR"
+mkdir -p "$DIR"
+"$HERE/gentree" "$@" "$DIR/src" >&2
+(cd "$DIR/src" && find . -type f -o -type l | sort) > "$DIR/list"
+FILES=$(wc -l < "$DIR/list")
+BYTES=$(cd "$DIR/src" && find . -type f -printf '%s\n' |
+        awk '{ sum += $1 } END { print sum+0 }')
+# the extract modes all start from the same tar file
+(cd "$DIR/src" && tar cf "$DIR/ref.tar" -T "$DIR/list")
+
+export SLOWFS_OPEN_US SLOWFS_STAT_US SLOWFS_READ_US
+export SLOWFS_PATH="$DIR/src:$DIR/dst"
+
+printf "%d files, %.1f MB, latency us: open %s stat %s read %s\n\n" \
+       "$FILES" "$(echo "$BYTES" | awk '{ print $1/1e6 }')" \
+       "${SLOWFS_OPEN_US:-0}" "${SLOWFS_STAT_US:-0}" "${SLOWFS_READ_US:-0}"
+printf "%-36s %9s %10s %10s\n" "mode" "seconds" "files/s" "MB/s"
+
+# run NAME COMMAND: times COMMAND run in the tree with the shim loaded
+run() {
+  local name=$1 cmd=$2
+  if [ -n "$MODES" ] && ! echo "$name" | grep -Eq "$MODES"; then
+    return
+  fi
+  rm -rf "$DIR/dst" "$DIR/out.tar"
+  mkdir "$DIR/dst"
+  sync
+  if [ "$DROP_CACHES" = 1 ]; then
+    echo 3 > /proc/sys/vm/drop_caches
+  fi
+  local start end
+  start=$(date +%s.%N)
+  if ! (cd "$DIR/src" && LD_PRELOAD=$SHIM bash -c "$cmd") \
+       > /dev/null 2> "$DIR/err"; then
+    printf "%-36s failed: %s\n" "$name" "$(head -1 "$DIR/err")"
+    return
+  fi
+  end=$(date +%s.%N)
+  echo "$start $end $FILES $BYTES" | awk -v name="$name" '{
+    secs = $2 - $1
+    printf "%-36s %9.2f %10.0f %10.1f\n", name, secs, $3/secs, $4/1e6/secs
+  }'
+}
+
+run "parcp -create | parcp -tar" \
+    "$PARCP -create $PARCP_OPTS < ../list | $PARCP -tar > ../out.tar"
+run "parcp -create | parcp -extract" \
+    "$PARCP -create $PARCP_OPTS < ../list | (cd ../dst && $PARCP -extract)"
+run "parcp -create-tar" "$PARCP -create-tar ../out.tar $PARCP_OPTS < ../list"
+run "parcp -create-tar DIR" "$PARCP -create-tar ../out.tar $PARCP_OPTS ."
+# io_uring does not go through libc, so it sees no added latency
+run "parcp -create-tar -engine uring (*)" \
+    "$PARCP -create-tar ../out.tar -engine uring $PARCP_OPTS < ../list"
+run "parcp -copy" "$PARCP -copy $PARCP_OPTS . ../dst"
+if [ -x "$CREATETAR" ]; then
+  run "createtar" "$CREATETAR \$(cat ../list) > ../out.tar"
+fi
+run "tar -c" "tar cf ../out.tar -T ../list"
+if [ -x "$PUNTAR" ]; then
+  run "puntar" "cd ../dst && $PUNTAR < ../ref.tar"
+  run "puntar -engine native" \
+      "cd ../dst && $PUNTAR -engine native $PUNTAR_OPTS < ../ref.tar"
+fi
+run "tar -x" "cd ../dst && tar xf ../ref.tar"
+
+echo
+echo "(*) without the latencies of slowfs.so"
@@ -0,0 +1,133 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// a chunk of page aligned memory. Its contents are undefined when it is
+// checked out of a pool, nothing is ever zero-filled.
+struct buffer_t
+{
+  char* data;
+  size_t capacity;
+};
+
+// a pool of page aligned buffers of a fixed size. Buffers are carved out of
+// large slabs and recycled through a free list so that checking a buffer out
+// and returning it never allocates or touches the memory. Requests for more
+// than the pool's buffer size are served by one-off allocations which are
+// freed when they are returned. If max_buffers is non-zero get() blocks once
+// that many pooled buffers are checked out.
+class buffer_pool_t
+{
+  public:
+    buffer_pool_t(size_t buffer_size, size_t max_buffers = 0);
+    ~buffer_pool_t();
+
+    buffer_t get(size_t size = 0);
+    void put(const buffer_t& buffer);
+    size_t buffer_size() const { return size; };
+  private:
+    buffer_pool_t(const buffer_pool_t&);
+    buffer_pool_t& operator=(const buffer_pool_t&);
+
+    static char* allocate(size_t size);
+
+    // slabs are at least this large so that small buffers are not allocated
+    // one by one
+    enum { SLAB_SIZE = 4*1024*1024 };
+
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+
+    size_t size;
+    size_t max_buffers;
+    size_t num_buffers; // buffers carved from slabs so far
+    std::vector<char*> free_list;
+    std::vector<char*> slabs;
+};
+
+inline char* buffer_pool_t::allocate(size_t sz)
+{
+  void* mem;
+  const int ierr = posix_memalign(&mem, size_t(sysconf(_SC_PAGESIZE)), sz);
+  if(ierr) {
+    std::cerr << "Could not allocate " << sz << " bytes: " << strerror(ierr)
+              << std::endl;
+    exit(1);
+  }
+  return static_cast<char*>(mem);
+}
+
+inline buffer_pool_t::buffer_pool_t(size_t buffer_size, size_t max_buffers_) :
+  max_buffers(max_buffers_), num_buffers(0)
+{
+  const size_t pagesize = size_t(sysconf(_SC_PAGESIZE));
+  size = (buffer_size + pagesize-1) & ~(pagesize-1);
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wait, NULL);
+}
+
+inline buffer_pool_t::~buffer_pool_t()
+{
+  for(size_t i = 0 ; i < slabs.size() ; ++i)
+    free(slabs[i]);
+  pthread_cond_destroy(&wait);
+  pthread_mutex_destroy(&lock);
+}
+
+// check out a buffer of at least size bytes
+inline buffer_t buffer_pool_t::get(size_t sz)
+{
+  buffer_t buffer;
+  if(sz > size) {
+    buffer.capacity = sz;
+    buffer.data = allocate(sz);
+    return buffer;
+  }
+
+  pthread_mutex_lock(&lock);
+  while(free_list.empty()) {
+    if(max_buffers == 0 || num_buffers < max_buffers) {
+      size_t count = std::max(size_t(1), size_t(SLAB_SIZE) / size);
+      if(max_buffers)
+        count = std::min(count, max_buffers - num_buffers);
+      char* slab = allocate(count * size);
+      slabs.push_back(slab);
+      for(size_t i = 0 ; i < count ; ++i)
+        free_list.push_back(slab + i*size);
+      num_buffers += count;
+    } else {
+      pthread_cond_wait(&wait, &lock);
+    }
+  }
+  buffer.data = free_list.back();
+  buffer.capacity = size;
+  free_list.pop_back();
+  pthread_mutex_unlock(&lock);
+
+  return buffer;
+}
+
+// return a buffer obtained from get()
+inline void buffer_pool_t::put(const buffer_t& buffer)
+{
+  if(buffer.capacity != size) {
+    free(buffer.data);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  free_list.push_back(buffer.data);
+  pthread_cond_signal(&wait);
+  pthread_mutex_unlock(&lock);
+}
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,104 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <cstring>
+
+// CRC32C, the Castagnoli polynomial used by iSCSI, ext4 and btrfs. On x86-64
+// CPUs with SSE4.2 it is computed with the crc32 instruction, elsewhere with
+// a slicing-by-8 table. Like zlib's crc32() the running value starts at 0 and
+// pieces can be chained: crc32c(crc32c(0, a, n), b, m) is the CRC of a
+// followed by b.
+
+// reflected polynomial
+#define CRC32C_POLY 0x82f63b78u
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char* p,
+                               size_t len);
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len)
+{
+  while(len > 0 && (uintptr_t(p) & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    --len;
+  }
+  while(len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc; // little endian
+    crc = crc32c_table[7][word & 0xff] ^
+          crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^
+          crc32c_table[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while(len > 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    --len;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len)
+{
+  while(len > 0 && (uintptr_t(p) & 7) != 0) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+    --len;
+  }
+  uint64_t crc64 = crc;
+  while(len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  crc = uint32_t(crc64);
+  while(len > 0) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+    --len;
+  }
+  return crc;
+}
+#endif
+
+static void crc32c_init()
+{
+  for(uint32_t i = 0 ; i < 256 ; ++i) {
+    uint32_t crc = i;
+    for(int j = 0 ; j < 8 ; ++j)
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    crc32c_table[0][i] = crc;
+  }
+  for(uint32_t i = 0 ; i < 256 ; ++i)
+    for(int k = 1 ; k < 8 ; ++k)
+      crc32c_table[k][i] = crc32c_table[0][crc32c_table[k-1][i] & 0xff] ^
+                           (crc32c_table[k-1][i] >> 8);
+
+  crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.2"))
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+static inline uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, crc32c_init);
+  return ~crc32c_impl(~crc, static_cast<const unsigned char*>(data), len);
+}
+
+#endif // CRC32C_H
@@ -46,11 +46,14 @@ struct posix_header
 /* Values used in typeflag field.  */
 #define REGTYPE  '0'            /* regular file */
 #define SYMTYPE  '2'            /* reserved */
+#define XHDTYPE  'x'            /* extended header of the next member */
 
 #define BLOCKSIZE 512
 #define BUFFERSIZE (BLOCKSIZE*100)
 
 #define MAX_FILE_SIZE ((8L<<(3*(sizeof(((struct posix_header*)0)->size)-1)))-1)
+/* the largest uid or gid the 7 octal digits of a header hold */
+#define MAX_OCTAL_ID 07777777
 
 union hdr_union
 {
@@ -58,9 +61,91 @@ union hdr_union
   char block[BLOCKSIZE];
 };
 
+/* the records of a PAX extended header, for values a ustar header cannot
+   hold */
+struct pax_records
+{
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+/* appends a "length key=value\n" record, the length counts its own digits */
+static void add_pax_record(struct pax_records *records, const char *key,
+                           const char *value, size_t value_len)
+{
+  const size_t base = strlen(key) + value_len + 3; /* ' ', '=' and '\n' */
+  size_t len = base + 1;
+  char digits[32];
+  while(1)
+  {
+    const size_t ndigits = (size_t)snprintf(digits, sizeof(digits), "%zu", len);
+    if(base + ndigits == len)
+      break;
+    len = base + ndigits;
+  }
+  if(records->size + len + 1 > records->capacity)
+  {
+    records->capacity = 2*(records->size + len + 1);
+    records->data = (char *)realloc(records->data, records->capacity);
+    if(records->data == NULL)
+    {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  snprintf(records->data + records->size, len + 1, "%s %s=%.*s\n", digits, key,
+           (int)value_len, value);
+  records->size += len;
+}
+
+static void add_pax_number(struct pax_records *records, const char *key,
+                           unsigned long long value)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", value);
+  add_pax_record(records, key, buf, strlen(buf));
+}
+
+static void set_checksum(union hdr_union *hdr)
+{
+  unsigned long int checksum = 0;
+  memset(hdr->hdr.chksum, ' ', sizeof(hdr->hdr.chksum));
+  for(size_t j = 0 ; j < sizeof(hdr->block) ; j++)
+    checksum += hdr->block[j];
+  snprintf(hdr->hdr.chksum, sizeof(hdr->hdr.chksum), "%0*lo",
+           (int)sizeof(hdr->hdr.chksum)-1, checksum);
+}
+
+/* writes the 'x' header holding records in front of the member whose header
+   is hdr, followed by the records padded to a full block */
+static void write_pax_header(const union hdr_union *hdr,
+                             const struct pax_records *records)
+{
+  union hdr_union pax = *hdr;
+  snprintf(pax.hdr.prefix, sizeof(pax.hdr.prefix), "%s", "");
+  snprintf(pax.hdr.name, sizeof(pax.hdr.name), "PaxHeaders/%.*s",
+           (int)(sizeof(pax.hdr.name) - sizeof("PaxHeaders/")),
+           hdr->hdr.name);
+  snprintf(pax.hdr.mode, sizeof(pax.hdr.mode), "%0*o",
+           (int)sizeof(pax.hdr.mode)-1, 0644);
+  snprintf(pax.hdr.size, sizeof(pax.hdr.size), "%0*lo",
+           (int)sizeof(pax.hdr.size)-1, (unsigned long)records->size);
+  memset(pax.hdr.linkname, 0, sizeof(pax.hdr.linkname));
+  pax.hdr.typeflag = XHDTYPE;
+  set_checksum(&pax);
+  fwrite(&pax.block, BLOCKSIZE, 1, stdout);
+
+  const size_t padded = (records->size + BLOCKSIZE-1) & ~(BLOCKSIZE-1);
+  static const char zeros[BLOCKSIZE] = {0};
+  fwrite(records->data, 1, records->size, stdout);
+  fwrite(zeros, 1, padded - records->size, stdout);
+}
+
 void write_tarfile(int nfiles, char **filenames)
 {
   char buffer[BUFFERSIZE];
+  struct pax_records records = {NULL, 0, 0};
 
   for(int i = 0 ; i < nfiles ; i++)
   {
@@ -69,40 +154,36 @@ void write_tarfile(int nfiles, char **filenames)
     union hdr_union hdr;
     struct group *grp;
     struct passwd *pwd;
-    unsigned long int checksum;
 
     assert(sizeof(hdr) == BLOCKSIZE);
 
     lstat(filename, &statbuf);
     grp = getgrgid(statbuf.st_gid);
     pwd = getpwuid(statbuf.st_uid);
-    if(statbuf.st_size > MAX_FILE_SIZE)
-    {
-      fprintf(stderr, "size %zd of file %s too big. Maximum size is %lu\n",
-              statbuf.st_size, filename, MAX_FILE_SIZE);
-      exit(1);
-    }
+    records.size = 0;
 
     assert(S_ISLNK(statbuf.st_mode) || S_ISREG(statbuf.st_mode));
 
     memset(hdr.block, 0, BLOCKSIZE);
     if(S_ISLNK(statbuf.st_mode))
     {
-      if((size_t)statbuf.st_size >= sizeof(hdr.hdr.linkname))
-      {
-        fprintf(stderr, "linked filename %s too long. Last part must be shorter than %zu characters\n",
-                hdr.hdr.linkname, sizeof(hdr.hdr.linkname)-1);
-        exit(1);
-      }
-      size_t sz_read =
-        readlink(filename, hdr.hdr.linkname, sizeof(hdr.hdr.linkname));
-      if(sz_read == (size_t)-1)
+      char *target = (char *)malloc((size_t)statbuf.st_size + 1);
+      ssize_t sz_read =
+        target ? readlink(filename, target, (size_t)statbuf.st_size + 1) : -1;
+      if(sz_read == -1)
       {
         fprintf(stderr, "Could not read link %s: %s\n", filename,
                 strerror(errno));
         exit(1);
       }
-      hdr.hdr.linkname[statbuf.st_size] = '\0';
+      /* the link may have changed since the lstat */
+      if(sz_read > statbuf.st_size)
+        sz_read = statbuf.st_size;
+      if((size_t)sz_read >= sizeof(hdr.hdr.linkname))
+        add_pax_record(&records, "linkpath", target, (size_t)sz_read);
+      snprintf(hdr.hdr.linkname, sizeof(hdr.hdr.linkname), "%.*s",
+               (int)sz_read, target);
+      free(target);
       statbuf.st_size = 0; // tar requires zero size for links
     }
     else
@@ -110,6 +191,22 @@ void write_tarfile(int nfiles, char **filenames)
       strcpy(hdr.hdr.linkname, "");
     }
 
+    if(statbuf.st_size > MAX_FILE_SIZE)
+    {
+      add_pax_number(&records, "size", (unsigned long long)statbuf.st_size);
+      statbuf.st_size = 0;
+    }
+    if(statbuf.st_uid > MAX_OCTAL_ID)
+    {
+      add_pax_number(&records, "uid", statbuf.st_uid);
+      statbuf.st_uid = 0;
+    }
+    if(statbuf.st_gid > MAX_OCTAL_ID)
+    {
+      add_pax_number(&records, "gid", statbuf.st_gid);
+      statbuf.st_gid = 0;
+    }
+
     // name is set at the end due to funny handling of long file names
     snprintf(hdr.hdr.mode, sizeof(hdr.hdr.mode), "%0*o",
              (int)sizeof(hdr.hdr.mode)-1, statbuf.st_mode);
@@ -126,8 +223,10 @@ void write_tarfile(int nfiles, char **filenames)
     // link name already set
     strncpy(hdr.hdr.magic, TMAGIC, sizeof(hdr.hdr.magic));
     strncpy(hdr.hdr.version, TVERSION, sizeof(hdr.hdr.version));
-    snprintf(hdr.hdr.uname, sizeof(hdr.hdr.uname), "%s", pwd->pw_name);
-    snprintf(hdr.hdr.gname, sizeof(hdr.hdr.gname), "%s", grp->gr_name);
+    snprintf(hdr.hdr.uname, sizeof(hdr.hdr.uname), "%s",
+             pwd ? pwd->pw_name : "");
+    snprintf(hdr.hdr.gname, sizeof(hdr.hdr.gname), "%s",
+             grp ? grp->gr_name : "");
     snprintf(hdr.hdr.devmajor, sizeof(hdr.hdr.devmajor), "%0*o",
              (int)sizeof(hdr.hdr.devmajor)-1, 0);
     snprintf(hdr.hdr.devminor, sizeof(hdr.hdr.devminor), "%0*o",
@@ -139,30 +238,27 @@ void write_tarfile(int nfiles, char **filenames)
     }
     else
     {
-      const char *p = strchr(filename+strlen(filename)-sizeof(hdr.hdr.name)-1, '/');
-      if(p == NULL)
+      const char *p = strchr(filename+strlen(filename)-sizeof(hdr.hdr.name)+1, '/');
+      if(p != NULL && (size_t)(p-filename) < sizeof(hdr.hdr.prefix))
       {
-        fprintf(stderr, "filename %s too long. Last part must be shorter than %zu characters\n",
-                filename, sizeof(hdr.hdr.name)-1);
-        exit(1);
+        snprintf(hdr.hdr.prefix, sizeof(hdr.hdr.prefix), "%.*s",
+                 (int)(p-filename), filename);
+        snprintf(hdr.hdr.name, sizeof(hdr.hdr.name), "%s", p+1);
       }
-      if((size_t)(p-filename) > sizeof(hdr.hdr.prefix))
+      else
       {
-        fprintf(stderr, "filename %s too long. First part must be shorter than %zu characters\n",
-                filename, sizeof(hdr.hdr.prefix)-1);
-        exit(1);
+        /* readers that ignore the record at least get the last component */
+        const char *last = strrchr(filename, '/');
+        add_pax_record(&records, "path", filename, strlen(filename));
+        snprintf(hdr.hdr.name, sizeof(hdr.hdr.name), "%s",
+                 last ? last+1 : filename);
       }
-      snprintf(hdr.hdr.prefix, sizeof(hdr.hdr.prefix), "%.*s", (int)(p-filename),
-               filename);
-      snprintf(hdr.hdr.name, sizeof(hdr.hdr.name), "%s", p+1);
     }
 
-    checksum = 0;
-    for(size_t j = 0 ; j < sizeof(hdr.block) ; j++)
-      checksum += hdr.block[j];
-    snprintf(hdr.hdr.chksum, sizeof(hdr.hdr.chksum), "%0*lo",
-             (int)sizeof(hdr.hdr.chksum)-1, checksum);
+    set_checksum(&hdr);
 
+    if(records.size > 0)
+      write_pax_header(&hdr, &records);
     fwrite(&hdr.block, BLOCKSIZE, 1, stdout);
 
     if(S_ISREG(statbuf.st_mode))
@@ -195,6 +291,7 @@ void write_tarfile(int nfiles, char **filenames)
       fclose(fh);
     }
   }
+  free(records.data);
 
   memset(buffer, 0, 2*BLOCKSIZE);
   fwrite(buffer, BLOCKSIZE, 2, stdout);
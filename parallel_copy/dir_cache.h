@@ -0,0 +1,299 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <string>
+#include <tr1/unordered_map>
+#include <vector>
+
+// a trie of the directories below a root that have already been created,
+// so that extracting a file costs no mkdir calls for directories seen
+// before. Directories are held open and files are meant to be created with
+// openat() and friends relative to them. Components are opened with
+// O_NOFOLLOW, so a symbolic link in the archive cannot redirect later files
+// outside of the root. At most max_fds directories are kept open, the least
+// recently used ones are closed and re-opened when needed. All members may
+// be called from any thread. The lock only guards the trie, the reference
+// counts and the LRU list, directories are created and opened without it so
+// that a slow file system does not serialize the callers. A directory being
+// opened is marked so that others wait for it instead of opening it again.
+class dir_cache_t
+{
+  public:
+    struct dir_t;
+
+    dir_cache_t(const char* root, size_t max_fds);
+    ~dir_cache_t();
+
+    // returns the directory holding path, creating missing directories, and
+    // stores the last component of path in leaf. Empty and "." components
+    // are ignored. Returns NULL if path contains ".." or names no file. The
+    // directory stays open until it is given back with release().
+    dir_t* parent_of(const std::string& path, std::string& leaf);
+    // like parent_of() but never creates directories, dir is set to NULL if
+    // one of them does not exist. Returns false if path is invalid.
+    bool lookup_parent(const std::string& path, std::string& leaf,
+                       dir_t*& dir);
+    void release(dir_t* dir);
+    static int fd(const dir_t* dir);
+
+    // true if path has a ".." component
+    static bool escapes(const std::string& path);
+  private:
+    dir_cache_t(const dir_cache_t&);
+    dir_cache_t& operator=(const dir_cache_t&);
+
+    typedef std::tr1::unordered_map<std::string, dir_t*> children_t;
+    typedef std::list<dir_t*> lru_t;
+
+    bool find_parent(const std::string& path, std::string& leaf,
+                     bool create, dir_t*& dir);
+    void ref(dir_t* dir);
+    void unref(dir_t* dir);
+    static std::string path_of(const dir_t* dir);
+    static void destroy(dir_t* dir);
+
+    pthread_mutex_t lock;
+    pthread_cond_t opened; // a directory is no longer being opened
+    dir_t* root;
+    size_t max_fds;
+    size_t open_fds;
+    // directories that are open but not in use, least recently used first
+    lru_t lru;
+};
+
+struct dir_cache_t::dir_t
+{
+  std::string name;
+  dir_t* parent;
+  int fd;
+  int refs;         // callers of parent_of() still using it
+  bool created;     // known to exist
+  bool opening;     // somebody is creating or opening it without the lock
+  bool in_lru;
+  lru_t::iterator lru_pos;
+  children_t children;
+};
+
+inline dir_cache_t::dir_cache_t(const char* root_path, size_t max_fds_) :
+  max_fds(max_fds_), open_fds(1)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&opened, NULL);
+  root = new dir_t;
+  root->parent = NULL;
+  root->refs = 1; // never closed
+  root->created = true;
+  root->opening = false;
+  root->in_lru = false;
+  root->name = root_path;
+  root->fd = open(root_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if(root->fd < 0) {
+    std::cerr << "failed to open directory '" << root_path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+inline dir_cache_t::~dir_cache_t()
+{
+  destroy(root);
+  pthread_cond_destroy(&opened);
+  pthread_mutex_destroy(&lock);
+}
+
+inline void dir_cache_t::destroy(dir_t* dir)
+{
+  for(children_t::iterator it = dir->children.begin() ;
+      it != dir->children.end() ; ++it)
+    destroy(it->second);
+  if(dir->fd >= 0)
+    close(dir->fd);
+  delete dir;
+}
+
+inline int dir_cache_t::fd(const dir_t* dir)
+{
+  return dir->fd;
+}
+
+inline bool dir_cache_t::escapes(const std::string& path)
+{
+  for(size_t start = 0 ; start <= path.size() ; ) {
+    size_t slash = path.find('/', start);
+    if(slash == std::string::npos)
+      slash = path.size();
+    if(path.compare(start, slash-start, "..") == 0)
+      return true;
+    start = slash+1;
+  }
+  return false;
+}
+
+inline std::string dir_cache_t::path_of(const dir_t* dir)
+{
+  if(dir->parent == NULL)
+    return dir->name;
+  return path_of(dir->parent) + "/" + dir->name;
+}
+
+// take a reference to an open directory, called with lock held
+inline void dir_cache_t::ref(dir_t* dir)
+{
+  dir->refs += 1;
+  if(dir->in_lru) {
+    lru.erase(dir->lru_pos);
+    dir->in_lru = false;
+  }
+}
+
+// drop a reference, called with lock held
+inline void dir_cache_t::unref(dir_t* dir)
+{
+  dir->refs -= 1;
+  if(dir->refs == 0) {
+    lru.push_back(dir);
+    dir->lru_pos = --lru.end();
+    dir->in_lru = true;
+  }
+  while(open_fds > max_fds && !lru.empty()) {
+    dir_t* victim = lru.front();
+    lru.pop_front();
+    victim->in_lru = false;
+    close(victim->fd);
+    victim->fd = -1;
+    open_fds -= 1;
+  }
+}
+
+inline dir_cache_t::dir_t* dir_cache_t::parent_of(const std::string& path,
+                                                  std::string& leaf)
+{
+  dir_t* dir;
+  return find_parent(path, leaf, true, dir) ? dir : NULL;
+}
+
+inline bool dir_cache_t::lookup_parent(const std::string& path,
+                                       std::string& leaf, dir_t*& dir)
+{
+  return find_parent(path, leaf, false, dir);
+}
+
+inline bool dir_cache_t::find_parent(const std::string& path,
+                                     std::string& leaf, bool create,
+                                     dir_t*& found)
+{
+  if(escapes(path))
+    return false;
+
+  // split off the last non-empty component
+  size_t end = path.size();
+  while(end > 0 && path[end-1] == '/')
+    --end;
+  size_t start = path.rfind('/', end ? end-1 : 0);
+  start = start == std::string::npos ? 0 : start+1;
+  if(end <= start)
+    return false;
+  leaf = path.substr(start, end-start);
+  if(leaf == ".")
+    return false;
+
+  pthread_mutex_lock(&lock);
+  // the directories below the root leading to the parent
+  std::vector<dir_t*> chain;
+  dir_t* dir = root;
+  for(size_t pos = 0 ; pos < start ; ) {
+    size_t slash = path.find('/', pos);
+    const std::string name = path.substr(pos, slash-pos);
+    pos = slash+1;
+    if(name.empty() || name == ".")
+      continue;
+
+    dir_t*& child = dir->children[name];
+    if(child == NULL) {
+      child = new dir_t;
+      child->name = name;
+      child->parent = dir;
+      child->fd = -1;
+      child->refs = 0;
+      child->created = false;
+      child->opening = false;
+      child->in_lru = false;
+    }
+    chain.push_back(child);
+    dir = child;
+  }
+
+  // open the directories from the root down. The one above the next to be
+  // opened is referenced, so that its fd stays valid while the lock is
+  // dropped, and its reference is handed down once the next one is open.
+  dir_t* base = root;
+  ref(base);
+  for(size_t i = 0 ; i < chain.size() ; ) {
+    dir_t* next = chain[i];
+    if(next->fd >= 0) {
+      ref(next);
+      unref(base);
+      base = next;
+      ++i;
+      continue;
+    }
+    if(next->opening) {
+      pthread_cond_wait(&opened, &lock);
+      continue;
+    }
+
+    next->opening = true;
+    const bool exists = next->created;
+    pthread_mutex_unlock(&lock);
+    if(!exists && create && mkdirat(base->fd, next->name.c_str(), 0777) &&
+       errno != EEXIST) {
+      std::cerr << "failed to create directory '" << path_of(next) << "': "
+                << strerror(errno) << std::endl;
+      exit(1);
+    }
+    const int fd = openat(base->fd, next->name.c_str(),
+                          O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    const int err = errno;
+    if(fd < 0 && (create || (err != ENOENT && err != ENOTDIR))) {
+      std::cerr << "failed to open directory '" << path_of(next) << "': "
+                << strerror(err) << std::endl;
+      exit(1);
+    }
+    pthread_mutex_lock(&lock);
+    next->opening = false;
+    pthread_cond_broadcast(&opened);
+    if(fd < 0) {
+      // without create a missing directory means there is nothing to find
+      unref(base);
+      pthread_mutex_unlock(&lock);
+      found = NULL;
+      return true;
+    }
+    next->fd = fd;
+    next->created = true;
+    open_fds += 1;
+  }
+  pthread_mutex_unlock(&lock);
+
+  found = base;
+  return true;
+}
+
+inline void dir_cache_t::release(dir_t* dir)
+{
+  pthread_mutex_lock(&lock);
+  unref(dir);
+  pthread_mutex_unlock(&lock);
+}
+
+#endif // DIR_CACHE_H
@@ -0,0 +1,280 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// An index records the size, modification time and inode of every file of a
+// run of parcp -create, so that the next run can leave out files that did
+// not change. It is a header, an array of fixed size records sorted by name
+// and the names themselves, all integers are little endian:
+//
+//   "PRCI", version (32 bit), number of records (64 bit)
+//   records of INDEX_RECORD_SIZE bytes: offset of the name in the file (64
+//   bit), length of the name (32 bit), nanoseconds of the mtime (32 bit),
+//   seconds of the mtime (64 bit), size (64 bit), inode (64 bit)
+//   the names, without separators
+//
+// Reading an index maps it and binary searches the records, so millions of
+// files cost no memory beyond the pages touched.
+#define INDEX_MAGIC "PRCI"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 16
+#define INDEX_RECORD_SIZE 40
+
+// the state of a file as stored in an index
+struct index_entry_t
+{
+  std::string name;
+  uint64_t size;
+  int64_t mtime_sec;
+  uint32_t mtime_nsec;
+  uint64_t ino;
+
+  index_entry_t(const std::string& fn, const struct stat& statbuf) :
+    name(fn), size(uint64_t(statbuf.st_size)),
+    mtime_sec(int64_t(statbuf.st_mtim.tv_sec)),
+    mtime_nsec(uint32_t(statbuf.st_mtim.tv_nsec)),
+    ino(uint64_t(statbuf.st_ino)) {}
+};
+typedef std::vector<index_entry_t> index_list_t;
+
+static inline uint64_t index_get_le(const char* src, size_t bytes)
+{
+  uint64_t val = 0;
+  for(size_t i = 0 ; i < bytes ; ++i)
+    val |= uint64_t((unsigned char)src[i]) << (8*i);
+  return val;
+}
+
+static inline void index_put_le(char* dst, uint64_t val, size_t bytes)
+{
+  for(size_t i = 0 ; i < bytes ; ++i)
+    dst[i] = char((val >> (8*i)) & 0xff);
+}
+
+// an index written by an earlier run. Besides answering whether a file is
+// unchanged it remembers which files were asked about, the others are gone.
+// unchanged() may be called from any thread.
+class file_index_t
+{
+  public:
+    file_index_t(const char* path);
+    ~file_index_t();
+
+    // true if fn is in the index with the size, modification time and inode
+    // of statbuf, either way fn counts as seen
+    bool unchanged(const std::string& fn, const struct stat& statbuf);
+
+    size_t size() const { return count; };
+    std::string name(size_t i) const;
+    bool seen(size_t i) const { return (seen_bits[i/64] >> (i%64)) & 1; };
+  private:
+    file_index_t(const file_index_t&);
+    file_index_t& operator=(const file_index_t&);
+
+    const char* record(size_t i) const
+    {
+      return map + INDEX_HEADER_SIZE + i*INDEX_RECORD_SIZE;
+    };
+    void corrupt() const;
+
+    std::string path;
+    const char* map;
+    size_t map_size;
+    size_t count;
+    std::vector<uint64_t> seen_bits;
+};
+
+// collects the entries of a new index, each thread adding to its own list
+// without locking, and writes them out sorted once all threads are done
+class index_writer_t
+{
+  public:
+    index_writer_t(const char* path);
+    ~index_writer_t();
+
+    // a list for one thread, owned by the index_writer_t
+    index_list_t* new_list();
+    // writes a temporary file that then replaces path, so path may well be
+    // the index a file_index_t still has mapped
+    void write();
+  private:
+    index_writer_t(const index_writer_t&);
+    index_writer_t& operator=(const index_writer_t&);
+
+    static bool by_name(const index_entry_t* a, const index_entry_t* b)
+    {
+      return a->name < b->name;
+    };
+
+    std::string path;
+    pthread_mutex_t lock;
+    std::vector<index_list_t*> lists;
+};
+
+inline file_index_t::file_index_t(const char* path_) :
+  path(path_), map(NULL), map_size(0), count(0)
+{
+  const int fd = open(path_, O_RDONLY|O_CLOEXEC);
+  struct stat statbuf;
+  if(fd < 0 || fstat(fd, &statbuf)) {
+    std::cerr << "failed to open index '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  map_size = size_t(statbuf.st_size);
+  if(map_size < INDEX_HEADER_SIZE)
+    corrupt();
+  void* addr = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(addr == MAP_FAILED) {
+    std::cerr << "failed to map index '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  close(fd);
+  map = static_cast<const char*>(addr);
+
+  if(memcmp(map, INDEX_MAGIC, 4) != 0 ||
+     index_get_le(map+4, 4) != INDEX_VERSION)
+    corrupt();
+  count = size_t(index_get_le(map+8, 8));
+  if(count > (map_size - INDEX_HEADER_SIZE) / INDEX_RECORD_SIZE)
+    corrupt();
+  seen_bits.resize((count + 63)/64);
+}
+
+inline file_index_t::~file_index_t()
+{
+  if(map)
+    munmap(const_cast<char*>(map), map_size);
+}
+
+inline void file_index_t::corrupt() const
+{
+  std::cerr << "corrupt index '" << path << "'" << std::endl;
+  exit(1);
+}
+
+inline std::string file_index_t::name(size_t i) const
+{
+  const char* rec = record(i);
+  const uint64_t offset = index_get_le(rec, 8);
+  const uint64_t len = index_get_le(rec+8, 4);
+  if(offset > map_size || len > map_size - offset)
+    corrupt();
+  return std::string(map + offset, size_t(len));
+}
+
+inline bool file_index_t::unchanged(const std::string& fn,
+                                    const struct stat& statbuf)
+{
+  size_t lo = 0, hi = count;
+  while(lo < hi) {
+    const size_t mid = lo + (hi - lo)/2;
+    const char* rec = record(mid);
+    const uint64_t offset = index_get_le(rec, 8);
+    const uint64_t len = index_get_le(rec+8, 4);
+    if(offset > map_size || len > map_size - offset)
+      corrupt();
+    // the same order as std::string's operator<, which sorted the records
+    const int cmp = fn.compare(0, fn.size(), map + offset, size_t(len));
+    if(cmp < 0) {
+      hi = mid;
+    } else if(cmp > 0) {
+      lo = mid + 1;
+    } else {
+      __sync_fetch_and_or(&seen_bits[mid/64], uint64_t(1) << (mid%64));
+      return index_get_le(rec+12, 4) == uint64_t(statbuf.st_mtim.tv_nsec) &&
+             int64_t(index_get_le(rec+16, 8)) ==
+               int64_t(statbuf.st_mtim.tv_sec) &&
+             index_get_le(rec+24, 8) == uint64_t(statbuf.st_size) &&
+             index_get_le(rec+32, 8) == uint64_t(statbuf.st_ino);
+    }
+  }
+  return false;
+}
+
+inline index_writer_t::index_writer_t(const char* path_) : path(path_)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+inline index_writer_t::~index_writer_t()
+{
+  for(size_t i = 0 ; i < lists.size() ; ++i)
+    delete lists[i];
+  pthread_mutex_destroy(&lock);
+}
+
+inline index_list_t* index_writer_t::new_list()
+{
+  index_list_t* list = new index_list_t;
+  pthread_mutex_lock(&lock);
+  lists.push_back(list);
+  pthread_mutex_unlock(&lock);
+  return list;
+}
+
+inline void index_writer_t::write()
+{
+  // sort pointers rather than the entries to avoid copying the names
+  std::vector<const index_entry_t*> entries;
+  pthread_mutex_lock(&lock);
+  for(size_t i = 0 ; i < lists.size() ; ++i)
+    for(size_t j = 0 ; j < lists[i]->size() ; ++j)
+      entries.push_back(&(*lists[i])[j]);
+  pthread_mutex_unlock(&lock);
+  std::sort(entries.begin(), entries.end(), by_name);
+
+  const std::string tmp = path + ".tmp";
+  FILE* fh = fopen(tmp.c_str(), "w");
+  if(fh == NULL) {
+    std::cerr << "failed to create index '" << tmp << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  char header[INDEX_HEADER_SIZE];
+  memcpy(header, INDEX_MAGIC, 4);
+  index_put_le(header+4, INDEX_VERSION, 4);
+  index_put_le(header+8, entries.size(), 8);
+  fwrite(header, sizeof(header), 1, fh);
+
+  uint64_t name_offset = INDEX_HEADER_SIZE + entries.size()*INDEX_RECORD_SIZE;
+  for(size_t i = 0 ; i < entries.size() ; ++i) {
+    const index_entry_t& entry = *entries[i];
+    char rec[INDEX_RECORD_SIZE];
+    index_put_le(rec, name_offset, 8);
+    index_put_le(rec+8, entry.name.size(), 4);
+    index_put_le(rec+12, entry.mtime_nsec, 4);
+    index_put_le(rec+16, uint64_t(entry.mtime_sec), 8);
+    index_put_le(rec+24, entry.size, 8);
+    index_put_le(rec+32, entry.ino, 8);
+    fwrite(rec, sizeof(rec), 1, fh);
+    name_offset += entry.name.size();
+  }
+  for(size_t i = 0 ; i < entries.size() ; ++i)
+    fwrite(entries[i]->name.data(), 1, entries[i]->name.size(), fh);
+
+  if(ferror(fh) || fclose(fh) || rename(tmp.c_str(), path.c_str())) {
+    std::cerr << "failed to write index '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+#endif // FILE_INDEX_H
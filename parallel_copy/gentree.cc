@@ -0,0 +1,297 @@
+// generates a synthetic tree of files to benchmark parcp, createtar, puntar
+// and GNU tar on, see bench.sh. The same options and seed always give the
+// same tree.
+//
+// usage: gentree [options] DIR
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+// defaults for the options
+#define NUM_FILES 10000
+#define MIN_SIZE 0
+#define MAX_SIZE (1024*1024)
+#define DEPTH 3
+#define FANOUT 8
+
+// random data the contents of the files are cut from
+#define POOL_SIZE (4*1024*1024)
+
+// the data at either end of a sparse file, the rest is a hole
+#define SPARSE_DATA (64*1024)
+#define MIN_SPARSE_SIZE (1024*1024)
+
+enum dist_t { DIST_UNIFORM, DIST_LOG };
+
+// xorshift64*, small and the same everywhere unlike rand()
+class rng_t
+{
+  public:
+    rng_t(uint64_t seed) : state(seed ? seed : 1) {}
+
+    uint64_t next()
+    {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return state * 0x2545f4914f6cdd1dULL;
+    };
+    // uniform in [0, 1)
+    double uniform() { return double(next() >> 11) / double(1ULL << 53); };
+  private:
+    uint64_t state;
+};
+
+static size_t parse_size(const char* arg, const char* option)
+{
+  char* end;
+  const unsigned long long val = strtoull(arg, &end, 10);
+  size_t unit = 1;
+  switch(*end) {
+    case 'k': case 'K': unit = 1024; ++end; break;
+    case 'm': case 'M': unit = 1024*1024; ++end; break;
+    case 'g': case 'G': unit = 1024*1024*1024; ++end; break;
+    default: break;
+  }
+  if(end == arg || *end != '\0') {
+    std::cerr << "invalid size '" << arg << "' for option -" << option
+              << std::endl;
+    exit(1);
+  }
+  return size_t(val) * unit;
+}
+
+static int parse_count(const char* arg, const char* option, long min_val)
+{
+  char* end;
+  const long val = strtol(arg, &end, 10);
+  if(end == arg || *end != '\0' || val < min_val || val > 100000000) {
+    std::cerr << "invalid count '" << arg << "' for option -" << option
+              << std::endl;
+    exit(1);
+  }
+  return int(val);
+}
+
+static void make_dir(const std::string& dn)
+{
+  if(mkdir(dn.c_str(), 0777) && errno != EEXIST) {
+    std::cerr << "failed to create directory '" << dn << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+static void write_at(int fd, const std::string& fn, const char* buf,
+                     size_t sz, off_t offset)
+{
+  while(sz > 0) {
+    const ssize_t written = pwrite(fd, buf, sz, offset);
+    if(written < 0) {
+      if(errno == EINTR)
+        continue;
+      std::cerr << "failed to write to '" << fn << "': " << strerror(errno)
+                << std::endl;
+      exit(1);
+    }
+    buf += written;
+    sz -= size_t(written);
+    offset += written;
+  }
+}
+
+// writes size bytes cut from pool at a random place, or only the first and
+// last SPARSE_DATA bytes of them if sparse
+static void make_file(const std::string& fn, size_t size, bool sparse,
+                      const std::vector<char>& pool, rng_t& rng)
+{
+  const int fd = open(fn.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if(fd < 0) {
+    std::cerr << "failed to create '" << fn << "': " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+  size_t pos = size_t(rng.next() % pool.size());
+  for(size_t offset = 0 ; offset < size ; ) {
+    if(sparse && offset == SPARSE_DATA)
+      offset = std::max(offset, size - SPARSE_DATA);
+    size_t sz = std::min(size - offset, pool.size() - pos);
+    if(sparse && offset < SPARSE_DATA)
+      sz = std::min(sz, SPARSE_DATA - offset);
+    write_at(fd, fn, &pool[pos], sz, off_t(offset));
+    offset += sz;
+    pos = (pos + sz) % pool.size();
+  }
+  if(sparse && ftruncate(fd, off_t(size))) {
+    std::cerr << "failed to set the size of '" << fn << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  if(close(fd)) {
+    std::cerr << "failed to write to '" << fn << "': " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+}
+
+static void usage(const char* argv0)
+{
+  std::cerr << "usage: " << argv0 << " [options] DIR\n"
+            << "creates a tree of files with random contents below DIR\n"
+            << "  -files N         number of files (default " << NUM_FILES
+            << ")\n"
+            << "  -min-size SIZE   smallest file (default " << MIN_SIZE
+            << ")\n"
+            << "  -max-size SIZE   largest file (default " << MAX_SIZE
+            << ")\n"
+            << "  -dist D          uniform: sizes spread evenly between the "
+               "limits\n"
+            << "                   log: evenly on a log scale, mostly small "
+               "files (default)\n"
+            << "  -depth N         levels of directories below DIR (default "
+            << DEPTH << ")\n"
+            << "  -fanout N        subdirectories per directory (default "
+            << FANOUT << ")\n"
+            << "  -sparse PERCENT  share of files that are sparse, at least "
+            << MIN_SPARSE_SIZE << " bytes\n"
+            << "                   with data only at either end (default 0)\n"
+            << "  -seed N          seed of the random numbers (default 1)\n"
+            << "SIZE accepts K, M and G suffixes" << std::endl;
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  enum { OPT_FILES = 256, OPT_MIN_SIZE, OPT_MAX_SIZE, OPT_DIST, OPT_DEPTH,
+         OPT_FANOUT, OPT_SPARSE, OPT_SEED };
+  static const struct option longopts[] = {
+    {"files", required_argument, NULL, OPT_FILES},
+    {"min-size", required_argument, NULL, OPT_MIN_SIZE},
+    {"max-size", required_argument, NULL, OPT_MAX_SIZE},
+    {"dist", required_argument, NULL, OPT_DIST},
+    {"depth", required_argument, NULL, OPT_DEPTH},
+    {"fanout", required_argument, NULL, OPT_FANOUT},
+    {"sparse", required_argument, NULL, OPT_SPARSE},
+    {"seed", required_argument, NULL, OPT_SEED},
+    {NULL, 0, NULL, 0}
+  };
+  int num_files = NUM_FILES;
+  size_t min_size = MIN_SIZE, max_size = MAX_SIZE;
+  dist_t dist = DIST_LOG;
+  int depth = DEPTH, fanout = FANOUT, sparse_percent = 0;
+  uint64_t seed = 1;
+
+  int opt;
+  while((opt = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+    switch(opt) {
+      case OPT_FILES:
+        num_files = parse_count(optarg, "files", 0);
+        break;
+      case OPT_MIN_SIZE:
+        min_size = parse_size(optarg, "min-size");
+        break;
+      case OPT_MAX_SIZE:
+        max_size = parse_size(optarg, "max-size");
+        break;
+      case OPT_DIST:
+        if(strcmp(optarg, "uniform") == 0) {
+          dist = DIST_UNIFORM;
+        } else if(strcmp(optarg, "log") == 0) {
+          dist = DIST_LOG;
+        } else {
+          std::cerr << "unknown distribution '" << optarg << "'" << std::endl;
+          exit(1);
+        }
+        break;
+      case OPT_DEPTH:
+        depth = parse_count(optarg, "depth", 0);
+        break;
+      case OPT_FANOUT:
+        fanout = parse_count(optarg, "fanout", 1);
+        break;
+      case OPT_SPARSE:
+        sparse_percent = parse_count(optarg, "sparse", 0);
+        if(sparse_percent > 100)
+          usage(argv[0]);
+        break;
+      case OPT_SEED:
+        seed = uint64_t(parse_count(optarg, "seed", 0));
+        break;
+      default:
+        usage(argv[0]);
+        break;
+    }
+  }
+  if(argc - optind != 1 || min_size > max_size)
+    usage(argv[0]);
+
+  // all directories, parents before their children
+  std::vector<std::string> dirs(1, argv[optind]);
+  make_dir(dirs[0]);
+  size_t level_start = 0;
+  for(int level = 0 ; level < depth ; ++level) {
+    const size_t level_end = dirs.size();
+    for(size_t i = level_start ; i < level_end ; ++i) {
+      for(int j = 0 ; j < fanout ; ++j) {
+        char name[32];
+        snprintf(name, sizeof(name), "/d%02d", j);
+        dirs.push_back(dirs[i] + name);
+        make_dir(dirs.back());
+      }
+    }
+    level_start = level_end;
+  }
+
+  rng_t rng(seed);
+  std::vector<char> pool(POOL_SIZE);
+  for(size_t i = 0 ; i < pool.size() ; i += 8) {
+    const uint64_t val = rng.next();
+    memcpy(&pool[i], &val, 8);
+  }
+
+  // files are dealt out to the directories in turn
+  uint64_t total_bytes = 0;
+  int num_sparse = 0;
+  for(int i = 0 ; i < num_files ; ++i) {
+    const double u = rng.uniform();
+    size_t size;
+    if(dist == DIST_UNIFORM) {
+      size = min_size + size_t(u * double(max_size - min_size + 1));
+    } else {
+      // log(0) is not defined, so sizes are spread over [min+1, max+1)
+      const double lo = std::log(double(min_size + 1));
+      const double hi = std::log(double(max_size + 1));
+      size = size_t(std::exp(lo + u*(hi - lo))) - 1;
+    }
+    size = std::min(std::max(size, min_size), max_size);
+    const bool sparse = int(rng.next() % 100) < sparse_percent;
+    if(sparse) {
+      size = std::max(size, size_t(MIN_SPARSE_SIZE));
+      num_sparse += 1;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/f%07d", i);
+    make_file(dirs[size_t(i) % dirs.size()] + name, size, sparse, pool, rng);
+    total_bytes += size;
+  }
+
+  std::cout << num_files << " files (" << num_sparse << " sparse), "
+            << total_bytes << " bytes in " << dirs.size() << " directories"
+            << std::endl;
+  return 0;
+}
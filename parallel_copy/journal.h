@@ -0,0 +1,165 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <tr1/unordered_map>
+
+// an append-only record of the files a receiver has finished, read back as
+// a manifest_t by a sender that resumes the transfer. Each line is either
+// "C SIZE MTIME NAME" for a file that was written completely or "F NAME" for
+// one that has to be sent again, a later line for a name overrides earlier
+// ones. Every line is appended with a single write() to a file opened with
+// O_APPEND, so several threads may add to the journal and a receiver killed
+// at any point leaves at most a partial last line, which is ignored. Names
+// containing a newline are never recorded, such files are always sent again.
+class journal_t
+{
+  public:
+    journal_t(const char* path);
+    ~journal_t();
+
+    void complete(const std::string& fn, uint64_t size, int64_t mtime);
+    void failed(const std::string& fn);
+  private:
+    journal_t(const journal_t&);
+    journal_t& operator=(const journal_t&);
+
+    void append(const std::string& line);
+
+    std::string path;
+    int fd;
+};
+
+// the files recorded as complete in a journal_t
+class manifest_t
+{
+  public:
+    manifest_t(const char* path);
+
+    // true if fn is recorded with the size and modification time of statbuf
+    bool complete(const std::string& fn, const struct stat& statbuf) const;
+    size_t size() const { return entries.size(); };
+  private:
+    manifest_t(const manifest_t&);
+    manifest_t& operator=(const manifest_t&);
+
+    struct entry_t
+    {
+      uint64_t size;
+      int64_t mtime;
+    };
+    typedef std::tr1::unordered_map<std::string, entry_t> entries_t;
+
+    entries_t entries;
+};
+
+inline journal_t::journal_t(const char* path_) :
+  path(path_), fd(open(path_, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0666))
+{
+  if(fd < 0) {
+    std::cerr << "failed to open journal '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  // terminate a line left partial by an earlier receiver so that it does not
+  // run into the first line appended now
+  const off_t end = lseek(fd, 0, SEEK_END);
+  char last = '\n';
+  if(end > 0 && pread(fd, &last, 1, end-1) == 1 && last != '\n')
+    append("");
+}
+
+inline journal_t::~journal_t()
+{
+  if(close(fd)) {
+    std::cerr << "failed to write journal '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+inline void journal_t::complete(const std::string& fn, uint64_t size,
+                                int64_t mtime)
+{
+  if(fn.find('\n') != std::string::npos)
+    return;
+  char buf[64];
+  snprintf(buf, sizeof(buf), "C %llu %lld ", (unsigned long long)size,
+           (long long)mtime);
+  append(buf + fn);
+}
+
+inline void journal_t::failed(const std::string& fn)
+{
+  if(fn.find('\n') != std::string::npos)
+    return;
+  append("F " + fn);
+}
+
+inline void journal_t::append(const std::string& line)
+{
+  const std::string buf = line + "\n";
+  const ssize_t sz = write(fd, buf.data(), buf.size());
+  if(sz != ssize_t(buf.size())) {
+    std::cerr << "failed to write journal '" << path << "': "
+              << (sz < 0 ? strerror(errno) : "short write") << std::endl;
+    exit(1);
+  }
+}
+
+inline manifest_t::manifest_t(const char* path)
+{
+  std::ifstream in(path);
+  if(!in) {
+    std::cerr << "failed to open manifest '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  // anything else, such as a line cut short by a receiver that was killed
+  // and terminated by the next one, is skipped
+  std::string line;
+  while(std::getline(in, line)) {
+    // the last line is partial if the receiver is still running
+    if(in.eof())
+      break;
+    if(line.compare(0, 2, "F ") == 0) {
+      entries.erase(line.substr(2));
+    } else if(line.compare(0, 2, "C ") == 0) {
+      const char* p = line.c_str() + 2;
+      char* end;
+      entry_t entry;
+      entry.size = strtoull(p, &end, 10);
+      if(end == p || *end != ' ')
+        continue;
+      p = end + 1;
+      entry.mtime = strtoll(p, &end, 10);
+      if(end == p || *end != ' ')
+        continue;
+      entries[std::string(end + 1)] = entry;
+    }
+  }
+}
+
+inline bool manifest_t::complete(const std::string& fn,
+                                 const struct stat& statbuf) const
+{
+  entries_t::const_iterator it = entries.find(fn);
+  return it != entries.end() &&
+         it->second.size == uint64_t(statbuf.st_size) &&
+         it->second.mtime == int64_t(statbuf.st_mtime);
+}
+
+#endif // JOURNAL_H
@@ -0,0 +1,148 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstddef>
+
+// a bounded multi-producer single-consumer queue. Producers claim a slot by
+// advancing head with a compare-and-swap and publish it by bumping the slot's
+// sequence number, the single consumer reads slots in order. No locks are
+// taken and no memory is allocated after construction. The consumer spins
+// briefly when the queue is empty and then parks on a futex which producers
+// only wake if the consumer announced that it is asleep.
+//
+// The queue is sized so that pushing never finds it full in parcp, since each
+// thread owns a fixed number of packets. Should it be full nonetheless
+// producers yield until a slot frees up.
+template<class T>
+class mpsc_queue_t
+{
+  public:
+    mpsc_queue_t(size_t min_capacity);
+    ~mpsc_queue_t();
+
+    void push(const T& value);
+    T pop();
+    bool try_pop(T& value);
+    // values queued, exact for the consumer and a snapshot for anyone else
+    size_t size() const
+    {
+      const size_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+      return __atomic_load_n(&head, __ATOMIC_RELAXED) - t;
+    };
+  private:
+    mpsc_queue_t(const mpsc_queue_t&);
+    mpsc_queue_t& operator=(const mpsc_queue_t&);
+
+    struct cell_t {
+      size_t seq;
+      T value;
+    };
+
+    enum { SPIN_COUNT = 100 };
+    enum { CACHELINE = 64 };
+
+    cell_t* cells;
+    size_t mask;
+    char pad0[CACHELINE];
+    size_t head; // next slot to be claimed by a producer
+    char pad1[CACHELINE];
+    size_t tail; // next slot to be read by the consumer
+    int sleeping; // futex word, 1 if the consumer is (about to be) parked
+    char pad2[CACHELINE];
+};
+
+template<class T>
+mpsc_queue_t<T>::mpsc_queue_t(size_t min_capacity) : head(0), tail(0), sleeping(0)
+{
+  size_t capacity = 2;
+  while(capacity < min_capacity)
+    capacity *= 2;
+  mask = capacity - 1;
+  cells = new cell_t[capacity];
+  for(size_t i = 0 ; i < capacity ; ++i)
+    cells[i].seq = i;
+}
+
+template<class T>
+mpsc_queue_t<T>::~mpsc_queue_t()
+{
+  delete[] cells;
+}
+
+// enqueue a value, waking the consumer if it is parked
+template<class T>
+void mpsc_queue_t<T>::push(const T& value)
+{
+  size_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  cell_t* cell;
+  while(true) {
+    cell = &cells[pos & mask];
+    const size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    const ptrdiff_t dif = ptrdiff_t(seq) - ptrdiff_t(pos);
+    if(dif == 0) {
+      if(__atomic_compare_exchange_n(&head, &pos, pos+1, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if(dif < 0) { // full
+      sched_yield();
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    }
+  }
+  cell->value = value;
+  __atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+
+  // pairs with the fence in pop(): either the consumer sees our value or we
+  // see that it is sleeping
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&sleeping, __ATOMIC_RELAXED) &&
+     __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED)) {
+    syscall(SYS_futex, &sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+// dequeue the oldest value if there is one, never blocks
+template<class T>
+bool mpsc_queue_t<T>::try_pop(T& value)
+{
+  cell_t* cell = &cells[tail & mask];
+  const size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+  if(seq != tail+1)
+    return false;
+  value = cell->value;
+  __atomic_store_n(&cell->seq, tail+mask+1, __ATOMIC_RELEASE);
+  tail += 1;
+  return true;
+}
+
+// dequeue the oldest value, block if none is available
+template<class T>
+T mpsc_queue_t<T>::pop()
+{
+  T value;
+  while(true) {
+    for(int i = 0 ; i < SPIN_COUNT ; ++i) {
+      if(try_pop(value))
+        return value;
+    }
+
+    __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(try_pop(value)) {
+      __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+      return value;
+    }
+    // returns immediately if a producer already cleared sleeping
+    syscall(SYS_futex, &sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+  }
+}
+
+#endif // MPSC_QUEUE_H
@@ -1,26 +1,185 @@
 #include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <grp.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/fs.h>
+
+#include <stdint.h>
+#include <zlib.h>
 
 #include <cstdio>
 #include <queue>
-#include <string>
+#include <deque>
 #include <map>
+#include <string>
+#include <tr1/unordered_map>
 #include <cstring>
 #include <cerrno>
 #include <cassert>
 #include <cstdlib>
 #include <vector>
 #include <iostream>
+#include <algorithm>
+
+#include "buffer_pool.h"
+#include "crc32c.h"
+#include "dir_cache.h"
+#include "file_index.h"
+#include "journal.h"
+#include "mpsc_queue.h"
+#include "stats.h"
+#include "tar_index.h"
+#include "tree_walker.h"
+#include "uring.h"
+#include "write_behind.h"
 
+// defaults for the runtime options
 #define NUM_THREADS 4
 #define NUM_PACKETS 10
 #define CHUNK_SIZE 80000
+#define MAX_THREADS 256
+#define URING_DEPTH 32
+#define WRITE_SIZE (4*1024*1024)
+#define REORDER_MEMORY (256*1024*1024)
+#define NUM_WRITERS 4
+#define NUM_WALKERS 4
+#define SPLIT_SIZE (1024*1024*1024)
+
+// most directories the receiver keeps open, see dir_cache_t
+#define MAX_DIR_FDS 1024
+
+// packet buffers are at least this large so that they can hold file names
+// and tar headers even for tiny chunk sizes
+#define MIN_PACKET_BUFFER (64*1024)
+
+// bytes moved per copy_file_range call by -copy
+#define COPY_CHUNK (64*1024*1024)
+
+// how often the master re-evaluates the number of workers in auto-tune mode
+#define TUNE_INTERVAL 0.25
+
+enum engine_t { ENGINE_THREADS, ENGINE_URING };
+
+struct options_t
+{
+  engine_t engine;      // how workers read files
+  int uring_depth;      // files in flight per worker for ENGINE_URING
+  int num_threads;      // number of worker threads to start with
+  int max_threads;      // upper limit on the number of workers for auto-tune
+  int num_packets;      // packets owned by each worker
+  size_t chunk_size;    // maximum payload of a DATA packet
+  size_t memory_budget; // if non-zero, caps the bytes in flight
+  bool auto_tune;       // grow the number of workers while they wait for I/O
+  size_t write_size;    // bytes -tar collects before writing them out
+  bool writer_thread;   // -tar writes from a separate thread
+  bool stream_tar;      // -tar writes sequentially even to a seekable file
+  int num_writers;      // threads creating files for -extract
+  bool numeric_owner;   // store no user and group names in tar headers
+  int num_walkers;      // threads listing directories given to -create
+  size_t split_size;    // files larger than this are read in ranges, 0: never
+  int compress_level;   // zlib level for DATA packets of -create, 0: none
+  bool checksum;        // -create follows each file with a CSUM packet
+};
+
+static options_t options = {
+  ENGINE_THREADS, URING_DEPTH, NUM_THREADS, MAX_THREADS, NUM_PACKETS, CHUNK_SIZE, 0, false,
+  WRITE_SIZE, false, false, NUM_WRITERS, false, NUM_WALKERS, SPLIT_SIZE, 0, true
+};
+
+// directories given on the command line of -create and -create-tar and the
+// find-like filters applied while walking them
+static std::vector<std::string> walk_roots;
+static std::vector<std::string> walk_includes;
+static std::vector<std::string> walk_excludes;
+
+// nanoseconds all workers together spent waiting in stat, open and read,
+// used to steer auto-tuning
+static uint64_t worker_io_ns = 0;
+
+// counters and latencies of the sender's threads for -progress and -stats,
+// NULL without them. Each thread registers itself and keeps its own
+// thread_stats_t, which also tracks the depth of the port the thread owns.
+// Threads that did not register, such as the receiver's, record nothing.
+// The registry is never freed as the workers record until the process exits.
+static stats_registry_t* run_stats = NULL;
+static __thread thread_stats_t* my_stats = NULL;
+
+static void register_thread(const char* role)
+{
+  if(run_stats)
+    my_stats = run_stats->add_thread(role);
+}
+
+static void record_op(stats_op_t op, uint64_t start_ns, uint64_t bytes = 0)
+{
+  if(my_stats)
+    my_stats->ops[op].record(stats_now_ns() - start_ns, bytes);
+}
+
+static void record_file()
+{
+  if(my_stats)
+    stats_add(my_stats->files, 1);
+}
+
+// only the thread owning a port pulls from it
+static void record_depth(size_t queued)
+{
+  if(my_stats)
+    my_stats->queue.record(queued);
+}
+
+// the tar file written by -create-tar, -1 if a stream is written to stdout
+static int tar_fd = -1;
+
+// the destination directory of -copy, NULL for the other modes, and the
+// source whose files are copied into it
+static dir_cache_t* copy_dirs = NULL;
+static std::string copy_src;
+
+// files -create leaves out because an earlier receiver finished them, NULL
+// without -skip-manifest
+static const manifest_t* skip_manifest = NULL;
+
+// where -extract records the files it finished, NULL without -journal
+static journal_t* journal = NULL;
+
+// the index of the previous run for -since and the one -write-index collects
+// for the next, NULL without the options
+static file_index_t* since_index = NULL;
+static index_writer_t* new_index = NULL;
+
+// where -tar and -create-tar record the offsets of the members they write,
+// NULL without -tar-index
+static tar_index_writer_t* tar_index = NULL;
+
+// A stream starts with a preamble of STREAM_MAGIC followed by the format
+// version as a 32 bit little endian integer. Each packet then consists of a
+// serialized_packet_t header followed by size bytes of payload. All integers
+// are fixed width little endian.
+#define STREAM_MAGIC "PRCP"
+#define STREAM_VERSION 1
 
 struct serialized_packet_t
+{
+  char type[4];   // fourcc of packet
+  char flags[4];  // FLAG_* bits, all others must be zero
+  char fid[8];    // the unique ID for the file during the run
+  char offset[8]; // offset of the payload in the file
+  char size[8];   // size in bytes excluding header
+  // payload
+};
+
+// the header used by streams written before STREAM_MAGIC was introduced,
+// only ever read
+struct legacy_packet_t
 {
   char type[4];  // fourcc of packet
   char fid[8];   // the unique ID for the file during the run
@@ -29,85 +188,637 @@ struct serialized_packet_t
   // payload
 };
 
+// the payload of a DATA packet is the size of the data as a 64 bit little
+// endian integer followed by the data compressed with zlib, the offset and
+// the EOF convention refer to the uncompressed data
+#define FLAG_COMPRESSED 1
+
 #define TYPE_DATA "DATA"
 #define TYPE_FILE "FILE"
 #define TYPE_WORK "WORK"
 #define TYPE_STAT "STAT"
 #define TYPE_ACK "ACK "
+// follows the zero sized DATA packet of a regular file, see file_digest_t.
+// Its offset is the size of the file like that of the DATA packet.
+#define TYPE_CSUM "CSUM"
+// names a file of the -since index that is gone, its payload is the name.
+// These follow all files and have ids of their own.
+#define TYPE_DELETE "DELE"
+// internal to parcp -create, never written to a stream: the controller asks a
+// worker to read a range of a large file with RANG, the worker reports the
+// range complete with DONE. A worker answers FILE with SKIP instead of STAT
+// if the file is complete in the -skip-manifest or unchanged since the -since
+// index.
+#define TYPE_RANGE "RANG"
+#define TYPE_DONE "DONE"
+#define TYPE_SKIP "SKIP"
 
 class packet_t;
 
 // a message port that accepts packets
 // pushing a packet enqueues it to the port's list of avaialable packets
 // pulling removes the oldest from the list, it blocks if no package is
-// available
+// available. Any thread may push but only the thread owning the port may
+// pull. capacity must be at least the number of packets that can be queued
+// at the port at any one time.
 class port_t
 {
   public:
-    port_t();
-    ~port_t();
+    port_t(size_t capacity) : packets(capacity) {};
 
-    void push_packet(packet_t* packet);
-    packet_t* pull_packet();
+    void push_packet(packet_t* packet) { packets.push(packet); };
+    packet_t* pull_packet()
+    {
+      record_depth(packets.size());
+      return packets.pop();
+    };
+    // like pull_packet but returns NULL instead of blocking
+    packet_t* try_pull_packet()
+    {
+      const size_t queued = packets.size();
+      packet_t* packet;
+      if(!packets.try_pop(packet))
+        return NULL;
+      record_depth(queued);
+      return packet;
+    };
   private:
     port_t(const port_t&);
     port_t& operator=(const port_t&);
 
-    pthread_mutex_t lock;
-    pthread_cond_t wait;
+    mpsc_queue_t<packet_t*> packets;
+};
+
+// TODO: turn into class with serialize member and reply member
+struct packet_t
+{
+  port_t* reply_port;
+  char type[4];
+  uint32_t flags; // as in the stream
+  uint32_t crc;   // of a DATA packet read by decompressing_reader_t
+  size_t size;
+  uint64_t fid;
+  uint64_t offset;
+  buffer_pool_t* pool;
+  buffer_t buf; // the payload, checked out of pool
+
+  packet_t(port_t* rp, buffer_pool_t* pl) :
+    reply_port(rp), flags(0), crc(0), size(0), fid(0), offset(0), pool(pl),
+    buf(pl->get())
+  { memcpy(type, TYPE_ACK, sizeof(type)); };
+  ~packet_t() { pool->put(buf); };
+
+  // make room for a payload of sz bytes, the current payload is lost
+  void reserve(size_t sz)
+  {
+    if(sz > buf.capacity) {
+      pool->put(buf);
+      buf = pool->get(sz);
+    }
+  };
+  private:
+    packet_t(const packet_t&);
+    packet_t& operator=(const packet_t&);
+};
+
+// the buffers of all packets used by sender() and its workers
+static buffer_pool_t* packet_pool = NULL;
+
+static void put_le32(char *dst, uint32_t val)
+{
+  for(size_t i = 0 ; i < 4 ; ++i)
+    dst[i] = char((val >> (8*i)) & 0xff);
+}
+
+static void put_le64(char *dst, uint64_t val)
+{
+  for(size_t i = 0 ; i < 8 ; ++i)
+    dst[i] = char((val >> (8*i)) & 0xff);
+}
+
+static uint32_t get_le32(const char *src)
+{
+  uint32_t val = 0;
+  for(size_t i = 0 ; i < 4 ; ++i)
+    val |= uint32_t((unsigned char)src[i]) << (8*i);
+  return val;
+}
+
+static uint64_t get_le64(const char *src)
+{
+  uint64_t val = 0;
+  for(size_t i = 0 ; i < 8 ; ++i)
+    val |= uint64_t((unsigned char)src[i]) << (8*i);
+  return val;
+}
+
+// writes packets to a stream, starting with the stream preamble
+class stream_writer_t
+{
+  public:
+    stream_writer_t(FILE* fh);
 
-    std::queue<packet_t*> packets;
+    void write_packet(const char type[4], uint64_t fid, uint64_t offset,
+                      const char* data, size_t size, uint32_t flags = 0);
+  private:
+    stream_writer_t(const stream_writer_t&);
+    stream_writer_t& operator=(const stream_writer_t&);
+
+    void write(const void* data, size_t size);
+
+    FILE* fh;
 };
 
-port_t::port_t()
+stream_writer_t::stream_writer_t(FILE* fh_) : fh(fh_)
 {
-  pthread_mutex_init(&lock, NULL);
-  pthread_cond_init(&wait, NULL);
+  char preamble[8];
+  memcpy(preamble, STREAM_MAGIC, 4);
+  put_le32(preamble+4, STREAM_VERSION);
+  write(preamble, sizeof(preamble));
 }
 
-port_t::~port_t()
+void stream_writer_t::write(const void* data, size_t size)
 {
-  pthread_cond_destroy(&wait);
-  pthread_mutex_destroy(&lock);
+  const uint64_t start = stats_now_ns();
+  if(size > 0 && fwrite(data, 1, size, fh) != size) {
+    std::cerr << "failed to write " << size << " bytes to stream: "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  record_op(OP_WRITE, start, size);
 }
 
-// enqueue a new packet, signalling possible waiting threads that there is a
-// package
-void port_t::push_packet(packet_t* packet)
+void stream_writer_t::write_packet(const char type[4], uint64_t fid,
+                                   uint64_t offset, const char* data,
+                                   size_t size, uint32_t flags)
 {
-  pthread_mutex_lock(&lock);
-  packets.push(packet);
-  pthread_cond_signal(&wait);
-  pthread_mutex_unlock(&lock);
+  serialized_packet_t ser_packet;
+  memcpy(ser_packet.type, type, sizeof(ser_packet.type));
+  put_le32(ser_packet.flags, flags);
+  put_le64(ser_packet.fid, fid);
+  put_le64(ser_packet.offset, offset);
+  put_le64(ser_packet.size, size);
+  write(&ser_packet, sizeof(ser_packet));
+  write(data, size);
 }
 
-// obtain a packet from the port, block if none is available
-packet_t* port_t::pull_packet()
+// reads packets from a stream. Both the binary format and the legacy ASCII
+// format are accepted, which one is used is decided from the first bytes of
+// the stream.
+class stream_reader_t
 {
-  packet_t* retval;
+  public:
+    stream_reader_t(FILE* fh);
 
-  pthread_mutex_lock(&lock);
-  while(packets.empty())
-    pthread_cond_wait(&wait, &lock);
-  retval = packets.front();
-  packets.pop();
-  pthread_mutex_unlock(&lock);
+    // reads the next packet header and its payload into packet, returns
+    // false at the end of the stream
+    bool read_packet(packet_t* packet);
+  private:
+    stream_reader_t(const stream_reader_t&);
+    stream_reader_t& operator=(const stream_reader_t&);
+
+    bool read_header(char type[4], uint32_t& flags, uint64_t& fid,
+                     uint64_t& offset, uint64_t& size);
+
+    FILE* fh;
+    bool started;
+    bool legacy;
+    // byte offset in the file of the next legacy DATA packet by fid
+    std::tr1::unordered_map<uint64_t, uint64_t> legacy_offsets;
+};
 
-  return retval;
+stream_reader_t::stream_reader_t(FILE* fh_) :
+  fh(fh_), started(false), legacy(false)
+{
 }
 
-// TODO: turn into class with serialize member and reply member
-struct packet_t
+bool stream_reader_t::read_header(char type[4], uint32_t& flags,
+                                  uint64_t& fid, uint64_t& offset,
+                                  uint64_t& size)
 {
-  port_t* reply_port;
-  char type[4];
-  int size;
-  char fid[8];
-  std::vector<char> data;
+  char fourcc[4];
+  if(fread(fourcc, sizeof(fourcc), 1, fh) != 1)
+    return false;
+
+  if(!started) {
+    started = true;
+    if(memcmp(fourcc, STREAM_MAGIC, sizeof(fourcc)) == 0) {
+      char version[4];
+      if(fread(version, sizeof(version), 1, fh) != 1) {
+        std::cerr << "truncated stream preamble" << std::endl;
+        exit(1);
+      }
+      if(get_le32(version) != STREAM_VERSION) {
+        std::cerr << "unsupported stream version " << get_le32(version)
+                  << std::endl;
+        exit(1);
+      }
+      if(fread(fourcc, sizeof(fourcc), 1, fh) != 1)
+        return false;
+    } else {
+      legacy = true;
+    }
+  }
+
+  if(legacy) {
+    legacy_packet_t ser_packet;
+    memcpy(ser_packet.type, fourcc, sizeof(fourcc));
+    if(fread(ser_packet.fid, sizeof(ser_packet)-sizeof(fourcc), 1, fh) != 1) {
+      std::cerr << "truncated packet header" << std::endl;
+      exit(1);
+    }
+    char fidbuf[sizeof(ser_packet.fid)+1];
+    memcpy(fidbuf, ser_packet.fid, sizeof(ser_packet.fid));
+    fidbuf[sizeof(ser_packet.fid)] = '\0';
+    char sizebuf[sizeof(ser_packet.size)+1];
+    memcpy(sizebuf, ser_packet.size, sizeof(ser_packet.size));
+    sizebuf[sizeof(ser_packet.size)] = '\0';
+
+    memcpy(type, ser_packet.type, sizeof(ser_packet.type));
+    flags = 0;
+    fid = strtoull(fidbuf, NULL, 10);
+    size = strtoull(sizebuf, NULL, 10);
+    // legacy DATA packets are sequential in the file
+    offset = 0;
+    if(strncmp(type, TYPE_DATA, sizeof(ser_packet.type)) == 0) {
+      uint64_t& next = legacy_offsets[fid];
+      offset = next;
+      next += size;
+      if(size == 0)
+        legacy_offsets.erase(fid);
+    }
+  } else {
+    serialized_packet_t ser_packet;
+    memcpy(ser_packet.type, fourcc, sizeof(fourcc));
+    if(fread(ser_packet.flags, sizeof(ser_packet)-sizeof(fourcc), 1, fh) != 1) {
+      std::cerr << "truncated packet header" << std::endl;
+      exit(1);
+    }
+    memcpy(type, ser_packet.type, sizeof(ser_packet.type));
+    flags = get_le32(ser_packet.flags);
+    if((flags & ~uint32_t(FLAG_COMPRESSED)) != 0 ||
+       (flags != 0 && strncmp(type, TYPE_DATA, sizeof(ser_packet.type)) != 0)) {
+      std::cerr << "unsupported packet flags " << flags << std::endl;
+      exit(1);
+    }
+
+    fid = get_le64(ser_packet.fid);
+    offset = get_le64(ser_packet.offset);
+    size = get_le64(ser_packet.size);
+  }
+
+  return true;
+}
+
+bool stream_reader_t::read_packet(packet_t* packet)
+{
+  uint64_t size;
+  if(!read_header(packet->type, packet->flags, packet->fid, packet->offset,
+                  size)) {
+    if(ferror(fh)) {
+      std::cerr << "failed to read from stdin: " << strerror(errno)
+                << std::endl;
+      exit(1);
+    }
+    return false;
+  }
+
+  packet->reserve(size);
+  packet->size = size;
+  const size_t sz = size ? fread(packet->buf.data, 1, size, fh) : 0;
+  if(sz != size || ferror(fh)) {
+    std::cerr << "failed to read " << size
+              << " bytes from stdin (only " << sz << " read): "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  return true;
+}
+
+// the checksum of the uncompressed DATA packet at offset, the CRC32C of the
+// offset as a 64 bit little endian integer followed by the data
+static uint32_t packet_checksum(uint64_t offset, const char* data, size_t size)
+{
+  char le_offset[8];
+  put_le64(le_offset, offset);
+  return crc32c(crc32c(0, le_offset, sizeof(le_offset)), data, size);
+}
+
+// the payload of a CSUM packet: the number of bytes in the DATA packets of a
+// file and the sum of their packet_checksum(), leaving out the zero sized
+// one, both as 64 bit little endian integers. The sum does not depend on the
+// order in which the packets are read or handled, so the ranges of a split
+// file are checked by adding up what each worker saw and readers can check
+// packets as they come.
+#define CSUM_SIZE 16
+
+struct file_digest_t
+{
+  uint64_t bytes;
+  uint64_t sum;
+
+  file_digest_t() : bytes(0), sum(0) {}
+
+  void add(uint32_t crc, size_t size) { bytes += size; sum += crc; };
+  void add(const packet_t& packet)
+  {
+    add(packet_checksum(packet.offset, packet.buf.data, packet.size),
+        packet.size);
+  };
+  void add(const file_digest_t& other)
+  {
+    bytes += other.bytes;
+    sum += other.sum;
+  };
+  void put(char* dst) const
+  {
+    put_le64(dst, bytes);
+    put_le64(dst+8, sum);
+  };
+  void get(const char* src)
+  {
+    bytes = get_le64(src);
+    sum = get_le64(src+8);
+  };
+  bool operator==(const file_digest_t& other) const
+  {
+    return bytes == other.bytes && sum == other.sum;
+  };
+};
+
+// files whose CSUM packet did not match their data
+static int checksum_errors = 0;
+
+// compares the CSUM packet of file fn with the digest of the data that
+// arrived for it, a mismatch is reported and counted in checksum_errors.
+// Returns false on a mismatch.
+static bool check_digest(const std::string& fn, const file_digest_t& digest,
+                         const packet_t& packet)
+{
+  if(packet.size != CSUM_SIZE) {
+    std::cerr << "corrupt input, bad checksum packet for id " << packet.fid
+              << std::endl;
+    exit(1);
+  }
+  file_digest_t expected;
+  expected.get(packet.buf.data);
+  if(!(digest == expected)) {
+    std::cerr << ("checksum mismatch for file " + fn + "\n") << std::flush;
+    __sync_fetch_and_add(&checksum_errors, 1);
+    return false;
+  }
+  return true;
+}
+
+// exits with an error once a stream has been read completely if any of its
+// files failed their checksum
+static void exit_on_checksum_errors()
+{
+  if(checksum_errors > 0) {
+    std::cerr << checksum_errors << " files failed their checksum"
+              << std::endl;
+    exit(1);
+  }
+}
+
+// compresses the payload of DATA packets for a worker of -create, keeping one
+// deflate stream around rather than setting one up for each packet
+class packet_compressor_t
+{
+  public:
+    packet_compressor_t(int level, size_t chunk_size);
+    ~packet_compressor_t();
+
+    // compresses packet in place and sets FLAG_COMPRESSED, leaves it as it
+    // is if compression does not make it smaller
+    void compress(packet_t* packet);
+  private:
+    packet_compressor_t(const packet_compressor_t&);
+    packet_compressor_t& operator=(const packet_compressor_t&);
+
+    z_stream strm;
+    std::vector<char> scratch;
+};
+
+packet_compressor_t::packet_compressor_t(int level, size_t chunk_size)
+{
+  memset(&strm, 0, sizeof(strm));
+  const int ierr = deflateInit(&strm, level);
+  if(ierr != Z_OK) {
+    std::cerr << "failed to set up compression: " << zError(ierr)
+              << std::endl;
+    exit(1);
+  }
+  scratch.resize(8 + deflateBound(&strm, uLong(chunk_size)));
+}
+
+packet_compressor_t::~packet_compressor_t()
+{
+  deflateEnd(&strm);
+}
+
+void packet_compressor_t::compress(packet_t* packet)
+{
+  packet->flags = 0;
+  if(packet->size == 0)
+    return;
+
+  deflateReset(&strm);
+  strm.next_in = reinterpret_cast<Bytef*>(packet->buf.data);
+  strm.avail_in = uInt(packet->size);
+  strm.next_out = reinterpret_cast<Bytef*>(&scratch[8]);
+  strm.avail_out = uInt(scratch.size() - 8);
+  if(deflate(&strm, Z_FINISH) != Z_STREAM_END ||
+     8 + strm.total_out >= packet->size)
+    return;
+
+  put_le64(&scratch[0], packet->size);
+  packet->size = 8 + strm.total_out;
+  memcpy(packet->buf.data, &scratch[0], packet->size);
+  packet->flags = FLAG_COMPRESSED;
+}
+
+// undoes packet_compressor_t, one for each thread that decompresses
+class packet_decompressor_t
+{
+  public:
+    packet_decompressor_t();
+    ~packet_decompressor_t();
+
+    // replaces the payload of a compressed packet by the data, the buffer
+    // comes from the packet's pool
+    void decompress(packet_t* packet);
+  private:
+    packet_decompressor_t(const packet_decompressor_t&);
+    packet_decompressor_t& operator=(const packet_decompressor_t&);
+
+    z_stream strm;
+};
+
+packet_decompressor_t::packet_decompressor_t()
+{
+  memset(&strm, 0, sizeof(strm));
+  const int ierr = inflateInit(&strm);
+  if(ierr != Z_OK) {
+    std::cerr << "failed to set up decompression: " << zError(ierr)
+              << std::endl;
+    exit(1);
+  }
+}
+
+packet_decompressor_t::~packet_decompressor_t()
+{
+  inflateEnd(&strm);
+}
+
+void packet_decompressor_t::decompress(packet_t* packet)
+{
+  if(!(packet->flags & FLAG_COMPRESSED))
+    return;
+  if(packet->size < 8) {
+    std::cerr << "corrupt input, truncated compressed packet" << std::endl;
+    exit(1);
+  }
+  const uint64_t size = get_le64(packet->buf.data);
+  // deflate cannot do better than about 1:1032
+  if(size > 1032*uint64_t(packet->size)) {
+    std::cerr << "corrupt input, compressed packet too large" << std::endl;
+    exit(1);
+  }
+
+  buffer_t data = packet->pool->get(size_t(size));
+  inflateReset(&strm);
+  strm.next_in = reinterpret_cast<Bytef*>(packet->buf.data + 8);
+  strm.avail_in = uInt(packet->size - 8);
+  strm.next_out = reinterpret_cast<Bytef*>(data.data);
+  strm.avail_out = uInt(size);
+  if(inflate(&strm, Z_FINISH) != Z_STREAM_END || strm.total_out != size) {
+    std::cerr << "corrupt input, bad compressed data for id " << packet->fid
+              << std::endl;
+    exit(1);
+  }
+  packet->pool->put(packet->buf);
+  packet->buf = data;
+  packet->size = size_t(size);
+  packet->flags = 0;
+}
+
+// reads packets from a stream and has them decompressed on several threads,
+// which also compute the crc of each DATA packet, handing them out in stream
+// order. Packet i goes to thread i modulo the number of threads and results
+// are collected in the same round robin, so the order of the stream is kept
+// without any bookkeeping.
+class decompressing_reader_t
+{
+  public:
+    decompressing_reader_t(stream_reader_t& stream, buffer_pool_t& pool,
+                           size_t num_threads, size_t num_packets);
+    ~decompressing_reader_t();
+
+    // the next packet of the stream, NULL at its end
+    packet_t* next();
+    // give back a packet returned by next()
+    void done(packet_t* packet);
+  private:
+    decompressing_reader_t(const decompressing_reader_t&);
+    decompressing_reader_t& operator=(const decompressing_reader_t&);
+
+    struct decompressor_t {
+      pthread_t thread;
+      port_t* in;
+      port_t* out;
+    };
 
-  packet_t(port_t* rp) : reply_port(rp), size(0) { memcpy(type, TYPE_ACK, sizeof(type)); };
+    static void* decompressor(void* callarg);
+
+    stream_reader_t& stream;
+    std::vector<decompressor_t> threads;
+    std::vector<packet_t*> packets;
+    std::queue<packet_t*> free_packets;
+    size_t num_read;   // packets handed to the threads
+    size_t num_taken;  // packets handed out by next()
+    bool eof;
 };
 
+decompressing_reader_t::decompressing_reader_t(stream_reader_t& stream_,
+                                               buffer_pool_t& pool,
+                                               size_t num_threads,
+                                               size_t num_packets) :
+  stream(stream_), threads(num_threads), packets(num_packets), num_read(0),
+  num_taken(0), eof(false)
+{
+  for(size_t i = 0 ; i < num_packets ; ++i) {
+    packets[i] = new packet_t(NULL, &pool);
+    free_packets.push(packets[i]);
+  }
+  for(size_t i = 0 ; i < num_threads ; ++i) {
+    // room for all packets plus the final NULL
+    threads[i].in = new port_t(num_packets+1);
+    threads[i].out = new port_t(num_packets+1);
+    const int ierr = pthread_create(&threads[i].thread, NULL, decompressor,
+                                    &threads[i]);
+    if(ierr) {
+      std::cerr << "Could not create decompression thread " << i << ": "
+                << strerror(ierr) << std::endl;
+      exit(1);
+    }
+  }
+}
+
+decompressing_reader_t::~decompressing_reader_t()
+{
+  for(size_t i = 0 ; i < threads.size() ; ++i) {
+    threads[i].in->push_packet(NULL);
+    pthread_join(threads[i].thread, NULL);
+    delete threads[i].in;
+    delete threads[i].out;
+  }
+  for(size_t i = 0 ; i < packets.size() ; ++i)
+    delete packets[i];
+}
+
+packet_t* decompressing_reader_t::next()
+{
+  // keep all free packets busy so that the threads have work while the
+  // caller handles the packet returned now
+  while(!eof && !free_packets.empty()) {
+    packet_t* packet = free_packets.front();
+    if(!stream.read_packet(packet)) {
+      eof = true;
+      break;
+    }
+    free_packets.pop();
+    threads[num_read % threads.size()].in->push_packet(packet);
+    num_read += 1;
+  }
+  if(num_taken == num_read)
+    return NULL;
+  packet_t* packet = threads[num_taken % threads.size()].out->pull_packet();
+  num_taken += 1;
+  return packet;
+}
+
+void decompressing_reader_t::done(packet_t* packet)
+{
+  free_packets.push(packet);
+}
+
+void* decompressing_reader_t::decompressor(void* callarg)
+{
+  decompressor_t* me = static_cast<decompressor_t*>(callarg);
+  packet_decompressor_t decompressor;
+  packet_t* packet;
+  while((packet = me->in->pull_packet()) != NULL) {
+    decompressor.decompress(packet);
+    if(strncmp(packet->type, TYPE_DATA, sizeof(packet->type)) == 0)
+      packet->crc =
+        packet_checksum(packet->offset, packet->buf.data, packet->size);
+    me->out->push_packet(packet);
+  }
+  return NULL;
+}
+
 // tar file format
 /* from gnu tar docs. Likely makes this file GPL */
 /* http://www.gnu.org/software/tar/manual/html_node/Standard.html */
@@ -145,18 +856,21 @@ struct posix_header
 /* Values used in typeflag field.  */
 #define REGTYPE  '0'            /* regular file */
 #define SYMTYPE  '2'            /* reserved */
+#define XHDTYPE  'x'            /* extended header of the next member */
 
 #define BLOCKSIZE 512
 
+// the member parcp -tar adds to list the files deleted since a -since index
+#define DELETED_MEMBER ".parcp-deleted"
+
 #define MAX_FILE_SIZE ((8L<<(3*(sizeof(((struct posix_header*)0)->size)-1)))-1)
 
-// format a number to string of a given length, not NUL at the end
-static void fmtnum(char *dst, int len, size_t number)
+// wall clock time in seconds
+static double wtime()
 {
-  char buffer[32];
-  assert(len < int(sizeof(buffer)));
-  snprintf(buffer, sizeof(buffer), "%*zu", (int)len, number);
-  memcpy(dst, buffer, size_t(len));
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return double(ts.tv_sec) + 1e-9*double(ts.tv_nsec);
 }
 
 static size_t round_to_block(size_t sz)
@@ -164,73 +878,204 @@ static size_t round_to_block(size_t sz)
   return (sz + BLOCKSIZE-1) & ~(BLOCKSIZE-1);
 }
 
-// create a tar header for a file in the provided buffer hdr which must be at
-// least BLOCKSIZE bytes large
-static char make_tarheader(const std::string fn, posix_header* hdr)
+// write all of buf to fd at offset, retrying short writes
+static void pwrite_all(int fd, const char* buf, size_t sz, off_t offset,
+                       const std::string& what)
 {
-  const char* filename = fn.c_str();
-  struct stat statbuf;
-  struct group *grp, grp_buf;
-  struct passwd *pwd, pwd_buf;
-  std::vector<char> grpstrings(100), pwdstrings(100);
-  unsigned long int checksum;
-
-  const int lstat_ierr = lstat(filename, &statbuf);
-  if(lstat_ierr) {
-    std::cerr << "failed to stat file '" << fn << "':"
-              << strerror(errno) << std::endl;
-    exit(1);
+  while(sz > 0) {
+    const uint64_t start = stats_now_ns();
+    const ssize_t written = pwrite(fd, buf, sz, offset);
+    record_op(OP_WRITE, start, written > 0 ? uint64_t(written) : 0);
+    if(written < 0) {
+      if(errno == EINTR)
+        continue;
+      std::cerr << "failed to write to " << what << ": " << strerror(errno)
+                << std::endl;
+      exit(1);
+    }
+    buf += written;
+    sz -= size_t(written);
+    offset += written;
   }
+}
 
-  int grp_ierr;
-  while((grp_ierr = getgrgid_r(statbuf.st_gid, &grp_buf, &grpstrings[0],
-                               grpstrings.size(), &grp)) == ERANGE) {
-    grpstrings.resize(2*grpstrings.size());
-  }
-  if(grp_ierr) {
-    std::cerr << "failed to get group name for gid " << statbuf.st_gid
-              << ":" << strerror(errno) << std::endl;
-    exit(1);
+// read exactly sz bytes from fd at offset
+static void pread_all(int fd, char* buf, size_t sz, off_t offset,
+                      const std::string& what)
+{
+  while(sz > 0) {
+    const ssize_t nread = pread(fd, buf, sz, offset);
+    if(nread <= 0) {
+      if(nread < 0 && errno == EINTR)
+        continue;
+      std::cerr << "failed to read from " << what << ": "
+                << (nread < 0 ? strerror(errno) : "unexpected end of file")
+                << std::endl;
+      exit(1);
+    }
+    buf += nread;
+    sz -= size_t(nread);
+    offset += nread;
   }
+}
 
+// looks up the name of a user, the name is empty if the uid is unknown
+static std::string lookup_user(uint32_t uid)
+{
+  struct passwd *pwd, pwd_buf;
+  std::vector<char> pwdstrings(100);
   int pwd_ierr;
-  while((pwd_ierr = getpwuid_r(statbuf.st_uid, &pwd_buf, &pwdstrings[0],
+  while((pwd_ierr = getpwuid_r(uid, &pwd_buf, &pwdstrings[0],
                     pwdstrings.size(), &pwd)) == ERANGE) {
     pwdstrings.resize(2*pwdstrings.size());
   }
   if(pwd_ierr) {
-    std::cerr << "failed to get user name for uid " << statbuf.st_uid
-              << ":" << strerror(errno) << std::endl;
+    std::cerr << "failed to get user name for uid " << uid
+              << ":" << strerror(pwd_ierr) << std::endl;
     exit(1);
   }
+  return pwd ? pwd->pw_name : "";
+}
 
-  if(statbuf.st_size > MAX_FILE_SIZE)
-  {
-    fprintf(stderr, "size %zd of file %s too big. Maximum size is %lu\n",
-            statbuf.st_size, filename, MAX_FILE_SIZE);
+// looks up the name of a group, the name is empty if the gid is unknown
+static std::string lookup_group(uint32_t gid)
+{
+  struct group *grp, grp_buf;
+  std::vector<char> grpstrings(100);
+  int grp_ierr;
+  while((grp_ierr = getgrgid_r(gid, &grp_buf, &grpstrings[0],
+                               grpstrings.size(), &grp)) == ERANGE) {
+    grpstrings.resize(2*grpstrings.size());
+  }
+  if(grp_ierr) {
+    std::cerr << "failed to get group name for gid " << gid
+              << ":" << strerror(grp_ierr) << std::endl;
     exit(1);
   }
+  return grp ? grp->gr_name : "";
+}
+
+// user and group names by id, shared by all workers so that each id costs
+// only one NSS lookup, which may well be a round trip to a directory server
+typedef std::tr1::unordered_map<uint32_t, std::string> id_names_t;
+static pthread_rwlock_t id_names_lock = PTHREAD_RWLOCK_INITIALIZER;
+static id_names_t user_names;
+static id_names_t group_names;
+
+static std::string cached_name(id_names_t& names, uint32_t id,
+                               std::string (*lookup)(uint32_t))
+{
+  pthread_rwlock_rdlock(&id_names_lock);
+  id_names_t::const_iterator it = names.find(id);
+  const bool found = it != names.end();
+  std::string name = found ? it->second : "";
+  pthread_rwlock_unlock(&id_names_lock);
+  if(found)
+    return name;
+
+  // two workers may look up the same id at the same time, which is harmless
+  name = lookup(id);
+  pthread_rwlock_wrlock(&id_names_lock);
+  names[id] = name;
+  pthread_rwlock_unlock(&id_names_lock);
+  return name;
+}
+
+// computes the checksum of a header whose chksum field is filled with spaces
+static void set_checksum(posix_header* hdr)
+{
+  unsigned long int checksum = 0;
+  for(size_t j = 0 ; j < BLOCKSIZE ; j++)
+    checksum += reinterpret_cast<char*>(hdr)[j];
+  snprintf(hdr->chksum, sizeof(hdr->chksum), "%0*lo",
+           (int)sizeof(hdr->chksum)-1, checksum);
+}
+
+static std::string to_decimal(uint64_t val)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llu", (unsigned long long)val);
+  return buf;
+}
+
+// appends a "length key=value\n" record of a PAX extended header, the length
+// counts its own digits
+static void add_pax_record(std::string& records, const std::string& key,
+                           const std::string& value)
+{
+  const size_t base = key.size() + value.size() + 3; // ' ', '=' and '\n'
+  size_t len = base + 1;
+  char digits[32];
+  while(true) {
+    const size_t ndigits = size_t(snprintf(digits, sizeof(digits), "%zu", len));
+    if(base + ndigits == len)
+      break;
+    len = base + ndigits;
+  }
+  records += digits;
+  records += " " + key + "=" + value + "\n";
+}
+
+// the largest uid or gid the 7 octal digits of a ustar header hold
+#define MAX_OCTAL_ID 07777777
+
+// splits filename into the prefix and name fields of hdr, returns false if
+// it does not fit
+static bool split_name(const char* filename, posix_header* hdr)
+{
+  if(strlen(filename) < sizeof(hdr->name))
+  {
+    strcpy(hdr->prefix, "");
+    strncpy(hdr->name, filename, sizeof(hdr->name));
+    return true;
+  }
+  const char *p = strchr(filename+strlen(filename)-sizeof(hdr->name)+1, '/');
+  if(p == NULL || (size_t)(p-filename) >= sizeof(hdr->prefix))
+    return false;
+  snprintf(hdr->prefix, sizeof(hdr->prefix), "%.*s", (int)(p-filename),
+           filename);
+  snprintf(hdr->name, sizeof(hdr->name), "%s", p+1);
+  return true;
+}
+
+// create a tar header for a file whose lstat results are statbuf in the
+// provided buffer hdr which must be at least BLOCKSIZE bytes large. What a
+// ustar header cannot hold, a size beyond MAX_FILE_SIZE, large ids, a name
+// that does not split into prefix and name or a link target of 100
+// characters or more, is appended to records as PAX records instead and
+// left zero or truncated in hdr.
+static char fill_tarheader(const std::string& fn, struct stat statbuf,
+                           posix_header* hdr, std::string& records)
+{
+  const char* filename = fn.c_str();
+
+  // with -numeric-owner the names stay empty, like tar --numeric-owner does
+  std::string uname, gname;
+  if(!options.numeric_owner) {
+    uname = cached_name(user_names, statbuf.st_uid, lookup_user);
+    gname = cached_name(group_names, statbuf.st_gid, lookup_group);
+  }
 
   assert(S_ISLNK(statbuf.st_mode) || S_ISREG(statbuf.st_mode));
 
   memset(hdr, 0, BLOCKSIZE);
   if(S_ISLNK(statbuf.st_mode))
   {
-    if((size_t)statbuf.st_size >= sizeof(hdr->linkname))
-    {
-      fprintf(stderr, "linked filename %s too long. Last part must be shorter than %zu characters\n",
-              hdr->linkname, sizeof(hdr->linkname)-1);
-      exit(1);
-    }
-    size_t sz_read =
-      readlink(filename, hdr->linkname, sizeof(hdr->linkname));
-    if(sz_read == (size_t)-1)
+    std::vector<char> target(size_t(statbuf.st_size) + 1);
+    ssize_t sz_read = readlink(filename, &target[0], target.size());
+    if(sz_read < 0)
     {
       fprintf(stderr, "Could not read link %s: %s\n", filename,
               strerror(errno));
       exit(1);
     }
-    hdr->linkname[statbuf.st_size] = '\0';
+    // the link may have changed since the lstat
+    sz_read = std::min(sz_read, statbuf.st_size);
+    if(size_t(sz_read) >= sizeof(hdr->linkname))
+      add_pax_record(records, "linkpath",
+                     std::string(&target[0], size_t(sz_read)));
+    snprintf(hdr->linkname, sizeof(hdr->linkname), "%.*s", (int)sz_read,
+             &target[0]);
     statbuf.st_size = 0; // tar requires zero size for links
   }
   else
@@ -238,9 +1083,25 @@ static char make_tarheader(const std::string fn, posix_header* hdr)
     strcpy(hdr->linkname, "");
   }
 
+  if(statbuf.st_size > MAX_FILE_SIZE)
+  {
+    add_pax_record(records, "size", to_decimal(statbuf.st_size));
+    statbuf.st_size = 0;
+  }
+  if(statbuf.st_uid > MAX_OCTAL_ID)
+  {
+    add_pax_record(records, "uid", to_decimal(statbuf.st_uid));
+    statbuf.st_uid = 0;
+  }
+  if(statbuf.st_gid > MAX_OCTAL_ID)
+  {
+    add_pax_record(records, "gid", to_decimal(statbuf.st_gid));
+    statbuf.st_gid = 0;
+  }
+
   // name is set at the end due to funny handling of long file names
   snprintf(hdr->mode, sizeof(hdr->mode), "%0*o",
-           (int)sizeof(hdr->mode)-1, statbuf.st_mode);
+           (int)sizeof(hdr->mode)-1, statbuf.st_mode & 07777);
   snprintf(hdr->uid, sizeof(hdr->uid), "%0*o",
            (int)sizeof(hdr->uid)-1, statbuf.st_uid);
   snprintf(hdr->gid, sizeof(hdr->gid), "%0*o",
@@ -254,66 +1115,499 @@ static char make_tarheader(const std::string fn, posix_header* hdr)
   // link name already set
   strncpy(hdr->magic, TMAGIC, sizeof(hdr->magic));
   strncpy(hdr->version, TVERSION, sizeof(hdr->version));
-  snprintf(hdr->uname, sizeof(hdr->uname), "%s", pwd->pw_name);
-  snprintf(hdr->gname, sizeof(hdr->gname), "%s", grp->gr_name);
+  snprintf(hdr->uname, sizeof(hdr->uname), "%s", uname.c_str());
+  snprintf(hdr->gname, sizeof(hdr->gname), "%s", gname.c_str());
   snprintf(hdr->devmajor, sizeof(hdr->devmajor), "%0*o",
            (int)sizeof(hdr->devmajor)-1, 0);
   snprintf(hdr->devminor, sizeof(hdr->devminor), "%0*o",
            (int)sizeof(hdr->devminor)-1, 0);
-  if(strlen(filename) < sizeof(hdr->name))
+  if(!split_name(filename, hdr))
   {
-    strcpy(hdr->prefix, "");
-    strncpy(hdr->name, filename, sizeof(hdr->name));
+    // readers that ignore the record at least get the last component
+    add_pax_record(records, "path", fn);
+    const size_t slash = fn.rfind('/');
+    snprintf(hdr->name, sizeof(hdr->name), "%s",
+             slash == std::string::npos ? filename : filename + slash + 1);
+  }
+
+  set_checksum(hdr);
+
+  return hdr->typeflag;
+}
+
+// fn with sub inserted as the last directory, the way GNU tar names its PAX
+// headers and sparse members
+static std::string in_subdir(const std::string& fn, const char* sub)
+{
+  const size_t slash = fn.rfind('/');
+  if(slash == std::string::npos)
+    return std::string(sub) + "/" + fn;
+  return fn.substr(0, slash+1) + sub + "/" + fn.substr(slash+1);
+}
+
+// the 'x' header in front of a member fn whose PAX records are records_size
+// bytes. Its own name does not matter, so it is cut short if it has to be.
+static void fill_paxheader(const std::string& fn, const struct stat& statbuf,
+                           size_t records_size, posix_header* pax)
+{
+  struct stat paxstat = statbuf;
+  paxstat.st_mode = S_IFREG | 0644;
+  paxstat.st_size = off_t(records_size);
+  std::string ignored;
+  fill_tarheader(in_subdir(fn, "PaxHeaders"), paxstat, pax, ignored);
+  pax->typeflag = XHDTYPE;
+  memset(pax->chksum, ' ', sizeof(pax->chksum));
+  set_checksum(pax);
+}
+
+// the headers of a member: the ustar header of fn, preceded by an 'x' header
+// if some of its values need PAX records
+static char make_tar_headers(const std::string& fn, const struct stat& statbuf,
+                             std::string& headers)
+{
+  posix_header hdr;
+  std::string records;
+  const char typeflag = fill_tarheader(fn, statbuf, &hdr, records);
+  headers.clear();
+  if(!records.empty()) {
+    posix_header pax;
+    fill_paxheader(fn, statbuf, records.size(), &pax);
+    headers.assign(reinterpret_cast<const char*>(&pax), BLOCKSIZE);
+    records.resize(round_to_block(records.size()), '\0');
+    headers += records;
+  }
+  headers.append(reinterpret_cast<const char*>(&hdr), BLOCKSIZE);
+  return typeflag;
+}
+
+// lstat a file or exit
+static void stat_file(const std::string& fn, struct stat& statbuf)
+{
+  const uint64_t start = stats_now_ns();
+  const int lstat_ierr = lstat(fn.c_str(), &statbuf);
+  record_op(OP_LSTAT, start);
+  if(lstat_ierr) {
+    std::cerr << "failed to stat file '" << fn << "':"
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+// a run of data in a file with holes
+struct extent_t
+{
+  uint64_t offset; // in the file
+  uint64_t size;
+  uint64_t packed; // in the tar member, counted from the end of the sparse map
+};
+typedef std::vector<extent_t> extents_t;
+
+static bool starts_after(uint64_t offset, const extent_t& extent)
+{
+  return offset < extent.offset;
+}
+
+// a file using fewer blocks than its size needs has holes, or is compressed
+// by the file system, only then is it worth looking for holes
+static bool maybe_sparse(const struct stat& statbuf)
+{
+  return S_ISREG(statbuf.st_mode) &&
+         uint64_t(statbuf.st_blocks)*512 < uint64_t(statbuf.st_size);
+}
+
+// finds the data extents of a file of size bytes with SEEK_DATA and
+// SEEK_HOLE. Like GNU tar a file ending in a hole gets a final empty extent
+// at its end. Returns false, with extents empty, if the file has no holes or
+// the file system cannot tell.
+static bool find_extents(int fd, uint64_t size, extents_t& extents)
+{
+  extents.clear();
+  uint64_t packed = 0;
+  for(off_t pos = 0 ; uint64_t(pos) < size ; ) {
+    const off_t data = lseek(fd, pos, SEEK_DATA);
+    if(data < 0 && errno == ENXIO) // nothing but a hole up to the end
+      break;
+    const off_t hole = data < 0 ? data : lseek(fd, data, SEEK_HOLE);
+    if(hole < 0) {
+      extents.clear();
+      return false;
+    }
+    if(uint64_t(data) >= size)
+      break;
+    extent_t extent;
+    extent.offset = uint64_t(data);
+    extent.size = std::min(uint64_t(hole), size) - extent.offset;
+    extent.packed = packed;
+    packed += extent.size;
+    extents.push_back(extent);
+    pos = hole;
+  }
+  if(extents.size() == 1 && extents[0].size == size) {
+    extents.clear();
+    return false;
+  }
+  if(extents.empty() ||
+     extents.back().offset + extents.back().size < size) {
+    extent_t extent = { size, 0, packed };
+    extents.push_back(extent);
+  }
+  return true;
+}
+
+// skips offset over a hole and returns how many bytes can be read from there
+// before reaching end or the next hole. A file without extents has no holes.
+static uint64_t readable(const extents_t& extents, uint64_t& offset,
+                         uint64_t end)
+{
+  if(!extents.empty()) {
+    extents_t::const_iterator it =
+      std::upper_bound(extents.begin(), extents.end(), offset, starts_after);
+    if(it != extents.begin() && (it-1)->offset + (it-1)->size > offset)
+      --it;
+    else if(it != extents.end())
+      offset = it->offset;
+    else
+      return 0;
+    end = std::min(end, it->offset + it->size);
+  }
+  return end > offset ? end - offset : 0;
+}
+
+// maps data at offset of a sparse file to its place in the tar member and
+// cuts size to the extent holding it. Returns false for data outside of the
+// extents, which can only come from a file that changed while it was read.
+static bool packed_range(const extents_t& extents, uint64_t& offset,
+                         size_t& size)
+{
+  if(extents.empty())
+    return true;
+  extents_t::const_iterator it =
+    std::upper_bound(extents.begin(), extents.end(), offset, starts_after);
+  if(it == extents.begin() || (it-1)->offset + (it-1)->size <= offset)
+    return false;
+  --it;
+  size = size_t(std::min(uint64_t(size), it->offset + it->size - offset));
+  offset = it->packed + (offset - it->offset);
+  return true;
+}
+
+// the payload of a STAT packet for a regular file with holes in GNU tar's
+// sparse format 1.0: a PAX header naming the file and its real size, the
+// header of a member holding the data without the holes and, as the start of
+// that member's data, the map of the extents padded to a full block
+static void make_sparse_header(const std::string& fn,
+                               const struct stat& statbuf,
+                               const extents_t& extents, std::string& payload)
+{
+  std::string map = to_decimal(extents.size()) + "\n";
+  uint64_t data_size = 0;
+  for(size_t i = 0 ; i < extents.size() ; ++i) {
+    map += to_decimal(extents[i].offset) + "\n" +
+           to_decimal(extents[i].size) + "\n";
+    data_size += extents[i].size;
   }
+  map.resize(round_to_block(map.size()), '\0');
+
+  // the member holding the data goes by a made up name, GNU.sparse.name
+  // overrides it
+  posix_header pax, hdr;
+  std::string records;
+  struct stat memberstat = statbuf;
+  memberstat.st_size = off_t(map.size() + data_size);
+  fill_tarheader(in_subdir(fn, "GNUSparseFile.0"), memberstat, &hdr, records);
+  add_pax_record(records, "GNU.sparse.major", "1");
+  add_pax_record(records, "GNU.sparse.minor", "0");
+  add_pax_record(records, "GNU.sparse.name", fn);
+  add_pax_record(records, "GNU.sparse.realsize", to_decimal(statbuf.st_size));
+  fill_paxheader(fn, statbuf, records.size(), &pax);
+
+  records.resize(round_to_block(records.size()), '\0');
+  payload.assign(reinterpret_cast<const char*>(&pax), BLOCKSIZE);
+  payload += records;
+  payload.append(reinterpret_cast<const char*>(&hdr), BLOCKSIZE);
+  payload += map;
+}
+
+// fills packet with the STAT payload of a file whose lstat results are
+// statbuf and returns its type flag. fd is the file opened for reading if it
+// is a regular file, -1 otherwise. For a file with holes extents receives its
+// data extents and the payload is made by make_sparse_header(), for any other
+// file it is made by make_tar_headers() and extents is empty.
+static char make_stat_payload(packet_t* packet, const std::string& fn,
+                              const struct stat& statbuf, int fd,
+                              extents_t& extents)
+{
+  extents.clear();
+  std::string payload;
+  char typeflag = REGTYPE;
+  if(fd < 0 || !maybe_sparse(statbuf) ||
+     !find_extents(fd, uint64_t(statbuf.st_size), extents))
+    typeflag = make_tar_headers(fn, statbuf, payload);
   else
-  {
-    const char *p = strchr(filename+strlen(filename)-sizeof(hdr->name)+1, '/');
-    if(p == NULL)
-    {
-      fprintf(stderr, "filename %s too long. Last part must be shorter than %zu characters\n",
-              filename, sizeof(hdr->name)-1);
+    make_sparse_header(fn, statbuf, extents, payload);
+  packet->reserve(payload.size());
+  memcpy(packet->buf.data, payload.data(), payload.size());
+  packet->size = payload.size();
+  return typeflag;
+}
+
+// real_size of a stat_info_t before it is known
+#define NO_SIZE uint64_t(-1)
+
+// what the consumers of a STAT packet need to know about its payload
+struct stat_info_t
+{
+  const posix_header* hdr; // the header of the member holding the data
+  size_t header_size;      // bytes of headers up to and including hdr
+  uint64_t data_size;      // bytes of data after the payload
+  bool sparse;             // the payload ends in a sparse map
+  extents_t extents;       // of a sparse file, if asked for
+  std::string linkpath;    // target of a symbolic link, from a PAX record
+                           // or hdr
+  uint64_t real_size;      // of the file, differs from data_size only for
+                           // sparse files
+};
+
+// applies the PAX records of an 'x' header to info, size_record receives
+// the value of a size record if there is one
+static void parse_pax_records(const std::string& records, stat_info_t& info,
+                              bool& has_size, uint64_t& size_record)
+{
+  for(size_t pos = 0 ; pos < records.size() ; ) {
+    // "length key=value\n", the length counts the whole record
+    const char* start = records.c_str() + pos;
+    char* end;
+    const unsigned long len = strtoul(start, &end, 10);
+    const size_t key = size_t(end - start) + 1;
+    if(end == start || *end != ' ' || len <= key ||
+       len > records.size() - pos || records[pos + len - 1] != '\n') {
+      std::cerr << "corrupt input, bad PAX record" << std::endl;
       exit(1);
     }
-    if((size_t)(p-filename) > sizeof(hdr->prefix))
-    {
-      fprintf(stderr, "filename %s too long. First part must be shorter than %zu characters\n",
-              filename, sizeof(hdr->prefix)-1);
+    const std::string record(start + key, len - key - 1);
+    const size_t eq = record.find('=');
+    if(eq != std::string::npos) {
+      const std::string name(record, 0, eq);
+      const std::string value(record, eq + 1);
+      if(name == "GNU.sparse.major" && value == "1") {
+        info.sparse = true;
+      } else if(name == "size") {
+        has_size = true;
+        size_record = strtoull(value.c_str(), NULL, 10);
+      } else if(name == "linkpath") {
+        info.linkpath = value;
+      } else if(name == "GNU.sparse.realsize") {
+        info.real_size = strtoull(value.c_str(), NULL, 10);
+      }
+    }
+    pos += len;
+  }
+}
+
+// parses a sparse map at the end of a STAT payload, returns false if it is
+// malformed
+static bool parse_sparse_map(const char* map, size_t size, extents_t& extents)
+{
+  const std::string text(map, strnlen(map, size));
+  const char* p = text.c_str();
+  char* end;
+  const unsigned long long count = strtoull(p, &end, 10);
+  if(end == p || *end != '\n' || count > size)
+    return false;
+  uint64_t packed = 0;
+  extents.resize(size_t(count));
+  for(size_t i = 0 ; i < extents.size() ; ++i) {
+    p = end+1;
+    extents[i].offset = strtoull(p, &end, 10);
+    if(end == p || *end != '\n')
+      return false;
+    p = end+1;
+    extents[i].size = strtoull(p, &end, 10);
+    if(end == p || *end != '\n')
+      return false;
+    if(i > 0 && extents[i].offset < extents[i-1].offset + extents[i-1].size)
+      return false;
+    extents[i].packed = packed;
+    packed += extents[i].size;
+  }
+  return true;
+}
+
+// finds the member header in a STAT payload, which may be preceded by PAX
+// extended headers, and the sparse map after it. Exits if the payload is
+// corrupt.
+static void parse_stat_payload(const char* payload, size_t size,
+                               stat_info_t& info, bool want_extents)
+{
+  info.sparse = false;
+  info.extents.clear();
+  info.linkpath.clear();
+  info.real_size = NO_SIZE;
+  bool has_size = false;
+  uint64_t size_record = 0;
+  size_t pos = 0;
+  while(true) {
+    if(pos + BLOCKSIZE > size) {
+      std::cerr << "corrupt input, truncated tar header" << std::endl;
       exit(1);
     }
-    snprintf(hdr->prefix, sizeof(hdr->prefix), "%.*s", (int)(p-filename),
-             filename);
-    snprintf(hdr->name, sizeof(hdr->name), "%s", p+1);
+    info.hdr = reinterpret_cast<const posix_header*>(payload + pos);
+    if(info.hdr->typeflag != XHDTYPE)
+      break;
+    const size_t records_size = strtoul(info.hdr->size, NULL, 8);
+    const std::string records(payload + pos + BLOCKSIZE,
+                              std::min(records_size, size - pos - BLOCKSIZE));
+    parse_pax_records(records, info, has_size, size_record);
+    pos += BLOCKSIZE + round_to_block(records_size);
   }
+  info.header_size = pos + BLOCKSIZE;
+  info.data_size =
+    has_size ? size_record : strtoull(info.hdr->size, NULL, 8);
+  if(info.linkpath.empty())
+    info.linkpath.assign(info.hdr->linkname,
+                         strnlen(info.hdr->linkname,
+                                 sizeof(info.hdr->linkname)));
 
-  checksum = 0;
-  for(size_t j = 0 ; j < BLOCKSIZE ; j++)
-    checksum += reinterpret_cast<char*>(hdr)[j];
-  snprintf(hdr->chksum, sizeof(hdr->chksum), "%0*lo",
-           (int)sizeof(hdr->chksum)-1, checksum);
+  const size_t map_size = size - info.header_size;
+  if(info.sparse != (map_size > 0) || map_size > info.data_size ||
+     (want_extents && info.sparse &&
+      !parse_sparse_map(payload + info.header_size, map_size, info.extents))) {
+    std::cerr << "corrupt input, bad sparse map" << std::endl;
+    exit(1);
+  }
+  info.data_size -= map_size;
+  if(info.real_size == NO_SIZE)
+    info.real_size = info.data_size;
+}
 
-  return hdr->typeflag;
+// the entry of a tar index for the member of a STAT payload, the caller
+// fills in the offsets
+static tar_index_entry_t index_entry(const std::string& fn,
+                                     const stat_info_t& info)
+{
+  tar_index_entry_t entry;
+  entry.name = fn;
+  entry.mode = uint32_t(strtoul(info.hdr->mode, NULL, 8) & 07777) |
+               (info.hdr->typeflag == SYMTYPE ? S_IFLNK : S_IFREG);
+  entry.size = info.data_size;
+  entry.real_size = info.real_size;
+  return entry;
+}
+
+// a file that is read up to its end rather than up to the end of a range
+#define NO_RANGE uint64_t(-1)
+
+// returns where the worker that stats a file stops reading it. Regular files
+// larger than -split-size are read in ranges of that size: the first by this
+// worker, the others by whichever workers the controller hands them to.
+// Sparse files are always read by a single worker.
+static uint64_t first_range_end(const stat_info_t& info)
+{
+  if(info.hdr->typeflag != REGTYPE || info.sparse || options.split_size == 0)
+    return NO_RANGE;
+  return info.data_size > options.split_size ? options.split_size : NO_RANGE;
+}
+
+// the payload of a RANG packet is the end of the range and the offset of the
+// member's data in the tar file for -create-tar, followed by the file name.
+// The packet's offset is the start of the range.
+static void make_range_packet(packet_t* packet, uint64_t fid, uint64_t start,
+                              uint64_t end, uint64_t data_offset,
+                              const std::string& fn)
+{
+  memcpy(packet->type, TYPE_RANGE, sizeof(packet->type));
+  packet->fid = fid;
+  packet->offset = start;
+  packet->size = 16 + fn.size();
+  put_le64(packet->buf.data, end);
+  put_le64(packet->buf.data + 8, data_offset);
+  memcpy(packet->buf.data + 16, fn.c_str(), fn.size());
+}
+
+static void parse_range_packet(const packet_t* packet, std::string& fn,
+                               uint64_t& end, uint64_t& data_offset)
+{
+  end = get_le64(packet->buf.data);
+  data_offset = get_le64(packet->buf.data + 8);
+  fn.assign(packet->buf.data + 16, packet->size - 16);
+}
+
+// opens a file for reading or exits
+static int open_file(const std::string& fn)
+{
+  const uint64_t start = stats_now_ns();
+  const int fd = open(fn.c_str(), O_RDONLY);
+  record_op(OP_OPEN, start);
+  if(fd < 0) {
+    std::cerr << "Could not open file " << fn << ": " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+  return fd;
+}
+
+// whether a worker leaves out fn because of -skip-manifest or -since, fn is
+// added to the worker's list for -write-index if it has one
+static bool skip_file(const std::string& fn, const struct stat& statbuf,
+                      index_list_t* index_list)
+{
+  if(index_list)
+    index_list->push_back(index_entry_t(fn, statbuf));
+  // the index has to see every file to tell which ones are gone
+  const bool unchanged = since_index && since_index->unchanged(fn, statbuf);
+  return unchanged || (skip_manifest && skip_manifest->complete(fn, statbuf));
+}
+
+// turns the packet of a worker whose read returned nothing into the end of
+// its file or range: DONE for a range, otherwise the zero sized DATA packet
+// or, with checksums, a CSUM packet standing in for it. DONE and CSUM carry
+// the digest of the data read.
+static void end_of_file(packet_t* packet, uint64_t end,
+                        const file_digest_t& digest)
+{
+  if(end != NO_RANGE)
+    memcpy(packet->type, TYPE_DONE, sizeof(packet->type));
+  else if(options.checksum)
+    memcpy(packet->type, TYPE_CSUM, sizeof(packet->type));
+  if(options.checksum) {
+    digest.put(packet->buf.data);
+    packet->size = CSUM_SIZE;
+  }
 }
 
 // each worker reads files as instructed by the controlling thread. It pushes
 // the data to the controller as a sequence of DATA packets. The last packet
-// has zero size and indicates EOF. A worker requests new work by sending a
-// WORK packet to the controller.
+// has zero size and indicates EOF, its offset is the size of the file. Holes
+// in sparse files are skipped, which leaves gaps between the DATA packets.
+// The worker checksums each DATA packet it has read and, with -compress,
+// compresses it. A worker requests new work by sending a WORK packet to the
+// controller, which replies with either a FILE or, for a large file, a RANG
+// packet. After reading a range the worker sends DONE instead of the zero
+// sized DATA packet.
 void* worker(void *callarg)
 {
   port_t* master_port = static_cast<port_t*>(callarg);
 
-  port_t myport;
+  port_t myport(options.num_packets);
+  register_thread("reader");
   std::queue<packet_t*> packets;
-  for(int i = 0 ; i < NUM_PACKETS ; ++i) {
-    packets.push(new packet_t(&myport));
+  for(int i = 0 ; i < options.num_packets ; ++i) {
+    packets.push(new packet_t(&myport, packet_pool));
   }
 
   // this is set to true whenever we have sent a FILE packet to master and are
   // waiting for a reply, so that we don't send multiple requests
   bool waiting_for_FILE = false;
-  FILE* fh = NULL;
-  char fid[8] = "-1"; // identifies current file
+  int fd = -1;
+  uint64_t fid = 0; // identifies current file
+  uint64_t offset = 0; // offset of next DATA packet in current file
+  uint64_t end = NO_RANGE; // where to stop reading the current file
+  extents_t extents; // of the current file if it has holes
+  file_digest_t digest; // of the data read from the current file or range
   std::string fn; // used only for error output
+  index_list_t* index_list = new_index ? new_index->new_list() : NULL;
+  packet_compressor_t* compressor = options.compress_level ?
+    new packet_compressor_t(options.compress_level, options.chunk_size) : NULL;
   while(true) {
     packet_t* packet = NULL;
 
@@ -329,14 +1623,14 @@ void* worker(void *callarg)
               << " of type "
               << std::string(packet->type, sizeof(packet->type))
               << " size: " << packet->size
-              << " payload: " << (packet->size ? std::string(&packet->data[0], packet->size) : "")
+              << " payload: " << (packet->size ? std::string(packet->buf.data, packet->size) : "")
               << std::endl;
 #endif
 
     // act on possible command in packet
     if(strncmp(packet->type, TYPE_FILE, sizeof(packet->type)) == 0) {
-      if(fh != NULL) {
-        std::cerr << "Received FILE packet for " << std::string(&packet->data[0], sizeof(packet->type))
+      if(fd >= 0) {
+        std::cerr << "Received FILE packet for " << std::string(packet->buf.data, packet->size)
                   << " while still processing file " << fn << std::endl;
         exit(1);
       }
@@ -344,26 +1638,48 @@ void* worker(void *callarg)
       // a new file, open it and send metadata to master to write
       waiting_for_FILE = false;
 
-      fn = std::string(&packet->data[0], packet->data.size());
-      memcpy(fid, packet->fid, sizeof(packet->fid));
-
-      // send metadata to master
-      packet->data.resize(BLOCKSIZE);
-      const char typeflag = make_tarheader(fn, reinterpret_cast<posix_header*>(&packet->data[0]));
-      memcpy(packet->type, TYPE_STAT, sizeof(packet->type));
-      packet->size = BLOCKSIZE;
-      master_port->push_packet(packet);
+      fn = std::string(packet->buf.data, packet->size);
+      fid = packet->fid;
+      offset = 0;
+      digest = file_digest_t();
+      record_file();
 
-      if(typeflag == REGTYPE) {
-        fh = fopen(fn.c_str(), "rb");
-        if(fh == NULL) {
-          std::cerr << "Could not open file " << fn << ": " << strerror(errno)
-                    << std::endl;
-          exit(1);
-        }
+      // send metadata to master, a sparse file has to be opened first to
+      // find its holes
+      const double start = wtime();
+      struct stat statbuf;
+      stat_file(fn, statbuf);
+      if(skip_file(fn, statbuf, index_list)) {
+        memcpy(packet->type, TYPE_SKIP, sizeof(packet->type));
+        packet->size = 0;
+      } else {
+        if(S_ISREG(statbuf.st_mode))
+          fd = open_file(fn);
+        make_stat_payload(packet, fn, statbuf, fd, extents);
+        stat_info_t info;
+        parse_stat_payload(packet->buf.data, packet->size, info, false);
+        end = first_range_end(info);
+        memcpy(packet->type, TYPE_STAT, sizeof(packet->type));
       }
+      master_port->push_packet(packet);
+      __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+    } else if(strncmp(packet->type, TYPE_RANGE, sizeof(packet->type)) == 0) {
+      // part of a large file, the controller already sent its STAT packet
+      waiting_for_FILE = false;
+      uint64_t data_offset;
+      parse_range_packet(packet, fn, end, data_offset);
+      fid = packet->fid;
+      offset = packet->offset;
+      extents.clear();
+      digest = file_digest_t();
+      const double start = wtime();
+      fd = open_file(fn);
+      __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+      // the packet is free to carry data now
+      memcpy(packet->type, TYPE_ACK, sizeof(packet->type));
+      packets.push(packet);
     } else if(strncmp(packet->type, TYPE_ACK, sizeof(packet->type)) == 0) {
-      if(fh == NULL) { // (maybe) get some work
+      if(fd < 0) { // (maybe) get some work
         if(waiting_for_FILE) {
 #ifdef DEBUG
           std::cerr << "Queuing packet: " << (void*)packet  << std::endl;
@@ -378,29 +1694,47 @@ void* worker(void *callarg)
           waiting_for_FILE = true;
         }
       } else { // we already have some work to do
-        packet->data.resize(CHUNK_SIZE);
         memcpy(packet->type, TYPE_DATA, sizeof(packet->type));
 
-        const size_t sz_read =
-          fread(&packet->data[0], 1, packet->data.size(), fh);
-        if(ferror(fh)) {
+        // holes are skipped, the receiving end leaves them unwritten
+        const double start = wtime();
+        const size_t sz = size_t(std::min(uint64_t(options.chunk_size),
+                                          readable(extents, offset, end)));
+        const uint64_t read_start = stats_now_ns();
+        ssize_t sz_read = 0;
+        while(sz > 0 &&
+              (sz_read = pread(fd, packet->buf.data, sz, off_t(offset))) < 0 &&
+              errno == EINTR)
+          ;
+        if(sz_read < 0) {
           std::cerr << "Could not read from file " << fn << ": "
                     << strerror(errno) << std::endl;
           exit(1);
         }
+        if(sz > 0)
+          record_op(OP_READ, read_start, uint64_t(sz_read));
+        __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
 #ifdef DEBUG
         std::cerr << "Writing " << sz_read << " bytes of file " << fn << " in: "
                   << (void*)packet << std::endl;
 #endif
 
-        packet->size = sz_read;
-        memcpy(packet->fid, fid, sizeof(packet->fid));
-        master_port->push_packet(packet);
+        packet->size = size_t(sz_read);
+        packet->fid = fid;
+        packet->offset = offset;
+        offset += size_t(sz_read);
+        packet->flags = 0;
+        if(options.checksum && sz_read > 0)
+          digest.add(*packet);
+        if(compressor)
+          compressor->compress(packet);
 
-        if(sz_read == 0) { // this means eof occured
-          fclose(fh);
-          fh = NULL;
+        if(sz_read == 0) { // this means eof occured or the range is complete
+          end_of_file(packet, end, digest);
+          close(fd);
+          fd = -1;
         }
+        master_port->push_packet(packet);
       }
     } else {
       std::cerr << "Unexpected type "
@@ -413,363 +1747,2470 @@ void* worker(void *callarg)
   return NULL;
 }
 
-// the controlling thread for archive creation. It creates the worker threads
-// and instructs them to read files. It accepts data packets from the workers
-// and writes them as a stream to stdout.
-void sender()
+// state of one of the files a uring_worker() is reading
+struct uring_slot_t
 {
-  // this is port of the controlling thread. It accepts work requests by the
-  // workers as well as data pushes by the workers.
-  port_t master_port;
+  enum state_t { FREE, STATING, OPENING, READY, READING };
 
-  std::vector<pthread_t> threads(NUM_THREADS);
-  for(size_t i = 0 ; i < threads.size() ; ++i) {
-    const int ierr =
-      pthread_create(&threads[i], NULL, worker, static_cast<void*>(&master_port));
-    if(ierr) {
-      std::cerr << "Could not create thread " << i << ": " << strerror(errno)
-                << std::endl;
-      exit(1);
-    }
-  }
+  state_t state;
+  uint64_t fid;
+  std::string fn;
+  int fd;
+  uint64_t offset; // offset of next DATA packet
+  uint64_t end;    // where to stop reading, NO_RANGE for the end of the file
+  extents_t extents; // of a file with holes
+  file_digest_t digest; // of the data read so far
+  struct statx stx;
+  packet_t* packet; // packet filled by the operation in flight
+  uint64_t op_start; // when the operation in flight was queued, for -stats
 
-  int fid = 0;  // unique ID for each file
-  int active_threads = 0; // number of threads that are processing a file
-  // loop as long as we either have files to process or not all workers are
-  // done
-  while(!std::cin.eof() || active_threads > 0) {
-    packet_t* packet = master_port.pull_packet();
-    if(strncmp(packet->type, TYPE_WORK, sizeof(packet->type)) == 0) {
-      std::string fn;
-      if(std::getline(std::cin, fn).good()) {
-        fid += 1;
+  uring_slot_t() :
+    state(FREE), fid(0), fd(-1), offset(0), end(NO_RANGE), packet(NULL),
+    op_start(0) {}
+};
 
-        // tell worker to start reading file
-        memcpy(packet->type, TYPE_FILE, sizeof(packet->type));
-        packet->size = fn.size();
-        fmtnum(packet->fid, int(sizeof(packet->fid)), fid);
-        packet->data.resize(packet->size);
-        memcpy(&packet->data[0], fn.c_str(), packet->size);
-
-        // send FILE packet to stream
-        serialized_packet_t ser_packet;
-        memcpy(ser_packet.type, packet->type, sizeof(packet->type));
-        fmtnum(ser_packet.size, int(sizeof(ser_packet.size)), packet->size);
-        memcpy(ser_packet.fid, packet->fid, sizeof(packet->fid));
-        fwrite(&ser_packet, sizeof(ser_packet), 1, stdout);
-        fwrite(&packet->data[0], 1, packet->size, stdout);
+// queues opening the file of a slot
+static void queue_open(uring_t& ring, uring_slot_t& slot, size_t idx)
+{
+  struct io_uring_sqe* sqe = ring.get_sqe();
+  assert(sqe);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = uint64_t(uintptr_t(slot.fn.c_str()));
+  sqe->open_flags = O_RDONLY;
+  sqe->user_data = idx;
+  slot.state = uring_slot_t::OPENING;
+  slot.op_start = stats_now_ns();
+}
 
-        packet->reply_port->push_packet(packet);
-        active_threads += 1;
-      }
-    } else if(strncmp(packet->type, TYPE_DATA, sizeof(packet->type)) == 0 ||
-              strncmp(packet->type, TYPE_STAT, sizeof(packet->type)) == 0) {
-      // accept data from worker and write to stream
-      serialized_packet_t ser_packet;
-      memcpy(ser_packet.type, packet->type, sizeof(packet->type));
-      fmtnum(ser_packet.size, int(sizeof(ser_packet.size)), packet->size);
-      memcpy(ser_packet.fid, packet->fid, sizeof(packet->fid));
-      fwrite(&ser_packet, sizeof(ser_packet), 1, stdout);
-      fwrite(&packet->data[0], 1, packet->size, stdout);
-      if(packet->size == 0)
-        active_threads -= 1;
+static void stat_from_statx(const struct statx& stx, struct stat& statbuf)
+{
+  memset(&statbuf, 0, sizeof(statbuf));
+  statbuf.st_mode = stx.stx_mode;
+  statbuf.st_uid = stx.stx_uid;
+  statbuf.st_gid = stx.stx_gid;
+  statbuf.st_size = off_t(stx.stx_size);
+  statbuf.st_blocks = blkcnt_t(stx.stx_blocks);
+  statbuf.st_ino = ino_t(stx.stx_ino);
+  statbuf.st_mtim.tv_sec = time_t(stx.stx_mtime.tv_sec);
+  statbuf.st_mtim.tv_nsec = long(stx.stx_mtime.tv_nsec);
+}
 
-      memcpy(packet->type, TYPE_ACK, sizeof(packet->type));
-      packet->reply_port->push_packet(packet);
-    } else {
-      std::cerr << "Unexpected type "
-                << std::string(packet->type, sizeof(packet->type))
-                << std::endl;
-      exit(1);
-    }
-  }
+// sends the STAT packet waiting in a slot to the controller
+static void send_stat(port_t* master_port, uring_slot_t& slot,
+                      const struct stat& statbuf)
+{
+  packet_t* packet = slot.packet;
+  slot.packet = NULL;
+  make_stat_payload(packet, slot.fn, statbuf, slot.fd, slot.extents);
+  stat_info_t info;
+  parse_stat_payload(packet->buf.data, packet->size, info, false);
+  slot.end = first_range_end(info);
+  memcpy(packet->type, TYPE_STAT, sizeof(packet->type));
+  master_port->push_packet(packet);
 }
 
-// extracts the data packets from a stream from stdin and re-creates the files
-// in the stream
-void receiver()
+// number of files each worker handles at once
+static size_t files_per_worker()
 {
-  serialized_packet_t ser_packet;
-  std::vector<char> buf;
-  std::map<std::string, FILE*> filehandles;
-  std::map<std::string, std::string> filenames;
+  return options.engine == ENGINE_URING ? size_t(options.uring_depth) : 1;
+}
 
-  while(fread(&ser_packet, sizeof(ser_packet), 1, stdin))
-  {
-    // parse packet header into variables
-    std::string fid(ser_packet.fid, sizeof(ser_packet.fid));
-    char sizebuf[sizeof(ser_packet.size)+1];
-    memcpy(sizebuf, ser_packet.size, sizeof(ser_packet.size));
-    sizebuf[sizeof(ser_packet.size)] = '\0';
+// a worker that handles options.uring_depth files at once. It speaks the same
+// protocol with the controller as worker() but rather than blocking in each
+// lstat, open and read it queues them as statx, openat and read operations
+// on an io_uring and acts on whichever completes first. Each file has at most
+// one operation in flight so that its DATA packets are sent in order. If the
+// kernel does not support io_uring this falls back to worker().
+void* uring_worker(void *callarg)
+{
+  port_t* master_port = static_cast<port_t*>(callarg);
+  const size_t depth = options.uring_depth;
 
-    buf.resize(atoi(sizebuf));
-    const size_t sz = fread(&buf[0], 1, buf.size(), stdin);
-    if(sz != buf.size() || ferror(stdin)) {
-      std::cerr << "failed to read " << buf.size()
-                << " bytes from stdin (only " << sz << " read): "
-                << strerror(errno) << std::endl;
-      exit(1);
-    }
+  uring_t ring(depth);
+  if(!ring.valid()) {
+    static int warned = 0;
+    if(__sync_fetch_and_add(&warned, 1) == 0)
+      std::cerr << "io_uring not available (" << strerror(ring.error())
+                << "), falling back to reader threads" << std::endl;
+    return worker(callarg);
+  }
+
+  port_t myport(depth*options.num_packets);
+  register_thread("uring reader");
+  std::queue<packet_t*> packets;
+  for(size_t i = 0 ; i < depth*options.num_packets ; ++i) {
+    packets.push(new packet_t(&myport, packet_pool));
+  }
 
-    if(strncmp(ser_packet.type, TYPE_FILE, sizeof(ser_packet.type)) == 0) {
-      // new file, create it and record its file-id
-      std::string fn(&buf[0], buf.size());
+  std::vector<uring_slot_t> slots(depth);
+  std::vector<size_t> free_slots; // slots not reading a file
+  for(size_t i = 0 ; i < depth ; ++i)
+    free_slots.push_back(depth-1-i);
+  std::queue<size_t> ready; // slots with an open file waiting for a packet
+  index_list_t* index_list = new_index ? new_index->new_list() : NULL;
+  packet_compressor_t* compressor = options.compress_level ?
+    new packet_compressor_t(options.compress_level, options.chunk_size) : NULL;
+  size_t work_wanted = depth; // free slots for which no WORK was sent yet
+  size_t in_flight = 0; // operations queued or submitted to the ring
 
-      // behave like tar, forbid absolute paths
-      // TODO: move into writer
-      if(fn[0] == '/') {
-        static bool warned = false;
-        if(!warned) {
-          std::cerr << "stripping absolute path from filename " << fn
-                    << std::endl;
-          warned = true;
+  while(true) {
+    // act on completed operations
+    for(struct io_uring_cqe* cqe = ring.peek_cqe() ; cqe ;
+        cqe = ring.peek_cqe()) {
+      const size_t idx = size_t(cqe->user_data);
+      const int res = cqe->res;
+      ring.cqe_seen();
+      in_flight -= 1;
+
+      uring_slot_t& slot = slots[idx];
+      switch(slot.state) {
+        case uring_slot_t::STATING: {
+          record_op(OP_LSTAT, slot.op_start);
+          if(res < 0) {
+            std::cerr << "failed to stat file '" << slot.fn << "':"
+                      << strerror(-res) << std::endl;
+            exit(1);
+          }
+          struct stat statbuf;
+          stat_from_statx(slot.stx, statbuf);
+
+          if(skip_file(slot.fn, statbuf, index_list)) {
+            packet_t* packet = slot.packet;
+            slot.packet = NULL;
+            memcpy(packet->type, TYPE_SKIP, sizeof(packet->type));
+            packet->size = 0;
+            master_port->push_packet(packet);
+            slot.state = uring_slot_t::FREE;
+            free_slots.push_back(idx);
+            work_wanted += 1;
+            break;
+          }
+
+          // the STAT packet of a file that may have holes waits in the slot
+          // until the file is open and its extents are known
+          if(!maybe_sparse(statbuf))
+            send_stat(master_port, slot, statbuf);
+          if(S_ISREG(statbuf.st_mode)) {
+            queue_open(ring, slot, idx);
+            in_flight += 1;
+          } else {
+            slot.state = uring_slot_t::FREE;
+            free_slots.push_back(idx);
+            work_wanted += 1;
+          }
+          break;
         }
-        fn.erase(0,1);
-      }
+        case uring_slot_t::OPENING:
+          record_op(OP_OPEN, slot.op_start);
+          if(res < 0) {
+            std::cerr << "Could not open file " << slot.fn << ": "
+                      << strerror(-res) << std::endl;
+            exit(1);
+          }
+          slot.fd = res;
+          if(slot.packet) {
+            struct stat statbuf;
+            stat_from_statx(slot.stx, statbuf);
+            send_stat(master_port, slot, statbuf);
+          }
+          slot.state = uring_slot_t::READY;
+          ready.push(idx);
+          break;
+        case uring_slot_t::READING: {
+          record_op(OP_READ, slot.op_start, res > 0 ? uint64_t(res) : 0);
+          if(res < 0) {
+            std::cerr << "Could not read from file " << slot.fn << ": "
+                      << strerror(-res) << std::endl;
+            exit(1);
+          }
+          packet_t* packet = slot.packet;
+          slot.packet = NULL;
+          memcpy(packet->type, TYPE_DATA, sizeof(packet->type));
+          packet->size = size_t(res);
+          packet->fid = slot.fid;
+          packet->offset = slot.offset;
+          slot.offset += size_t(res);
+          packet->flags = 0;
+          if(options.checksum && res > 0)
+            slot.digest.add(*packet);
+          if(compressor)
+            compressor->compress(packet);
 
-      // create directory path to file if needed
-      // TODO: handle ".." etc properly
-      for(size_t start = 0, slash = fn.find('/', start) ;
-          slash != std::string::npos ;
-          start = slash+1, slash = fn.find('/', start)) {
-        const int ierr = mkdir(fn.substr(0, slash).c_str(), 0777);
-        if(ierr && errno != EEXIST) {
-          std::cerr << "failed to create directory '" << fn.substr(0, slash) << "': "
-                    << strerror(errno) << std::endl;
-          exit(1);
+          if(res == 0) { // this means eof occured or the range is complete
+            end_of_file(packet, slot.end, slot.digest);
+            close(slot.fd);
+            slot.fd = -1;
+            slot.state = uring_slot_t::FREE;
+            free_slots.push_back(idx);
+            work_wanted += 1;
+          } else {
+            slot.state = uring_slot_t::READY;
+            ready.push(idx);
+          }
+          master_port->push_packet(packet);
+          break;
         }
+        case uring_slot_t::FREE:
+        case uring_slot_t::READY:
+        default:
+          std::cerr << "Unexpected completion for file " << slot.fn
+                    << std::endl;
+          exit(1);
+          break;
       }
+    }
 
-      // we never erase the filename to detect corrupt files
-      if(filenames.count(fid)) {
-        std::cerr << "corrupt input, id " << fid << " for file " << fn
-                  << " not unique" << std::endl;
-        exit(1);
+    // hand out free packets, asking for more files takes precedence
+    while(!packets.empty() && (work_wanted > 0 || !ready.empty())) {
+      packet_t* packet = packets.front();
+      packets.pop();
+      if(work_wanted > 0) {
+        memcpy(packet->type, TYPE_WORK, sizeof(packet->type));
+        master_port->push_packet(packet);
+        work_wanted -= 1;
+      } else {
+        uring_slot_t& slot = slots[ready.front()];
+        struct io_uring_sqe* sqe = ring.get_sqe();
+        assert(sqe);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = slot.fd;
+        sqe->addr = uint64_t(uintptr_t(packet->buf.data));
+        // a range ends with a read of zero bytes just like a file does,
+        // holes are skipped
+        sqe->len = unsigned(std::min(uint64_t(options.chunk_size),
+                                     readable(slot.extents, slot.offset,
+                                              slot.end)));
+        sqe->off = slot.offset;
+        sqe->user_data = ready.front();
+        slot.state = uring_slot_t::READING;
+        slot.packet = packet;
+        slot.op_start = stats_now_ns();
+        ready.pop();
+        in_flight += 1;
       }
-      filenames[fid] = fn;
-    } else if(strncmp(ser_packet.type, TYPE_STAT,
-                      sizeof(ser_packet.type)) == 0) {
-      // a tar header packet, act on type
-      const posix_header* hdr = reinterpret_cast<posix_header*>(&buf[0]);
-      if(hdr->typeflag == SYMTYPE) {
-        const std::string fn = filenames[fid];
-        std::clog << "creating file " << fn << std::endl;
-        const int ierr = symlink(hdr->linkname, fn.c_str());
-        if(ierr) {
-          std::cerr << "failed to create symbolic link '" << fn << "' to target '"
-                    << hdr->linkname << ": " << strerror(errno) << std::endl;
+    }
+
+    const int ierr = ring.submit(0);
+    if(ierr < 0) {
+      std::cerr << "Could not submit I/O: " << strerror(-ierr) << std::endl;
+      exit(1);
+    }
+
+    // act on packets from the controller, if there are none wait for either
+    // a packet or a completion whichever can make progress
+    packet_t* packet = myport.try_pull_packet();
+    if(packet == NULL && in_flight == 0)
+      packet = myport.pull_packet();
+    if(packet) {
+      if(strncmp(packet->type, TYPE_FILE, sizeof(packet->type)) == 0) {
+        assert(!free_slots.empty());
+        const size_t idx = free_slots.back();
+        free_slots.pop_back();
+        uring_slot_t& slot = slots[idx];
+        slot.fn = std::string(packet->buf.data, packet->size);
+        slot.fid = packet->fid;
+        slot.offset = 0;
+        slot.digest = file_digest_t();
+        slot.packet = packet;
+
+        struct io_uring_sqe* sqe = ring.get_sqe();
+        assert(sqe);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = uint64_t(uintptr_t(slot.fn.c_str()));
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = uint64_t(uintptr_t(&slot.stx));
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = idx;
+        slot.state = uring_slot_t::STATING;
+        slot.op_start = stats_now_ns();
+        record_file();
+        in_flight += 1;
+      } else if(strncmp(packet->type, TYPE_RANGE, sizeof(packet->type)) == 0) {
+        // part of a large file, the controller already sent its STAT packet
+        assert(!free_slots.empty());
+        const size_t idx = free_slots.back();
+        free_slots.pop_back();
+        uring_slot_t& slot = slots[idx];
+        uint64_t data_offset;
+        parse_range_packet(packet, slot.fn, slot.end, data_offset);
+        slot.fid = packet->fid;
+        slot.offset = packet->offset;
+        slot.extents.clear();
+        slot.digest = file_digest_t();
+        packets.push(packet);
+        queue_open(ring, slot, idx);
+        in_flight += 1;
+      } else if(strncmp(packet->type, TYPE_ACK, sizeof(packet->type)) == 0) {
+        packets.push(packet);
+      } else {
+        std::cerr << "Unexpected type "
+                  << std::string(packet->type, sizeof(packet->type))
+                  << std::endl;
+        exit(1);
+      }
+      continue;
+    }
+
+    const int ierr_wait = ring.submit(1);
+    if(ierr_wait < 0) {
+      std::cerr << "Could not wait for I/O: " << strerror(-ierr_wait)
+                << std::endl;
+      exit(1);
+    }
+  }
+
+  return NULL;
+}
+
+// copies bytes [start, end) of a file to the tar file at data_offset+start,
+// stops early if the file is shorter
+static void copy_to_tar(int fd, const std::string& fn, packet_t* packet,
+                        uint64_t start, uint64_t end, off_t data_offset)
+{
+  double t0 = wtime();
+  for(uint64_t pos = start ; pos < end ; ) {
+    const uint64_t read_start = stats_now_ns();
+    const ssize_t sz_read =
+      pread(fd, packet->buf.data,
+            size_t(std::min(uint64_t(options.chunk_size), end-pos)), off_t(pos));
+    record_op(OP_READ, read_start, sz_read > 0 ? uint64_t(sz_read) : 0);
+    if(sz_read < 0) {
+      if(errno == EINTR)
+        continue;
+      std::cerr << "Could not read from file " << fn << ": "
+                << strerror(errno) << std::endl;
+      exit(1);
+    }
+    if(sz_read == 0)
+      break;
+    __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - t0)));
+    pwrite_all(tar_fd, packet->buf.data, size_t(sz_read),
+               data_offset + off_t(pos), "tar file");
+    pos += size_t(sz_read);
+    t0 = wtime();
+  }
+}
+
+// a worker for -create-tar. Rather than sending file contents to the
+// controller it writes the tar header and data straight into the tar file at
+// the offset the controller reserves when it receives the STAT packet. The
+// zero sized DATA packet tells the controller that the member is complete,
+// or the DONE packet that a range of it is.
+void* tar_worker(void *callarg)
+{
+  port_t* master_port = static_cast<port_t*>(callarg);
+
+  port_t myport(1);
+  register_thread("tar writer");
+  packet_t* packet = new packet_t(&myport, packet_pool);
+  extents_t extents;
+  while(true) {
+    memcpy(packet->type, TYPE_WORK, sizeof(packet->type));
+    master_port->push_packet(packet);
+    packet = myport.pull_packet();
+    if(strncmp(packet->type, TYPE_RANGE, sizeof(packet->type)) == 0) {
+      std::string fn;
+      uint64_t end, data_offset;
+      parse_range_packet(packet, fn, end, data_offset);
+      const double start = wtime();
+      const int fd = open_file(fn);
+      __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+      copy_to_tar(fd, fn, packet, packet->offset, end, off_t(data_offset));
+      close(fd);
+
+      memcpy(packet->type, TYPE_DONE, sizeof(packet->type));
+      packet->size = 0;
+      master_port->push_packet(packet);
+      packet = myport.pull_packet();
+      continue;
+    }
+    if(strncmp(packet->type, TYPE_FILE, sizeof(packet->type)) != 0) {
+      std::cerr << "Unexpected type "
+                << std::string(packet->type, sizeof(packet->type))
+                << std::endl;
+      exit(1);
+    }
+    const std::string fn(packet->buf.data, packet->size);
+    record_file();
+
+    const double start = wtime();
+    struct stat statbuf;
+    stat_file(fn, statbuf);
+    const int fd = S_ISREG(statbuf.st_mode) ? open_file(fn) : -1;
+    make_stat_payload(packet, fn, statbuf, fd, extents);
+    stat_info_t info;
+    parse_stat_payload(packet->buf.data, packet->size, info, false);
+    const uint64_t end = first_range_end(info);
+    const uint64_t size = info.data_size;
+    __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+    memcpy(packet->type, TYPE_STAT, sizeof(packet->type));
+    master_port->push_packet(packet);
+    packet = myport.pull_packet();
+
+    // the controller leaves the headers in the packet, the data follows them
+    const off_t member_offset = off_t(packet->offset);
+    const off_t data_offset = member_offset + off_t(packet->size);
+    pwrite_all(tar_fd, packet->buf.data, packet->size, member_offset,
+               "tar file");
+
+    if(fd >= 0 && extents.empty()) {
+      // never write more than the header promised in case the file grew,
+      // should it have shrunk the tail of the member stays zero
+      copy_to_tar(fd, fn, packet, 0, std::min(size, end), data_offset);
+    } else if(fd >= 0) {
+      // only the extents are stored, one after the other
+      for(size_t i = 0 ; i < extents.size() ; ++i) {
+        const extent_t& extent = extents[i];
+        copy_to_tar(fd, fn, packet, extent.offset,
+                    extent.offset + extent.size,
+                    data_offset + off_t(extent.packed) - off_t(extent.offset));
+      }
+    }
+    if(fd >= 0)
+      close(fd);
+
+    memcpy(packet->type, end == NO_RANGE ? TYPE_DATA : TYPE_DONE,
+           sizeof(packet->type));
+    packet->size = 0;
+    master_port->push_packet(packet);
+    packet = myport.pull_packet();
+  }
+
+  return NULL;
+}
+
+// the name of the copy of fn relative to the -copy destination
+static std::string copy_name(const std::string& fn)
+{
+  if(copy_src == "/")
+    return fn.substr(1);
+  if(fn.size() > copy_src.size() && fn[copy_src.size()] == '/' &&
+     fn.compare(0, copy_src.size(), copy_src) == 0)
+    return fn.substr(copy_src.size()+1);
+  // the source is a single file
+  const size_t slash = fn.rfind('/');
+  return slash == std::string::npos ? fn : fn.substr(slash+1);
+}
+
+// finds the directory of the copy of fn, creating it if need be
+static dir_cache_t::dir_t* copy_parent(const std::string& fn,
+                                       std::string& leaf)
+{
+  dir_cache_t::dir_t* dir = copy_dirs->parent_of(copy_name(fn), leaf);
+  if(dir == NULL) {
+    std::cerr << "invalid file name '" << fn << "'" << std::endl;
+    exit(1);
+  }
+  return dir;
+}
+
+// opens the copy of fn for writing, creating it if create is set. The file
+// is only readable by us until finish_copy() gives it its final mode so that
+// the workers copying its ranges can still open it.
+static int open_copy(const std::string& fn, bool create)
+{
+  std::string leaf;
+  dir_cache_t::dir_t* dir = copy_parent(fn, leaf);
+  const int flags = O_WRONLY|O_NOFOLLOW|O_CLOEXEC|(create ? O_CREAT|O_TRUNC : 0);
+  const int fd = openat(dir_cache_t::fd(dir), leaf.c_str(), flags, 0600);
+  if(fd < 0) {
+    std::cerr << "failed to open copy of '" << fn << "' for writing: "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  copy_dirs->release(dir);
+  return fd;
+}
+
+static void close_copy(int fd, const std::string& fn)
+{
+  if(close(fd)) {
+    std::cerr << "failed to write copy of '" << fn << "': " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+}
+
+// gives the copy of fn the mode and modification time of the original,
+// either through fd or, if it is -1, by name
+static void finish_copy(const std::string& fn, int fd, mode_t mode,
+                        const struct timespec& mtime)
+{
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = mtime;
+  int ierr;
+  if(fd >= 0) {
+    ierr = fchmod(fd, mode & 07777) || futimens(fd, times);
+  } else {
+    std::string leaf;
+    dir_cache_t::dir_t* dir = copy_parent(fn, leaf);
+    const int dirfd = dir_cache_t::fd(dir);
+    ierr = fchmodat(dirfd, leaf.c_str(), mode & 07777, 0) ||
+           utimensat(dirfd, leaf.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    copy_dirs->release(dir);
+  }
+  if(ierr) {
+    std::cerr << "failed to set mode and time of copy of '" << fn << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+// finishes the copy of a file whose ranges were copied by several workers,
+// the header has the time in seconds only so the original is stat'ed again
+static void finish_split_copy(const std::string& fn)
+{
+  struct stat statbuf;
+  stat_file(fn, statbuf);
+  finish_copy(fn, -1, statbuf.st_mode, statbuf.st_mtim);
+}
+
+// a directory below the -copy destination whose mode and time are set once
+// all files are in place, name is relative to the destination
+struct copy_dir_t
+{
+  std::string name;
+  mode_t mode;
+  struct timespec mtime;
+};
+static std::vector<copy_dir_t> copy_dir_list;
+static pthread_mutex_t copy_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// creates the copy of each directory as the walkers reach it, so that empty
+// directories are copied as well. The directory stays writable until
+// finish_copy_dirs().
+class copy_dir_visitor_t : public tree_walker_visitor_t
+{
+  public:
+    void visit_dir(const std::string& fn, const struct stat& statbuf)
+    {
+      copy_dir_t dir;
+      // the source itself is the destination
+      if(fn != copy_src) {
+        dir.name = copy_name(fn);
+        std::string leaf;
+        dir_cache_t::dir_t* parent = copy_parent(fn, leaf);
+        if(mkdirat(dir_cache_t::fd(parent), leaf.c_str(), 0700) &&
+           errno != EEXIST) {
+          std::cerr << "failed to create directory '" << dir.name << "': "
+                    << strerror(errno) << std::endl;
           exit(1);
         }
-        std::clog << "finished file " << fn << std::endl;
-      } else if(hdr->typeflag == REGTYPE) {
-        const std::string fn = filenames[fid];
-        FILE* fh = fopen(fn.c_str(), "wb");
-        if(fh == NULL) {
-          std::cerr << "failed to open '" << fn << "' for writing: "
-                    << strerror(errno) << std::endl;
+        copy_dirs->release(parent);
+      }
+      dir.mode = statbuf.st_mode;
+      dir.mtime = statbuf.st_mtim;
+      pthread_mutex_lock(&copy_dir_lock);
+      copy_dir_list.push_back(dir);
+      pthread_mutex_unlock(&copy_dir_lock);
+    }
+};
+
+static bool copy_dir_deeper_first(const copy_dir_t& a, const copy_dir_t& b)
+{
+  return a.name > b.name;
+}
+
+// sets the mode and time of the directories below dst once all files are
+// copied. A directory's time changes as entries are added to it, so children
+// go before their parents.
+static void finish_copy_dirs(const char* dst)
+{
+  std::sort(copy_dir_list.begin(), copy_dir_list.end(),
+            copy_dir_deeper_first);
+  for(size_t i = 0 ; i < copy_dir_list.size() ; ++i) {
+    const copy_dir_t& dir = copy_dir_list[i];
+    int fd;
+    if(dir.name.empty()) {
+      fd = open(dst, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    } else {
+      std::string leaf;
+      dir_cache_t::dir_t* parent = copy_dirs->parent_of(dir.name, leaf);
+      fd = openat(dir_cache_t::fd(parent), leaf.c_str(),
+                  O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+      copy_dirs->release(parent);
+    }
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = dir.mtime;
+    if(fd < 0 || fchmod(fd, dir.mode & 07777) || futimens(fd, times)) {
+      std::cerr << "failed to set mode and time of directory '"
+                << (dir.name.empty() ? dst : dir.name.c_str()) << "': "
+                << strerror(errno) << std::endl;
+      exit(1);
+    }
+    close(fd);
+  }
+}
+
+// re-creates a symbolic link below the -copy destination
+static void copy_symlink(const std::string& fn, const struct stat& statbuf)
+{
+  std::vector<char> target(size_t(statbuf.st_size) + 1);
+  const ssize_t len = readlink(fn.c_str(), &target[0], target.size());
+  if(len < 0 || size_t(len) >= target.size()) {
+    std::cerr << "Could not read link " << fn << ": "
+              << (len < 0 ? strerror(errno) : "link changed") << std::endl;
+    exit(1);
+  }
+  target[size_t(len)] = '\0';
+
+  std::string leaf;
+  dir_cache_t::dir_t* dir = copy_parent(fn, leaf);
+  const int dirfd = dir_cache_t::fd(dir);
+  int ierr = symlinkat(&target[0], dirfd, leaf.c_str());
+  if(ierr && errno == EEXIST && unlinkat(dirfd, leaf.c_str(), 0) == 0)
+    ierr = symlinkat(&target[0], dirfd, leaf.c_str());
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = statbuf.st_mtim;
+  if(ierr || utimensat(dirfd, leaf.c_str(), times, AT_SYMLINK_NOFOLLOW)) {
+    std::cerr << "failed to create symbolic link '" << copy_name(fn)
+              << "' to target '" << &target[0] << "': " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+  copy_dirs->release(dir);
+}
+
+// copies bytes [start, end) of src to the same place in dst, up to the end
+// of src if end is NO_RANGE. The copy shares the blocks of the original if
+// the file system can clone them, otherwise copy_file_range() moves the data
+// inside the kernel and if even that is not possible, e.g. between different
+// file systems on older kernels, it goes through buf.
+static void copy_range(int src, int dst, const std::string& fn,
+                       uint64_t start, uint64_t end, buffer_t& buf)
+{
+  struct file_clone_range clone;
+  clone.src_fd = src;
+  clone.src_offset = start;
+  clone.src_length = end == NO_RANGE ? 0 : end - start; // 0: to the end
+  clone.dest_offset = start;
+  uint64_t op_start = stats_now_ns();
+  if(ioctl(dst, FICLONERANGE, &clone) == 0) {
+    // a clone to the end of the file does not say how much it cloned
+    uint64_t cloned = clone.src_length;
+    struct stat statbuf;
+    if(cloned == 0 && fstat(src, &statbuf) == 0 &&
+       uint64_t(statbuf.st_size) > start)
+      cloned = uint64_t(statbuf.st_size) - start;
+    record_op(OP_WRITE, op_start, cloned);
+    return;
+  }
+
+  bool in_kernel = true;
+  for(uint64_t pos = start ; pos < end ; ) {
+    const size_t sz = size_t(std::min(uint64_t(COPY_CHUNK), end - pos));
+    ssize_t copied;
+    op_start = stats_now_ns();
+    if(in_kernel) {
+      loff_t in = loff_t(pos), out = loff_t(pos);
+      copied = copy_file_range(src, &in, dst, &out, sz, 0);
+      if(copied < 0 && (errno == EXDEV || errno == EINVAL ||
+                        errno == ENOSYS || errno == EOPNOTSUPP)) {
+        in_kernel = false;
+        continue;
+      }
+      record_op(OP_WRITE, op_start, copied > 0 ? uint64_t(copied) : 0);
+    } else {
+      copied = pread(src, buf.data, std::min(sz, buf.capacity), off_t(pos));
+      record_op(OP_READ, op_start, copied > 0 ? uint64_t(copied) : 0);
+      if(copied > 0)
+        pwrite_all(dst, buf.data, size_t(copied), off_t(pos),
+                   "copy of '" + fn + "'");
+    }
+    if(copied < 0) {
+      if(errno == EINTR)
+        continue;
+      std::cerr << "Could not copy file " << fn << ": " << strerror(errno)
+                << std::endl;
+      exit(1);
+    }
+    if(copied == 0)
+      break;
+    pos += uint64_t(copied);
+  }
+}
+
+// a worker for -copy. Like tar_worker() it does all I/O itself and only
+// reports to the controller. It re-creates each file below the destination
+// and gives it the mode and modification time of the original, directories
+// are handled by copy_dir_visitor_t and finish_copy_dirs(). The ranges
+// of a large file are copied by several workers into the file created by the
+// one that sent its STAT packet, the controller finishes such a file once
+// all ranges are done. Holes of sparse files are left unwritten.
+void* copy_worker(void *callarg)
+{
+  port_t* master_port = static_cast<port_t*>(callarg);
+
+  port_t myport(1);
+  register_thread("copier");
+  packet_t* packet = new packet_t(&myport, packet_pool);
+  extents_t extents;
+  while(true) {
+    memcpy(packet->type, TYPE_WORK, sizeof(packet->type));
+    master_port->push_packet(packet);
+    packet = myport.pull_packet();
+    if(strncmp(packet->type, TYPE_RANGE, sizeof(packet->type)) == 0) {
+      std::string fn;
+      uint64_t end, data_offset;
+      parse_range_packet(packet, fn, end, data_offset);
+      const double start = wtime();
+      const int src = open_file(fn);
+      const int dst = open_copy(fn, false);
+      copy_range(src, dst, fn, packet->offset, end, packet->buf);
+      close(src);
+      close_copy(dst, fn);
+      __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+
+      memcpy(packet->type, TYPE_DONE, sizeof(packet->type));
+      packet->size = 0;
+      master_port->push_packet(packet);
+      packet = myport.pull_packet();
+      continue;
+    }
+    if(strncmp(packet->type, TYPE_FILE, sizeof(packet->type)) != 0) {
+      std::cerr << "Unexpected type "
+                << std::string(packet->type, sizeof(packet->type))
+                << std::endl;
+      exit(1);
+    }
+    const std::string fn(packet->buf.data, packet->size);
+    record_file();
+
+    // the copy must exist before the controller hands out its ranges
+    double start = wtime();
+    struct stat statbuf;
+    stat_file(fn, statbuf);
+    const int src = S_ISREG(statbuf.st_mode) ? open_file(fn) : -1;
+    make_stat_payload(packet, fn, statbuf, src, extents);
+    stat_info_t info;
+    parse_stat_payload(packet->buf.data, packet->size, info, false);
+    const uint64_t end = first_range_end(info);
+    const int dst = src >= 0 ? open_copy(fn, true) : -1;
+    if(src < 0)
+      copy_symlink(fn, statbuf);
+    __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+    memcpy(packet->type, TYPE_STAT, sizeof(packet->type));
+    master_port->push_packet(packet);
+    packet = myport.pull_packet();
+
+    if(src >= 0) {
+      start = wtime();
+      if(extents.empty()) {
+        copy_range(src, dst, fn, 0, end, packet->buf);
+      } else {
+        for(size_t i = 0 ; i < extents.size() ; ++i)
+          copy_range(src, dst, fn, extents[i].offset,
+                     extents[i].offset + extents[i].size, packet->buf);
+        if(ftruncate(dst, statbuf.st_size)) {
+          std::cerr << "failed to set the size of the copy of '" << fn
+                    << "': " << strerror(errno) << std::endl;
           exit(1);
         }
-        if(filehandles.count(fid)) {
-          std::cerr << "corrupt input, id " << fid << " for file " << fn
-                    << " not unique" << std::endl;
+      }
+      if(end == NO_RANGE)
+        finish_copy(fn, dst, statbuf.st_mode, statbuf.st_mtim);
+      close(src);
+      close_copy(dst, fn);
+      __sync_fetch_and_add(&worker_io_ns, uint64_t(1e9*(wtime() - start)));
+    }
+
+    memcpy(packet->type, end == NO_RANGE ? TYPE_DATA : TYPE_DONE,
+           sizeof(packet->type));
+    packet->size = 0;
+    master_port->push_packet(packet);
+    packet = myport.pull_packet();
+  }
+
+  return NULL;
+}
+
+// adds worker threads until there are num_threads of them
+static void start_workers(std::vector<pthread_t>& threads, size_t num_threads,
+                          port_t* master_port)
+{
+  void* (*thread_func)(void*) =
+    copy_dirs ? copy_worker :
+    tar_fd >= 0 ? tar_worker :
+    options.engine == ENGINE_URING ? uring_worker : worker;
+  for(size_t i = threads.size() ; i < num_threads ; ++i) {
+    pthread_t thread;
+    const int ierr =
+      pthread_create(&thread, NULL, thread_func, static_cast<void*>(master_port));
+    if(ierr) {
+      std::cerr << "Could not create thread " << i << ": " << strerror(ierr)
+                << std::endl;
+      exit(1);
+    }
+    threads.push_back(thread);
+  }
+}
+
+// where sender() gets the names of the files to copy from
+class file_source_t
+{
+  public:
+    virtual ~file_source_t() {};
+    // returns false once there are no more names
+    virtual bool next(std::string& fn) = 0;
+};
+
+// one name per line on stdin, e.g. from find
+class stdin_source_t : public file_source_t
+{
+  public:
+    bool next(std::string& fn) { return std::getline(std::cin, fn).good(); };
+};
+
+// the files below the directories given on the command line
+class walk_source_t : public file_source_t
+{
+  public:
+    walk_source_t() :
+      walker(walk_roots, options.num_walkers, walk_includes, walk_excludes,
+             copy_dirs ? &dir_visitor : NULL) {};
+    bool next(std::string& fn) { return walker.next(fn); };
+  private:
+    copy_dir_visitor_t dir_visitor;
+    tree_walker_t walker;
+};
+
+// a range of a large file waiting for a worker
+struct file_range_t
+{
+  uint64_t fid;
+  uint64_t start;
+  uint64_t end;
+  uint64_t data_offset; // of the member in the tar file for -create-tar
+  std::string fn;
+};
+
+// a large file read in ranges, complete once no range is left
+struct split_file_t
+{
+  uint64_t size;
+  size_t ranges_left;
+  std::string fn; // for -copy, which finishes the copy at the end
+  file_digest_t digest; // sum of the digests of the ranges read so far
+};
+typedef std::tr1::unordered_map<uint64_t, split_file_t> split_files_t;
+
+// the controlling thread for archive creation. It creates the worker threads
+// and instructs them to read files. It accepts data packets from the workers
+// and writes them as a stream to stdout. For -create-tar it instead reserves
+// space in the tar file for each member and lets the workers write to it,
+// for -copy the workers write the copies and it only hands out the work.
+void sender()
+{
+  // this is port of the controlling thread. It accepts work requests by the
+  // workers as well as data pushes by the workers.
+  const int max_threads =
+    options.auto_tune ? options.max_threads : options.num_threads;
+  // idle workers may still ask for work once the controller is done, so the
+  // port outlives sender() just like the workers do
+  port_t& master_port =
+    *new port_t(max_threads*files_per_worker()*options.num_packets);
+  register_thread("controller");
+  packet_pool =
+    new buffer_pool_t(std::max(options.chunk_size, size_t(MIN_PACKET_BUFFER)));
+
+  std::vector<pthread_t> threads;
+  start_workers(threads, options.num_threads, &master_port);
+
+  stream_writer_t* stream =
+    tar_fd < 0 && copy_dirs == NULL ? new stream_writer_t(stdout) : NULL;
+  size_t sz_tarfile = 0;
+
+  file_source_t* source = walk_roots.empty() ?
+    static_cast<file_source_t*>(new stdin_source_t) : new walk_source_t;
+  bool exhausted = false;
+
+  // auto-tune bookkeeping for the current interval
+  double interval_start = wtime();
+  double master_idle = 0.;
+  uint64_t interval_io_ns = __sync_fetch_and_add(&worker_io_ns, 0);
+
+  // names of files whose STAT packet has not arrived yet, needed to hand
+  // out the ranges of large files
+  std::tr1::unordered_map<uint64_t, std::string> names;
+  std::queue<file_range_t> ranges;
+  split_files_t split_files;
+  // WORK requests that arrived while there was nothing to do, they get the
+  // ranges of large files that are still being stat'ed
+  std::queue<packet_t*> idle_workers;
+
+  uint64_t fid = 0;  // unique ID for each file
+  uint64_t num_skipped = 0; // files left out by -skip-manifest or -since
+  int active_threads = 0; // number of threads that are processing a file
+  // loop as long as we either have files to process or not all workers are
+  // done
+  while(!exhausted || active_threads > 0) {
+    const double wait_start = wtime();
+    packet_t* packet = master_port.pull_packet();
+    const double wait_end = wtime();
+    master_idle += wait_end - wait_start;
+
+    // grow the pool of workers as long as the master mostly waits for them
+    // and they in turn mostly wait for the file system rather than for the
+    // master
+    if(options.auto_tune && wait_end - interval_start >= TUNE_INTERVAL) {
+      const double elapsed = wait_end - interval_start;
+      const uint64_t io_ns = __sync_fetch_and_add(&worker_io_ns, 0);
+      const double worker_io =
+        1e-9*double(io_ns - interval_io_ns) / (elapsed*double(threads.size()));
+      if(master_idle > 0.5*elapsed && worker_io > 0.5 &&
+         int(threads.size()) < max_threads) {
+        const size_t num_threads =
+          std::min(2*threads.size(), size_t(max_threads));
+#ifdef DEBUG
+        std::cerr << "Growing to " << num_threads << " workers, master idle "
+                  << master_idle/elapsed << " workers in I/O " << worker_io
+                  << std::endl;
+#endif
+        start_workers(threads, num_threads, &master_port);
+      }
+      interval_start = wait_end;
+      master_idle = 0.;
+      interval_io_ns = io_ns;
+    }
+
+    if(strncmp(packet->type, TYPE_WORK, sizeof(packet->type)) == 0) {
+      std::string fn;
+      if(!ranges.empty()) {
+        // finish large files first, they are already taking up space
+        const file_range_t& range = ranges.front();
+        make_range_packet(packet, range.fid, range.start, range.end,
+                          range.data_offset, range.fn);
+        ranges.pop();
+        packet->reply_port->push_packet(packet);
+      } else if(!exhausted && source->next(fn)) {
+        // leave room for the header of a RANG packet
+        if(fn.size() + 16 > packet->buf.capacity) {
+          std::cerr << "file name " << fn << " too long" << std::endl;
           exit(1);
         }
-        std::clog << "creating file " << fn << std::endl;
-        filehandles[fid] = fh;
+        fid += 1;
+
+        // tell worker to start reading file
+        memcpy(packet->type, TYPE_FILE, sizeof(packet->type));
+        packet->size = fn.size();
+        packet->fid = fid;
+        packet->offset = 0;
+        memcpy(packet->buf.data, fn.c_str(), fn.size());
+
+        // the FILE packet goes to the stream right before the STAT packet,
+        // so that files the worker skips never show up in it
+        if(stream || options.split_size || tar_index)
+          names[fid] = fn;
+
+        packet->reply_port->push_packet(packet);
+        active_threads += 1;
       } else {
-        std::cerr << "unknown type flag '" << hdr->typeflag << "'"
+        exhausted = true;
+        idle_workers.push(packet);
+      }
+    } else if(strncmp(packet->type, TYPE_DATA, sizeof(packet->type)) == 0 ||
+              strncmp(packet->type, TYPE_STAT, sizeof(packet->type)) == 0) {
+      const bool is_stat =
+        strncmp(packet->type, TYPE_STAT, sizeof(packet->type)) == 0;
+      stat_info_t info;
+      std::tr1::unordered_map<uint64_t, std::string>::iterator name =
+        names.end();
+      if(is_stat) {
+        parse_stat_payload(packet->buf.data, packet->size, info, false);
+        name = names.find(packet->fid);
+      }
+      if(stream) {
+        // accept data from worker and write to stream
+        if(is_stat) {
+          assert(name != names.end());
+          stream->write_packet(TYPE_FILE, packet->fid, 0, name->second.data(),
+                               name->second.size());
+        }
+        stream->write_packet(packet->type, packet->fid, packet->offset,
+                             packet->buf.data, packet->size,
+                             is_stat ? 0 : packet->flags);
+        // symbolic links are complete with their STAT packet, regular files
+        // once the zero sized DATA packet arrives
+        if(is_stat ? info.hdr->typeflag == SYMTYPE : packet->size == 0)
+          active_threads -= 1;
+      } else if(is_stat && tar_fd >= 0) {
+        // reserve space for headers and data in the tar file
+        packet->offset = sz_tarfile;
+        sz_tarfile += packet->size + round_to_block(info.data_size);
+        if(tar_index) {
+          assert(name != names.end());
+          tar_index_entry_t entry = index_entry(name->second, info);
+          entry.header_offset = packet->offset;
+          entry.data_offset = packet->offset + packet->size;
+          tar_index->add(entry);
+        }
+      } else if(!is_stat) {
+        active_threads -= 1;
+      }
+
+      // queue all but the first range of a large file, the first one is read
+      // by the worker that sent the STAT packet
+      if(is_stat && options.split_size) {
+        assert(name != names.end());
+        if(first_range_end(info) != NO_RANGE) {
+          const uint64_t size = info.data_size;
+          split_file_t& file = split_files[packet->fid];
+          file.size = size;
+          file.ranges_left = 1;
+          file.fn = name->second;
+          for(uint64_t start = options.split_size ; start < size ;
+              start += options.split_size) {
+            file_range_t range;
+            range.fid = packet->fid;
+            range.start = start;
+            range.end = std::min(size, start + options.split_size);
+            range.data_offset = packet->offset + info.header_size;
+            range.fn = name->second;
+            ranges.push(range);
+            file.ranges_left += 1;
+          }
+        }
+
+        while(!ranges.empty() && !idle_workers.empty()) {
+          packet_t* idle = idle_workers.front();
+          idle_workers.pop();
+          const file_range_t& range = ranges.front();
+          make_range_packet(idle, range.fid, range.start, range.end,
+                            range.data_offset, range.fn);
+          ranges.pop();
+          idle->reply_port->push_packet(idle);
+        }
+      }
+      if(name != names.end())
+        names.erase(name);
+
+      memcpy(packet->type, TYPE_ACK, sizeof(packet->type));
+      packet->reply_port->push_packet(packet);
+    } else if(strncmp(packet->type, TYPE_SKIP, sizeof(packet->type)) == 0) {
+      // the file is complete at the receiving end, nothing of it is sent
+      names.erase(packet->fid);
+      num_skipped += 1;
+      active_threads -= 1;
+
+      memcpy(packet->type, TYPE_ACK, sizeof(packet->type));
+      packet->reply_port->push_packet(packet);
+    } else if(strncmp(packet->type, TYPE_CSUM, sizeof(packet->type)) == 0) {
+      // a file read as a whole is complete, its checksum follows the EOF
+      // marker
+      assert(stream);
+      stream->write_packet(TYPE_DATA, packet->fid, packet->offset, NULL, 0);
+      stream->write_packet(TYPE_CSUM, packet->fid, packet->offset,
+                           packet->buf.data, packet->size);
+      active_threads -= 1;
+
+      memcpy(packet->type, TYPE_ACK, sizeof(packet->type));
+      packet->reply_port->push_packet(packet);
+    } else if(strncmp(packet->type, TYPE_DONE, sizeof(packet->type)) == 0) {
+      // a range of a large file has been read, the file is complete once all
+      // of them are
+      split_files_t::iterator it = split_files.find(packet->fid);
+      assert(it != split_files.end());
+      if(packet->size == CSUM_SIZE) {
+        file_digest_t digest;
+        digest.get(packet->buf.data);
+        it->second.digest.add(digest);
+      }
+      if(--it->second.ranges_left == 0) {
+        if(stream) {
+          const uint64_t size = it->second.size;
+          stream->write_packet(TYPE_DATA, packet->fid, size, NULL, 0);
+          if(options.checksum) {
+            char payload[CSUM_SIZE];
+            it->second.digest.put(payload);
+            stream->write_packet(TYPE_CSUM, packet->fid, size, payload,
+                                 sizeof(payload));
+          }
+        } else if(copy_dirs)
+          finish_split_copy(it->second.fn);
+        split_files.erase(it);
+        active_threads -= 1;
+      }
+
+      memcpy(packet->type, TYPE_ACK, sizeof(packet->type));
+      packet->reply_port->push_packet(packet);
+    } else {
+      std::cerr << "Unexpected type "
+                << std::string(packet->type, sizeof(packet->type))
+                << std::endl;
+      exit(1);
+    }
+  }
+
+  delete source;
+
+  // files of the previous run that nobody asked about are gone
+  if(since_index) {
+    size_t num_deleted = 0;
+    for(size_t i = 0 ; i < since_index->size() ; ++i) {
+      if(since_index->seen(i))
+        continue;
+      const std::string name = since_index->name(i);
+      fid += 1;
+      stream->write_packet(TYPE_DELETE, fid, 0, name.data(), name.size());
+      num_deleted += 1;
+    }
+    std::clog << "skipped " << num_skipped << " unchanged files, "
+              << num_deleted << " files deleted since the last run"
+              << std::endl;
+  } else if(skip_manifest) {
+    std::clog << "skipped " << num_skipped << " files completed earlier"
+              << std::endl;
+  }
+
+  if(stream) {
+    delete stream;
+  } else if(tar_fd >= 0) {
+    // write tar termination blocks
+    static const char zeros[2*BLOCKSIZE] = {0};
+    pwrite_all(tar_fd, zeros, sizeof(zeros), sz_tarfile, "tar file");
+    if(close(tar_fd)) {
+      std::cerr << "failed to write to tar file: " << strerror(errno)
+                << std::endl;
+      exit(1);
+    }
+    if(tar_index)
+      tar_index->write();
+  }
+
+  // only once the stream is complete, an aborted run leaves the old index
+  if(new_index)
+    new_index->write();
+}
+
+// state of a file being re-created by receiver()
+struct extract_file_t
+{
+  std::string name;
+  int fd;
+  bool skip;   // the name is unsafe, the packets of the file are ignored
+  bool sparse; // may end in a hole, which no DATA packet covers
+  bool absolute; // a leading '/' was stripped from the name
+  int64_t mtime; // of the original, for the journal
+  file_digest_t digest; // of the DATA packets written so far
+  extract_file_t() :
+    fd(-1), skip(false), sparse(false), absolute(false), mtime(0) {}
+};
+typedef std::tr1::unordered_map<uint64_t, extract_file_t> extract_files_t;
+
+// a thread of receiver() creating the files whose fid modulo the number of
+// writers equals its index. All packets of a file pass through the same
+// port, so they are handled in stream order.
+struct extract_writer_t
+{
+  pthread_t thread;
+  port_t* port;
+  dir_cache_t* dirs; // shared by all writers
+  // we never erase the entries to detect corrupt files
+  extract_files_t files;
+};
+
+// writes a message to clog in one piece so that lines of concurrent writers
+// do not mix
+static void log_file(const char* what, const std::string& fn)
+{
+  std::clog << (what + fn + "\n") << std::flush;
+}
+
+// the name a file had in the stream, which is what the sender looks up in the
+// journal
+static std::string sent_name(const extract_file_t& file)
+{
+  return file.absolute ? "/" + file.name : file.name;
+}
+
+// acts on a single packet of the stream for extract_writer()
+static void extract_packet(extract_files_t& files, dir_cache_t& dirs,
+                           const packet_t& packet)
+{
+  if(strncmp(packet.type, TYPE_FILE, sizeof(packet.type)) == 0) {
+    // new file, create it and record its file-id
+    std::string fn(packet.buf.data, packet.size);
+
+    // behave like tar, forbid absolute paths
+    const bool absolute = fn[0] == '/';
+    if(absolute) {
+      static bool warned = false;
+      if(!__sync_lock_test_and_set(&warned, true)) {
+        std::cerr << "stripping absolute path from filename " << fn
                   << std::endl;
+      }
+      fn.erase(0,1);
+    }
+
+    extract_file_t& file = files[packet.fid];
+    if(!file.name.empty()) {
+      std::cerr << "corrupt input, id " << packet.fid << " for file " << fn
+                << " not unique" << std::endl;
+      exit(1);
+    }
+    file.name = fn;
+    file.absolute = absolute;
+
+    // like tar, refuse to write outside of the current directory
+    if(dir_cache_t::escapes(fn)) {
+      std::cerr << "skipping file " << fn << " whose name contains '..'"
+                << std::endl;
+      file.skip = true;
+    }
+  } else if(strncmp(packet.type, TYPE_STAT, sizeof(packet.type)) == 0) {
+    // a tar header packet, act on type
+    stat_info_t info;
+    parse_stat_payload(packet.buf.data, packet.size, info, false);
+    const posix_header* hdr = info.hdr;
+    extract_files_t::iterator it = files.find(packet.fid);
+    if(it == files.end()) {
+      std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
+      exit(1);
+    }
+    extract_file_t& file = it->second;
+    const std::string& fn = file.name;
+    if(file.skip)
+      return;
+    file.mtime = strtoll(hdr->mtime, NULL, 8);
+
+    // creates any missing directories of the path
+    std::string leaf;
+    dir_cache_t::dir_t* dir = dirs.parent_of(fn, leaf);
+    if(dir == NULL) {
+      std::cerr << "invalid file name '" << fn << "'" << std::endl;
+      exit(1);
+    }
+    const int dirfd = dir_cache_t::fd(dir);
+
+    if(hdr->typeflag == SYMTYPE) {
+      log_file("creating file ", fn);
+      const char* target = info.linkpath.c_str();
+      int ierr = symlinkat(target, dirfd, leaf.c_str());
+      // a link left by an earlier run, e.g. one the stream of -since updates
+      if(ierr && errno == EEXIST && unlinkat(dirfd, leaf.c_str(), 0) == 0)
+        ierr = symlinkat(target, dirfd, leaf.c_str());
+      if(ierr) {
+        std::cerr << "failed to create symbolic link '" << fn << "' to target '"
+                  << target << ": " << strerror(errno) << std::endl;
         exit(1);
       }
-    } else if(strncmp(ser_packet.type, TYPE_DATA,
-                      sizeof(ser_packet.type)) == 0) {
-      // a data packet, write to the correct file and close the file once the
-      // zero size packet arrives
-      FILE* fh = filehandles[fid];
-      if(fh == NULL) {
-        std::cerr << "corrupt input, unknown id " << fid << std::endl;
+      log_file("finished file ", fn);
+      if(journal)
+        journal->complete(sent_name(file), info.linkpath.size(), file.mtime);
+    } else if(hdr->typeflag == REGTYPE) {
+      if(file.fd >= 0) {
+        std::cerr << "corrupt input, id " << packet.fid << " for file " << fn
+                  << " not unique" << std::endl;
         exit(1);
       }
-      const size_t written = fwrite(&buf[0], 1, buf.size(), fh);
-      if(written != buf.size()) {
-        std::cerr << "failed to write to " << filenames[fid]
+      // do not follow a symbolic link the archive may have planted
+      const int fd = openat(dirfd, leaf.c_str(),
+                            O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC,
+                            0666);
+      if(fd < 0) {
+        std::cerr << "failed to open '" << fn << "' for writing: "
                   << strerror(errno) << std::endl;
         exit(1);
       }
-      if(written == 0) { // EOF marker
-        const std::string fn = filenames[fid];
-        if(fclose(fh)) {
-          std::cerr << "failed to write to " << fn
-                    << strerror(errno) << std::endl;
-          exit(1);
-        }
-        std::clog << "finished file " << fn << std::endl;
-        filehandles.erase(fid);
-      }
+      log_file("creating file ", fn);
+      file.fd = fd;
+      file.sparse = info.sparse;
     } else {
-      std::cerr << "Unexpected type "
-                << std::string(ser_packet.type, sizeof(ser_packet.type))
+      std::cerr << "unknown type flag '" << hdr->typeflag << "'"
+                << std::endl;
+      exit(1);
+    }
+    dirs.release(dir);
+  } else if(strncmp(packet.type, TYPE_DATA, sizeof(packet.type)) == 0) {
+    // a data packet, write to the correct file and close the file once the
+    // zero size packet arrives
+    extract_files_t::iterator it = files.find(packet.fid);
+    if(it != files.end() && it->second.skip)
+      return;
+    if(it == files.end() || it->second.fd < 0) {
+      std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
+      exit(1);
+    }
+    extract_file_t& file = it->second;
+    if(packet.size > 0) {
+      file.digest.add(packet);
+      pwrite_all(file.fd, packet.buf.data, packet.size, off_t(packet.offset),
+                 file.name);
+    } else { // EOF marker
+      // holes are never written, the offset of the marker is the real size
+      if(file.sparse && ftruncate(file.fd, off_t(packet.offset))) {
+        std::cerr << "failed to set the size of " << file.name << ": "
+                  << strerror(errno) << std::endl;
+        exit(1);
+      }
+      if(close(file.fd)) {
+        std::cerr << "failed to write to " << file.name << ": "
+                  << strerror(errno) << std::endl;
+        exit(1);
+      }
+      log_file("finished file ", file.name);
+      file.fd = -1;
+      if(journal)
+        journal->complete(sent_name(file), packet.offset, file.mtime);
+    }
+  } else if(strncmp(packet.type, TYPE_CSUM, sizeof(packet.type)) == 0) {
+    // the checksum of a file whose data has all been written
+    extract_files_t::iterator it = files.find(packet.fid);
+    if(it == files.end() || it->second.fd >= 0) {
+      std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
+      exit(1);
+    }
+    extract_file_t& file = it->second;
+    if(!file.skip && !check_digest(file.name, file.digest, packet) && journal)
+      journal->failed(sent_name(file));
+  } else if(strncmp(packet.type, TYPE_DELETE, sizeof(packet.type)) == 0) {
+    // a file the sender had in its last run is gone, remove it here too
+    std::string fn(packet.buf.data, packet.size);
+    if(!fn.empty() && fn[0] == '/')
+      fn.erase(0,1);
+    if(dir_cache_t::escapes(fn)) {
+      std::cerr << "not deleting file " << fn << " whose name contains '..'"
+                << std::endl;
+      return;
+    }
+    // a missing directory means the file is already gone, which must not
+    // create the directory
+    std::string leaf;
+    dir_cache_t::dir_t* dir;
+    if(!dirs.lookup_parent(fn, leaf, dir)) {
+      std::cerr << "invalid file name '" << fn << "'" << std::endl;
+      exit(1);
+    }
+    if(dir == NULL)
+      return;
+    if(unlinkat(dir_cache_t::fd(dir), leaf.c_str(), 0) && errno != ENOENT) {
+      std::cerr << "failed to delete '" << fn << "': " << strerror(errno)
                 << std::endl;
       exit(1);
     }
+    log_file("deleted file ", fn);
+    dirs.release(dir);
+  } else {
+    std::cerr << "Unexpected type "
+              << std::string(packet.type, sizeof(packet.type))
+              << std::endl;
+    exit(1);
+  }
+}
+
+// handles packets until a NULL packet arrives, returns each packet to its
+// reply port once it is done with it. Compressed packets are decompressed
+// and checksummed here, so that both scale with the number of writers.
+void* extract_writer(void* callarg)
+{
+  extract_writer_t* me = static_cast<extract_writer_t*>(callarg);
+  packet_decompressor_t decompressor;
+  packet_t* packet;
+  while((packet = me->port->pull_packet()) != NULL) {
+    decompressor.decompress(packet);
+    extract_packet(me->files, *me->dirs, *packet);
+    packet->reply_port->push_packet(packet);
+  }
+  return NULL;
+}
+
+// directories a dir_cache_t may keep open, leaving most file descriptors for
+// the files being written
+static size_t max_dir_fds()
+{
+  struct rlimit rlim;
+  size_t max_fds = MAX_DIR_FDS;
+  if(getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY)
+    max_fds = std::max(size_t(16), std::min(max_fds, size_t(rlim.rlim_cur/4)));
+  return max_fds;
+}
+
+// extracts the data packets from a stream from stdin and re-creates the files
+// in the stream. The main thread only reads the stream and hands the packets
+// to a pool of writer threads, each owning a subset of the files.
+void receiver()
+{
+  stream_reader_t stream(stdin);
+  buffer_pool_t pool(std::max(options.chunk_size, size_t(MIN_PACKET_BUFFER)));
+
+  // a fixed number of packets circulates between the reader and the writers
+  // so that a slow file system throttles reading the stream
+  const size_t num_writers = options.num_writers;
+  const size_t num_packets = num_writers * options.num_packets;
+  port_t free_port(num_packets);
+  std::vector<packet_t*> packets(num_packets);
+  for(size_t i = 0 ; i < num_packets ; ++i) {
+    packets[i] = new packet_t(&free_port, &pool);
+    free_port.push_packet(packets[i]);
+  }
+
+  dir_cache_t dirs(".", max_dir_fds());
+
+  std::vector<extract_writer_t> writers(num_writers);
+  for(size_t i = 0 ; i < num_writers ; ++i) {
+    writers[i].dirs = &dirs;
+    // room for all packets plus the final NULL
+    writers[i].port = new port_t(num_packets+1);
+    const int ierr = pthread_create(&writers[i].thread, NULL, extract_writer,
+                                    &writers[i]);
+    if(ierr) {
+      std::cerr << "Could not create writer thread " << i << ": "
+                << strerror(ierr) << std::endl;
+      exit(1);
+    }
+  }
+
+  while(true) {
+    packet_t* packet = free_port.pull_packet();
+    if(!stream.read_packet(packet)) {
+      free_port.push_packet(packet);
+      break;
+    }
+    writers[packet->fid % num_writers].port->push_packet(packet);
+  }
+
+  for(size_t i = 0 ; i < num_writers ; ++i) {
+    writers[i].port->push_packet(NULL);
+    pthread_join(writers[i].thread, NULL);
+    delete writers[i].port;
+  }
+  for(size_t i = 0 ; i < num_packets ; ++i)
+    delete packets[i];
+
+  exit_on_checksum_errors();
+}
+
+// writes tar members strictly in order for output that cannot seek. Members
+// are emitted in the order of their STAT packets. Data of the member being
+// written goes straight out, data of later members and out of order data is
+// held back until its member's turn. Once more than memory_budget bytes are
+// held back further chunks are spilled to a temporary file. Throttling the
+// input instead could deadlock since the data that is missing to make
+// progress may still be queued behind it in the stream.
+class tar_stream_t
+{
+  public:
+    tar_stream_t(write_behind_t& out, buffer_pool_t& pool,
+                 size_t memory_budget);
+    ~tar_stream_t();
+
+    // queue a member, header holds header_size bytes of headers, which for a
+    // sparse file include the sparse map, size is the data that follows them.
+    // If entry is given it is added to the tar index with the offsets of the
+    // member once they are known.
+    void add_member(uint64_t fid, const char* header, size_t header_size,
+                    size_t size, const tar_index_entry_t* entry = NULL);
+    // data for a member, buf may be exchanged for another pool buffer
+    void add_data(uint64_t fid, uint64_t offset, buffer_t& buf, size_t sz);
+    // no more data will arrive for a member
+    void end_member(uint64_t fid);
+    // bytes written so far
+    size_t position() const { return pos; };
+  private:
+    tar_stream_t(const tar_stream_t&);
+    tar_stream_t& operator=(const tar_stream_t&);
+
+    struct chunk_t {
+      buffer_t buf;      // buf.data is NULL if the chunk was spilled
+      size_t size;
+      off_t spill_offset;
+    };
+    typedef std::map<uint64_t, chunk_t> chunks_t;
+
+    struct member_t {
+      uint64_t fid;
+      std::string header;
+      size_t size;       // data bytes following the header
+      size_t written;    // data bytes written so far
+      bool started;      // header has been written
+      bool complete;     // end_member() was called
+      chunks_t chunks;   // held back data by offset
+      bool indexed;      // entry goes to the tar index
+      tar_index_entry_t entry;
+    };
+    // finished members stay in the map as NULL to detect ids that are reused
+    typedef std::tr1::unordered_map<uint64_t, member_t*> members_t;
+
+    member_t* find(uint64_t fid);
+    void write(buffer_t& buf, size_t sz);
+    void write_zeros(size_t sz);
+    void write_data(member_t* member, uint64_t offset, buffer_t& buf,
+                    size_t sz);
+    void pump();
+
+    write_behind_t& out;
+    buffer_pool_t& pool;
+    size_t pos;
+    size_t budget;
+    size_t held;       // bytes of buffers held in memory
+    FILE* spill;
+    off_t spill_size;
+
+    std::deque<member_t*> order; // members not completely written yet
+    members_t members;
+};
+
+tar_stream_t::tar_stream_t(write_behind_t& out_, buffer_pool_t& pool_,
+                           size_t memory_budget) :
+  out(out_), pool(pool_), pos(0), budget(memory_budget), held(0),
+  spill(NULL), spill_size(0)
+{
+}
+
+tar_stream_t::~tar_stream_t()
+{
+  if(!order.empty()) {
+    std::cerr << "corrupt input, " << order.size()
+              << " files were not completed" << std::endl;
+    exit(1);
+  }
+  if(spill)
+    fclose(spill);
+}
+
+tar_stream_t::member_t* tar_stream_t::find(uint64_t fid)
+{
+  members_t::iterator it = members.find(fid);
+  if(it == members.end() || it->second == NULL || it->second->complete) {
+    std::cerr << "corrupt input, unknown id " << fid << std::endl;
+    exit(1);
+  }
+  return it->second;
+}
+
+void tar_stream_t::add_member(uint64_t fid, const char* header,
+                              size_t header_size, size_t size,
+                              const tar_index_entry_t* entry)
+{
+  if(members.find(fid) != members.end()) {
+    std::cerr << "corrupt input, id " << fid << " not unique" << std::endl;
+    exit(1);
+  }
+  member_t* member = new member_t;
+  members[fid] = member;
+  member->fid = fid;
+  member->header.assign(header, header_size);
+  member->size = size;
+  member->written = 0;
+  member->started = false;
+  member->complete = false;
+  member->indexed = entry != NULL;
+  if(entry)
+    member->entry = *entry;
+  order.push_back(member);
+  pump();
+}
+
+void tar_stream_t::add_data(uint64_t fid, uint64_t offset, buffer_t& buf,
+                            size_t sz)
+{
+  member_t* member = find(fid);
+  if(member == order.front() && member->started &&
+     member->chunks.empty() && offset == member->written) {
+    write_data(member, offset, buf, sz);
+    return;
+  }
+
+  chunk_t chunk;
+  chunk.size = sz;
+  chunk.spill_offset = 0;
+  if(held + buf.capacity <= budget) {
+    chunk.buf = buf;
+    buf = pool.get();
+    held += chunk.buf.capacity;
+  } else {
+    if(spill == NULL) {
+      spill = tmpfile();
+      if(spill == NULL) {
+        std::cerr << "could not create a file to hold back data: "
+                  << strerror(errno) << std::endl;
+        exit(1);
+      }
+    }
+    chunk.buf.data = NULL;
+    chunk.buf.capacity = 0;
+    chunk.spill_offset = spill_size;
+    pwrite_all(fileno(spill), buf.data, sz, spill_size, "temporary file");
+    spill_size += off_t(sz);
+  }
+  if(!member->chunks.insert(std::make_pair(offset, chunk)).second) {
+    std::cerr << "corrupt input, duplicate offset " << offset << " for id "
+              << fid << std::endl;
+    exit(1);
+  }
+  if(member == order.front())
+    pump();
+}
+
+void tar_stream_t::end_member(uint64_t fid)
+{
+  member_t* member = find(fid);
+  member->complete = true;
+  if(member == order.front())
+    pump();
+}
+
+void tar_stream_t::write(buffer_t& buf, size_t sz)
+{
+  out.write(pos, buf, sz);
+  pos += sz;
+}
+
+void tar_stream_t::write_zeros(size_t sz)
+{
+  static char zeros[2*BLOCKSIZE] = {0};
+  buffer_t zero_buf = { zeros, sizeof(zeros) };
+  while(sz > 0) {
+    const size_t n = std::min(sz, sizeof(zeros));
+    write(zero_buf, n);
+    sz -= n;
   }
-  if(ferror(stdin)) {
-    std::cerr << "failed to read from stdin: " << strerror(errno) << std::endl;
+}
+
+// write data at offset of the current member, the file may have grown since
+// its header was made so anything beyond the announced size is dropped
+void tar_stream_t::write_data(member_t* member, uint64_t offset,
+                              buffer_t& buf, size_t sz)
+{
+  if(offset < member->written) {
+    std::cerr << "corrupt input, overlapping data at offset " << offset
+              << std::endl;
     exit(1);
   }
+  if(offset >= member->size)
+    return;
+  // a gap can only be left by a file that shrank while it was read
+  write_zeros(size_t(offset) - member->written);
+  sz = std::min(sz, member->size - size_t(offset));
+  write(buf, sz);
+  member->written = size_t(offset) + sz;
+}
+
+// write as much of the members at the front as is available
+void tar_stream_t::pump()
+{
+  while(!order.empty()) {
+    member_t* member = order.front();
+    if(!member->started) {
+      if(member->indexed) {
+        member->entry.header_offset = pos;
+        member->entry.data_offset = pos + member->header.size();
+        tar_index->add(member->entry);
+      }
+      // large writes take over their buffer, so it must come from the pool
+      buffer_t header = pool.get(member->header.size());
+      memcpy(header.data, member->header.data(), member->header.size());
+      write(header, member->header.size());
+      pool.put(header);
+      member->header.clear();
+      member->started = true;
+    }
+
+    chunks_t::iterator it;
+    while((it = member->chunks.begin()) != member->chunks.end() &&
+          (it->first == member->written || member->complete)) {
+      chunk_t& chunk = it->second;
+      if(chunk.buf.data == NULL) {
+        chunk.buf = pool.get(chunk.size);
+        pread_all(fileno(spill), chunk.buf.data, chunk.size,
+                  chunk.spill_offset, "temporary file");
+        // give the space back, the file only ever grows otherwise
+        fallocate(fileno(spill), FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                  chunk.spill_offset, off_t(chunk.size));
+      } else {
+        held -= chunk.buf.capacity;
+      }
+      write_data(member, it->first, chunk.buf, chunk.size);
+      pool.put(chunk.buf);
+      member->chunks.erase(it);
+    }
+    if(!member->complete)
+      break;
+
+    write_zeros(round_to_block(member->size) - member->written);
+    order.pop_front();
+    members[member->fid] = NULL;
+    delete member;
+  }
 }
 
+// state of a file being added to the tar file by maketar()
+struct tar_member_t
+{
+  std::string name;
+  size_t offset; // start of the data in the tar file
+  size_t size;   // bytes of data received so far
+  size_t data_size; // bytes of data announced by the header
+  bool open;     // true while DATA packets are expected
+  bool grew;     // data beyond data_size arrived and was dropped
+  extents_t extents; // where the data of a sparse file goes
+  file_digest_t digest; // of the DATA packets received so far
+  tar_member_t() :
+    offset(0), size(0), data_size(0), open(false), grew(false) {}
+};
+typedef std::tr1::unordered_map<uint64_t, tar_member_t> tar_members_t;
+
 // extracts the data packets from a stream from stdin and creates a tar file
 void maketar()
 {
-  serialized_packet_t ser_packet;
-  std::vector<char> buf;
-  std::map<std::string, size_t> fileoffsets;
-  std::map<std::string, std::string> filenames;
+
+  stream_reader_t stream(stdin);
+  const size_t packet_size =
+    std::max(options.chunk_size, size_t(MIN_PACKET_BUFFER));
+  buffer_pool_t pool(packet_size);
+  // -memory covers both the packets being decompressed and the data held
+  // back while streaming, the packets get at most half of it
+  size_t num_packets = size_t(options.num_writers)*options.num_packets;
+  size_t reorder_memory = REORDER_MEMORY;
+  if(options.memory_budget) {
+    num_packets = std::max(size_t(2),
+                           std::min(num_packets,
+                                    options.memory_budget/2/packet_size));
+    reorder_memory = options.memory_budget -
+                     std::min(options.memory_budget, num_packets*packet_size);
+  }
+  // compressed packets are decompressed by -writers threads while this one
+  // writes the tar file
+  decompressing_reader_t reader(stream, pool, options.num_writers,
+                                num_packets);
+  // we never erase the entries to detect corrupt files
+  tar_members_t members;
   size_t sz_tarfile = 0;
 
-  // TODO: fix this
-  FILE* fh = stdout;
+  // headers and data of a member are adjacent in the tar file, so as long as
+  // packets of a file arrive in order they end up in a single large write
+  write_behind_t out(fileno(stdout), &pool, options.write_size,
+                     options.writer_thread);
+  // a pipe gets the members one after the other, see tar_stream_t
+  tar_stream_t* tar_stream = NULL;
+  if(options.stream_tar || !out.seekable()) {
+    tar_stream = new tar_stream_t(out, pool, reorder_memory);
+  }
 
-  while(fread(&ser_packet, sizeof(ser_packet), 1, stdin)) {
-    // parse packet header into variables
-    std::string fid(ser_packet.fid, sizeof(ser_packet.fid));
-    char sizebuf[sizeof(ser_packet.size)+1];
-    memcpy(sizebuf, ser_packet.size, sizeof(ser_packet.size));
-    sizebuf[sizeof(ser_packet.size)] = '\0';
+  static char zeros[2*BLOCKSIZE] = {0};
+  buffer_t zero_buf = { zeros, sizeof(zeros) };
 
-    buf.resize(atoi(sizebuf));
-    const size_t sz = fread(&buf[0], 1, buf.size(), stdin);
-    if(sz != buf.size() || ferror(stdin)) {
-      const std::string fn = filenames[fid];
-      std::cerr << "failed to read " << buf.size()
-                << " bytes from stdin (only " << sz << " read): "
-                << strerror(errno) << std::endl;
-      exit(1);
-    }
+  // names of the files deleted since the last run, one per line, and the id
+  // of the last of them
+  std::string deleted;
+  uint64_t deleted_fid = 0;
 
+  for(packet_t* next ; (next = reader.next()) != NULL ; reader.done(next)) {
+    packet_t& packet = *next;
     // TODO: Remove FILE packet from streams since the STAT packet can be used
     // as well
-    if(strncmp(ser_packet.type, TYPE_FILE, sizeof(ser_packet.type)) == 0) {
+    if(strncmp(packet.type, TYPE_FILE, sizeof(packet.type)) == 0) {
       // new file record its file-id
-      std::string fn(&buf[0], buf.size());
+      std::string fn(packet.buf.data, packet.size);
 
-      // we never erase the filename to detect corrupt files
-      if(filenames.count(fid)) {
-        std::cerr << "corrupt input, id " << fid << " for file " << fn
+      tar_member_t& member = members[packet.fid];
+      if(!member.name.empty()) {
+        std::cerr << "corrupt input, id " << packet.fid << " for file " << fn
                   << " not unique" << std::endl;
         exit(1);
       }
-      filenames[fid] = fn;
-    } else if(strncmp(ser_packet.type, TYPE_STAT,
-                      sizeof(ser_packet.type)) == 0) {
-      // a tar header packet, act on type
-      const posix_header* hdr = reinterpret_cast<posix_header*>(&buf[0]);
-      assert(buf.size() == BLOCKSIZE);
-      if(hdr->typeflag == SYMTYPE) {
-        const int ierr_fseek = fseek(fh, sz_tarfile, SEEK_SET);
-        if(ierr_fseek) {
-          std::cerr << "failed to seek to position " << sz_tarfile << ": "
-                    << strerror(errno) << std::endl;
-          exit(1);
-        }
-        const size_t written = fwrite(&buf[0], 1, buf.size(), fh);
-        if(written != buf.size()) {
-          std::cerr << "failed to write to " << filenames[fid]
-                    << strerror(errno) << std::endl;
-          exit(1);
-        }
-        sz_tarfile += buf.size();
-      } else if(hdr->typeflag == REGTYPE) {
-        const int ierr_fseek = fseek(fh, sz_tarfile, SEEK_SET);
-        if(ierr_fseek) {
-          std::cerr << "failed to seek to position " << sz_tarfile << ": "
-                    << strerror(errno) << std::endl;
-          exit(1);
-        }
-        const size_t written = fwrite(&buf[0], 1, buf.size(), fh);
-        if(written != buf.size()) {
-          std::cerr << "failed to write to " << filenames[fid] << ": "
-                    << strerror(errno) << std::endl;
-          exit(1);
-        }
-        sz_tarfile += buf.size();
+      member.name = fn;
+    } else if(strncmp(packet.type, TYPE_STAT, sizeof(packet.type)) == 0) {
+      // a tar header packet, act on type. It holds all the headers of the
+      // member and for a sparse file the map that starts its data.
+      stat_info_t info;
+      parse_stat_payload(packet.buf.data, packet.size, info, true);
+      const char typeflag = info.hdr->typeflag;
+      const size_t size = info.data_size;
+      tar_members_t::iterator it = members.find(packet.fid);
+      if(it == members.end()) {
+        std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
+        exit(1);
+      }
+      tar_member_t& member = it->second;
+      member.extents.swap(info.extents);
+      tar_index_entry_t entry = index_entry(member.name, info);
+      const tar_index_entry_t* indexed = tar_index ? &entry : NULL;
+      if(tar_index && !tar_stream &&
+         (typeflag == SYMTYPE || typeflag == REGTYPE)) {
+        entry.header_offset = sz_tarfile;
+        entry.data_offset = sz_tarfile + packet.size;
+        tar_index->add(entry);
+      }
+      if(tar_stream && typeflag == SYMTYPE) {
+        tar_stream->add_member(packet.fid, packet.buf.data, packet.size, 0,
+                               indexed);
+        tar_stream->end_member(packet.fid);
+      } else if(tar_stream && typeflag == REGTYPE) {
+        tar_stream->add_member(packet.fid, packet.buf.data, packet.size, size,
+                               indexed);
+        member.open = true;
+      } else if(typeflag == SYMTYPE) {
+        out.write(sz_tarfile, packet.buf, packet.size);
+        sz_tarfile += packet.size;
+      } else if(typeflag == REGTYPE) {
+        out.write(sz_tarfile, packet.buf, packet.size);
+        sz_tarfile += packet.size;
 
-        fileoffsets[fid] = sz_tarfile;
-        sz_tarfile += round_to_block(strtol(hdr->size, NULL, 8));
+        member.offset = sz_tarfile;
+        member.data_size = size;
+        member.open = true;
+        sz_tarfile += round_to_block(size);
       } else {
-        std::cerr << "unknown type flag '" << hdr->typeflag << "'"
+        std::cerr << "unknown type flag '" << typeflag << "'"
                   << std::endl;
         exit(1);
       }
-    } else if(strncmp(ser_packet.type, TYPE_DATA,
-                      sizeof(ser_packet.type)) == 0) {
+    } else if(strncmp(packet.type, TYPE_DATA, sizeof(packet.type)) == 0) {
       // a data packet, write to the correct location in tar file
-      if(fileoffsets.count(fid) == 0) {
-        std::cerr << "corrupt input, unknown id " << fid << std::endl;
+      tar_members_t::iterator it = members.find(packet.fid);
+      if(it == members.end() || !it->second.open) {
+        std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
         exit(1);
       }
-      size_t offset = fileoffsets[fid];
-      const int ierr_fseek = fseek(fh, offset, SEEK_SET);
-      if(ierr_fseek) {
-        std::cerr << "failed to seek to position " << sz_tarfile << ": "
-                  << strerror(errno) << std::endl;
+      tar_member_t& member = it->second;
+      if(packet.size > 0)
+        member.digest.add(packet.crc, packet.size);
+      // the extents of a sparse file are stored without the holes
+      uint64_t offset = packet.offset;
+      size_t size = packet.size;
+      if(size > 0 && !packed_range(member.extents, offset, size)) {
+        // data where the file had a hole when it was stat'ed is lost
+      } else if(tar_stream && size > 0) {
+        tar_stream->add_data(packet.fid, offset, packet.buf, size);
+      } else if(tar_stream) {
+        tar_stream->end_member(packet.fid);
+        member.open = false;
+      } else if(size > 0) {
+        // the file may have grown since its header was made, anything beyond
+        // the announced size would overwrite the next member
+        if(offset + size > member.data_size) {
+          if(!member.grew) {
+            std::cerr << "file " << member.name << " grew while it was read, "
+                      << "dropping data beyond " << member.data_size
+                      << " bytes" << std::endl;
+            member.grew = true;
+          }
+          size = offset < member.data_size ?
+                 size_t(member.data_size - offset) : 0;
+        }
+        if(size > 0) {
+          out.write(member.offset + offset, packet.buf, size);
+          member.size = std::max(member.size, size_t(offset + size));
+        }
+      } else { // EOF marker
+        // pad the last block so that the next member's header continues the
+        // same extent instead of leaving a hole between them
+        const size_t padding = round_to_block(member.size) - member.size;
+        out.write(member.offset + member.size, zero_buf, padding);
+        member.open = false;
+      }
+    } else if(strncmp(packet.type, TYPE_CSUM, sizeof(packet.type)) == 0) {
+      // the checksum of a member whose data has all been written
+      tar_members_t::iterator it = members.find(packet.fid);
+      if(it == members.end() || it->second.open) {
+        std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
         exit(1);
       }
-      const size_t written = fwrite(&buf[0], 1, buf.size(), fh);
-      if(written != buf.size()) {
-        std::cerr << "failed to write to " << filenames[fid]
-                  << strerror(errno) << std::endl;
+      check_digest(it->second.name, it->second.digest, packet);
+    } else if(strncmp(packet.type, TYPE_DELETE, sizeof(packet.type)) == 0) {
+      deleted.append(packet.buf.data, packet.size);
+      deleted += '\n';
+      deleted_fid = packet.fid;
+    } else {
+      std::cerr << "Unexpected type "
+                << std::string(packet.type, sizeof(packet.type))
+                << std::endl;
+      exit(1);
+    }
+  }
+
+  // a tar file cannot express deletions, list them in a member of their own
+  if(!deleted.empty()) {
+    struct stat statbuf;
+    memset(&statbuf, 0, sizeof(statbuf));
+    statbuf.st_mode = S_IFREG | 0644;
+    statbuf.st_uid = getuid();
+    statbuf.st_gid = getgid();
+    statbuf.st_size = off_t(deleted.size());
+    statbuf.st_mtime = time(NULL);
+    std::string headers;
+    make_tar_headers(DELETED_MEMBER, statbuf, headers);
+    tar_index_entry_t entry;
+    entry.name = DELETED_MEMBER;
+    entry.mode = statbuf.st_mode;
+    entry.size = entry.real_size = deleted.size();
+
+    const size_t size = round_to_block(deleted.size());
+    buffer_t buf = pool.get(headers.size() + size);
+    memcpy(buf.data, headers.data(), headers.size());
+    memcpy(buf.data + headers.size(), deleted.data(), deleted.size());
+    memset(buf.data + headers.size() + deleted.size(), 0,
+           size - deleted.size());
+    if(tar_stream) {
+      tar_stream->add_member(deleted_fid, buf.data, headers.size(), size,
+                             tar_index ? &entry : NULL);
+      memmove(buf.data, buf.data + headers.size(), size);
+      tar_stream->add_data(deleted_fid, 0, buf, size);
+      tar_stream->end_member(deleted_fid);
+    } else {
+      if(tar_index) {
+        entry.header_offset = sz_tarfile;
+        entry.data_offset = sz_tarfile + headers.size();
+        tar_index->add(entry);
+      }
+      out.write(sz_tarfile, buf, headers.size() + size);
+      sz_tarfile += headers.size() + size;
+    }
+    pool.put(buf);
+  }
+
+  if(tar_stream) {
+    sz_tarfile = tar_stream->position();
+    delete tar_stream;
+  }
+
+  // write tar termination blocks
+  out.write(sz_tarfile, zero_buf, sizeof(zeros));
+  out.flush();
+  // the index describes a complete tar file or none
+  if(tar_index)
+    tar_index->write();
+
+  exit_on_checksum_errors();
+}
+
+// state of a file checked by verify()
+struct verify_file_t
+{
+  std::string name;
+  bool regular;  // a regular file, which ends with a zero sized DATA packet
+  bool complete; // its zero sized DATA packet arrived
+  bool checked;  // its CSUM packet arrived
+  file_digest_t digest; // of the DATA packets received so far
+  verify_file_t() : regular(false), complete(false), checked(false) {}
+};
+typedef std::tr1::unordered_map<uint64_t, verify_file_t> verify_files_t;
+
+// reads a stream from stdin and checks the checksum of each file without
+// writing anything. Packets are decompressed and checksummed by -writers
+// threads. Fails if a checksum does not match or the stream is cut short.
+void verify()
+{
+  stream_reader_t stream(stdin);
+  buffer_pool_t pool(std::max(options.chunk_size, size_t(MIN_PACKET_BUFFER)));
+  decompressing_reader_t reader(stream, pool, options.num_writers,
+                                options.num_writers*options.num_packets);
+  verify_files_t files;
+  size_t num_deleted = 0;
+
+  for(packet_t* next ; (next = reader.next()) != NULL ; reader.done(next)) {
+    packet_t& packet = *next;
+    if(strncmp(packet.type, TYPE_DELETE, sizeof(packet.type)) == 0) {
+      num_deleted += 1;
+      continue;
+    }
+    if(strncmp(packet.type, TYPE_FILE, sizeof(packet.type)) == 0) {
+      verify_file_t& file = files[packet.fid];
+      if(!file.name.empty()) {
+        std::cerr << "corrupt input, id " << packet.fid << " for file "
+                  << std::string(packet.buf.data, packet.size)
+                  << " not unique" << std::endl;
+        exit(1);
+      }
+      file.name = std::string(packet.buf.data, packet.size);
+      continue;
+    }
+
+    verify_files_t::iterator it = files.find(packet.fid);
+    if(it == files.end()) {
+      std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
+      exit(1);
+    }
+    verify_file_t& file = it->second;
+    if(strncmp(packet.type, TYPE_STAT, sizeof(packet.type)) == 0) {
+      stat_info_t info;
+      parse_stat_payload(packet.buf.data, packet.size, info, false);
+      file.regular = info.hdr->typeflag == REGTYPE;
+    } else if(strncmp(packet.type, TYPE_DATA, sizeof(packet.type)) == 0) {
+      if(!file.regular || file.complete) {
+        std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
         exit(1);
       }
-      fileoffsets[fid] += written;
-      if(written == 0) { // EOF marker
-        // we may write less than a multiple of BLOCKSIZE bytes and rely on the
-        // OS to present the holes in the output file as null bytes
-        fileoffsets.erase(fid);
+      if(packet.size > 0)
+        file.digest.add(packet.crc, packet.size);
+      file.complete = packet.size == 0;
+    } else if(strncmp(packet.type, TYPE_CSUM, sizeof(packet.type)) == 0) {
+      if(!file.complete || file.checked) {
+        std::cerr << "corrupt input, unknown id " << packet.fid << std::endl;
+        exit(1);
       }
+      check_digest(file.name, file.digest, packet);
+      file.checked = true;
     } else {
       std::cerr << "Unexpected type "
-                << std::string(ser_packet.type, sizeof(ser_packet.type))
+                << std::string(packet.type, sizeof(packet.type))
                 << std::endl;
       exit(1);
     }
   }
-  if(ferror(stdin)) {
-    std::cerr << "failed to read from stdin: " << strerror(errno) << std::endl;
+
+  size_t num_checked = 0, num_unchecked = 0, num_incomplete = 0;
+  for(verify_files_t::const_iterator it = files.begin() ; it != files.end() ;
+      ++it) {
+    if(it->second.regular && !it->second.complete) {
+      std::cerr << "file " << it->second.name << " is incomplete"
+                << std::endl;
+      num_incomplete += 1;
+    } else if(it->second.checked) {
+      num_checked += 1;
+    } else if(it->second.regular) {
+      num_unchecked += 1;
+    }
+  }
+  std::cout << files.size() << " files, " << num_checked
+            << " checked, " << num_unchecked << " without checksum, "
+            << num_deleted << " deleted" << std::endl;
+  if(num_incomplete > 0) {
+    std::cerr << num_incomplete << " files are incomplete" << std::endl;
     exit(1);
   }
+  exit_on_checksum_errors();
+}
 
-  // write tar termination blocks
-  buf.resize(2*BLOCKSIZE);
-  memset(&buf[0], 0, buf.size());
-  // TODO: add error checks
-  const int ierr_fseek = fseek(fh, sz_tarfile, SEEK_SET);
-  if(ierr_fseek) {
-    std::cerr << "failed to seek to position " << sz_tarfile
-              << strerror(errno) << std::endl;
+// parses a size in bytes with an optional K, M or G suffix
+static size_t parse_size(const char* arg, const char* option)
+{
+  char* end;
+  const unsigned long long val = strtoull(arg, &end, 10);
+  size_t unit = 1;
+  switch(*end) {
+    case 'k': case 'K': unit = 1024; ++end; break;
+    case 'm': case 'M': unit = 1024*1024; ++end; break;
+    case 'g': case 'G': unit = 1024*1024*1024; ++end; break;
+    default: break;
+  }
+  if(end == arg || *end != '\0' || val == 0) {
+    std::cerr << "invalid size '" << arg << "' for option -" << option
+              << std::endl;
+    exit(1);
+  }
+  return size_t(val) * unit;
+}
+
+static int parse_count(const char* arg, const char* option)
+{
+  char* end;
+  const long val = strtol(arg, &end, 10);
+  if(end == arg || *end != '\0' || val <= 0 || val > 1000000) {
+    std::cerr << "invalid count '" << arg << "' for option -" << option
+              << std::endl;
     exit(1);
   }
-  fwrite(&buf[0], 1, buf.size(), fh);
-  //fclose(fh);
+  return int(val);
+}
+
+static double parse_seconds(const char* arg, const char* option)
+{
+  char* end;
+  const double val = strtod(arg, &end);
+  if(end == arg || *end != '\0' || !(val > 0.) || val > 1e6) {
+    std::cerr << "invalid number of seconds '" << arg << "' for option -"
+              << option << std::endl;
+    exit(1);
+  }
+  return val;
+}
+
+static void usage(const char* argv0)
+{
+  std::cerr << "usage: " << argv0
+            << " [-create|-extract|-tar|-verify|-create-tar FILE] [options]"
+               " [DIR...]\n"
+            << "       " << argv0 << " -copy [options] SRC DST\n"
+            << "-create and -create-tar read file names from stdin unless "
+               "DIRs are given\n"
+            << "-copy copies the files below SRC into DST\n"
+            << "options for -create, -create-tar and -copy:\n"
+            << "  -threads N       number of reader threads (default "
+            << NUM_THREADS << ")\n"
+            << "  -chunk-size SIZE bytes per DATA packet (default "
+            << CHUNK_SIZE << ")\n"
+            << "  -packets N       packets in flight per reader (default "
+            << NUM_PACKETS << ")\n"
+            << "  -memory SIZE     cap bytes in flight, overrides -packets\n"
+            << "  -auto-tune       add readers while they wait for the file "
+               "system\n"
+            << "  -max-threads N   limit for -auto-tune (default "
+            << MAX_THREADS << ")\n"
+            << "  -engine E        threads: one file per reader (default)\n"
+            << "                   uring: many files per reader via io_uring "
+               "(-create only)\n"
+            << "  -uring-depth N   files in flight per uring reader (default "
+            << URING_DEPTH << ")\n"
+            << "  -split-size SIZE read larger files in ranges of SIZE on "
+               "several readers,\n"
+            << "                   0 disables (default 1G)\n"
+            << "  -numeric-owner   store only numeric user and group ids\n"
+            << "  -compress        compress DATA packets with zlib (-create "
+               "only)\n"
+            << "  -compress-level N\n"
+            << "                   zlib level 1-9, implies -compress "
+               "(default 1)\n"
+            << "  -no-checksum     do not follow files with a checksum "
+               "(-create only)\n"
+            << "  -since INDEX     only send files that changed since the "
+               "run that wrote\n"
+            << "                   INDEX, and the names of deleted files "
+               "(-create only)\n"
+            << "  -write-index INDEX\n"
+            << "                   record the files of this run for -since "
+               "(-create only)\n"
+            << "  -skip-manifest FILE\n"
+            << "                   leave out files a -journal lists as "
+               "complete and which\n"
+            << "                   still have the same size and mtime "
+               "(-create only)\n"
+            << "  -walkers N       threads listing DIRs (default "
+            << NUM_WALKERS << ")\n"
+            << "  -include PATTERN only files matching PATTERN, like find "
+               "-name or -path\n"
+            << "  -exclude PATTERN skip files and directories matching "
+               "PATTERN\n"
+            << "  -progress SECONDS\n"
+            << "                   print the rates of the run to stderr every "
+               "SECONDS\n"
+            << "  -stats FILE      write counters and latency histograms "
+               "of the run to FILE\n"
+            << "                   as JSON when it is done\n"
+            << "  -tar-index FILE  write the offsets of the members to FILE "
+               "(-create-tar only)\n"
+            << "options for -tar:\n"
+            << "  -chunk-size SIZE expected bytes per DATA packet (default "
+            << CHUNK_SIZE << ")\n"
+            << "  -write-size SIZE bytes collected per write (default "
+            << WRITE_SIZE << ")\n"
+            << "  -writer-thread   write the tar file from a separate thread\n"
+            << "  -stream          write members in order as if to a pipe\n"
+            << "  -memory SIZE     cap on packets in flight and data held "
+               "back while\n"
+            << "                   streaming (default " << REORDER_MEMORY
+            << " held back)\n"
+            << "  -writers N       threads decompressing packets (default "
+            << NUM_WRITERS << ")\n"
+            << "  -tar-index FILE  write the offsets of the members to FILE\n"
+            << "options for -extract:\n"
+            << "  -writers N       number of threads creating files (default "
+            << NUM_WRITERS << ")\n"
+            << "  -packets N       packets in flight per writer (default "
+            << NUM_PACKETS << ")\n"
+            << "  -journal FILE    append the files finished to FILE, see "
+               "-skip-manifest\n"
+            << "options for -verify:\n"
+            << "  -writers N       threads decompressing and checking packets "
+               "(default " << NUM_WRITERS << ")\n"
+            << "SIZE accepts K, M and G suffixes" << std::endl;
+  exit(1);
 }
 
 int main(int argc, char **argv)
 {
-  // TODO: do proper cmdline parsing using getopt or commandline.c
-  if(argc != 2 || (strcmp(argv[1], "-create") &&
-                   strcmp(argv[1], "-extract") &&
-                   strcmp(argv[1], "-tar"))) {
-    std::cerr << "usage: " << argv[0] << " [-create|-extract|-tar]" << std::endl;
+  enum { MODE_NONE, MODE_CREATE, MODE_EXTRACT, MODE_TAR, MODE_CREATE_TAR,
+         MODE_COPY, MODE_VERIFY };
+  enum { OPT_THREADS = 256, OPT_MAX_THREADS, OPT_PACKETS, OPT_CHUNK_SIZE,
+         OPT_MEMORY, OPT_AUTO_TUNE, OPT_ENGINE, OPT_URING_DEPTH,
+         OPT_WRITE_SIZE, OPT_WRITER_THREAD, OPT_STREAM, OPT_WRITERS,
+         OPT_NUMERIC_OWNER, OPT_WALKERS, OPT_INCLUDE, OPT_EXCLUDE,
+         OPT_SPLIT_SIZE, OPT_COMPRESS, OPT_COMPRESS_LEVEL, OPT_NO_CHECKSUM,
+         OPT_JOURNAL, OPT_SKIP_MANIFEST, OPT_SINCE, OPT_WRITE_INDEX,
+         OPT_PROGRESS, OPT_STATS, OPT_TAR_INDEX };
+  int mode = MODE_NONE;
+  const char* tarfile = NULL;
+  const char* journal_file = NULL;
+  const char* manifest_file = NULL;
+  const char* since_file = NULL;
+  const char* index_file = NULL;
+  double progress_interval = 0.;
+  const char* stats_file = NULL;
+  const char* tar_index_file = NULL;
+  static const struct option longopts[] = {
+    {"create", no_argument, NULL, MODE_CREATE},
+    {"extract", no_argument, NULL, MODE_EXTRACT},
+    {"tar", no_argument, NULL, MODE_TAR},
+    {"create-tar", required_argument, NULL, MODE_CREATE_TAR},
+    {"copy", no_argument, NULL, MODE_COPY},
+    {"verify", no_argument, NULL, MODE_VERIFY},
+    {"threads", required_argument, NULL, OPT_THREADS},
+    {"max-threads", required_argument, NULL, OPT_MAX_THREADS},
+    {"packets", required_argument, NULL, OPT_PACKETS},
+    {"chunk-size", required_argument, NULL, OPT_CHUNK_SIZE},
+    {"memory", required_argument, NULL, OPT_MEMORY},
+    {"auto-tune", no_argument, NULL, OPT_AUTO_TUNE},
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"uring-depth", required_argument, NULL, OPT_URING_DEPTH},
+    {"write-size", required_argument, NULL, OPT_WRITE_SIZE},
+    {"writer-thread", no_argument, NULL, OPT_WRITER_THREAD},
+    {"stream", no_argument, NULL, OPT_STREAM},
+    {"writers", required_argument, NULL, OPT_WRITERS},
+    {"numeric-owner", no_argument, NULL, OPT_NUMERIC_OWNER},
+    {"walkers", required_argument, NULL, OPT_WALKERS},
+    {"include", required_argument, NULL, OPT_INCLUDE},
+    {"exclude", required_argument, NULL, OPT_EXCLUDE},
+    {"split-size", required_argument, NULL, OPT_SPLIT_SIZE},
+    {"compress", no_argument, NULL, OPT_COMPRESS},
+    {"compress-level", required_argument, NULL, OPT_COMPRESS_LEVEL},
+    {"no-checksum", no_argument, NULL, OPT_NO_CHECKSUM},
+    {"journal", required_argument, NULL, OPT_JOURNAL},
+    {"skip-manifest", required_argument, NULL, OPT_SKIP_MANIFEST},
+    {"since", required_argument, NULL, OPT_SINCE},
+    {"write-index", required_argument, NULL, OPT_WRITE_INDEX},
+    {"progress", required_argument, NULL, OPT_PROGRESS},
+    {"stats", required_argument, NULL, OPT_STATS},
+    {"tar-index", required_argument, NULL, OPT_TAR_INDEX},
+    {NULL, 0, NULL, 0}
+  };
+
+  int opt;
+  while((opt = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+    switch(opt) {
+      case MODE_CREATE:
+      case MODE_EXTRACT:
+      case MODE_TAR:
+      case MODE_CREATE_TAR:
+      case MODE_COPY:
+      case MODE_VERIFY:
+        if(mode != MODE_NONE)
+          usage(argv[0]);
+        mode = opt;
+        if(mode == MODE_CREATE_TAR)
+          tarfile = optarg;
+        break;
+      case OPT_THREADS:
+        options.num_threads = parse_count(optarg, "threads");
+        break;
+      case OPT_MAX_THREADS:
+        options.max_threads = parse_count(optarg, "max-threads");
+        break;
+      case OPT_PACKETS:
+        options.num_packets = parse_count(optarg, "packets");
+        break;
+      case OPT_CHUNK_SIZE:
+        options.chunk_size = parse_size(optarg, "chunk-size");
+        break;
+      case OPT_MEMORY:
+        options.memory_budget = parse_size(optarg, "memory");
+        break;
+      case OPT_AUTO_TUNE:
+        options.auto_tune = true;
+        break;
+      case OPT_ENGINE:
+        if(strcmp(optarg, "threads") == 0) {
+          options.engine = ENGINE_THREADS;
+        } else if(strcmp(optarg, "uring") == 0) {
+          options.engine = ENGINE_URING;
+        } else {
+          std::cerr << "unknown engine '" << optarg << "'" << std::endl;
+          exit(1);
+        }
+        break;
+      case OPT_URING_DEPTH:
+        options.uring_depth = parse_count(optarg, "uring-depth");
+        if(options.uring_depth > 4096) {
+          std::cerr << "-uring-depth must be at most 4096" << std::endl;
+          exit(1);
+        }
+        break;
+      case OPT_WRITE_SIZE:
+        options.write_size = parse_size(optarg, "write-size");
+        break;
+      case OPT_WRITER_THREAD:
+        options.writer_thread = true;
+        break;
+      case OPT_STREAM:
+        options.stream_tar = true;
+        break;
+      case OPT_WRITERS:
+        options.num_writers = parse_count(optarg, "writers");
+        break;
+      case OPT_NUMERIC_OWNER:
+        options.numeric_owner = true;
+        break;
+      case OPT_WALKERS:
+        options.num_walkers = parse_count(optarg, "walkers");
+        break;
+      case OPT_INCLUDE:
+        walk_includes.push_back(optarg);
+        break;
+      case OPT_EXCLUDE:
+        walk_excludes.push_back(optarg);
+        break;
+      case OPT_COMPRESS:
+        if(options.compress_level == 0)
+          options.compress_level = Z_BEST_SPEED;
+        break;
+      case OPT_COMPRESS_LEVEL:
+        options.compress_level = parse_count(optarg, "compress-level");
+        if(options.compress_level > Z_BEST_COMPRESSION) {
+          std::cerr << "-compress-level must be at most "
+                    << Z_BEST_COMPRESSION << std::endl;
+          exit(1);
+        }
+        break;
+      case OPT_NO_CHECKSUM:
+        options.checksum = false;
+        break;
+      case OPT_JOURNAL:
+        journal_file = optarg;
+        break;
+      case OPT_SKIP_MANIFEST:
+        manifest_file = optarg;
+        break;
+      case OPT_SINCE:
+        since_file = optarg;
+        break;
+      case OPT_WRITE_INDEX:
+        index_file = optarg;
+        break;
+      case OPT_PROGRESS:
+        progress_interval = parse_seconds(optarg, "progress");
+        break;
+      case OPT_STATS:
+        stats_file = optarg;
+        break;
+      case OPT_TAR_INDEX:
+        tar_index_file = optarg;
+        break;
+      case OPT_SPLIT_SIZE:
+        options.split_size =
+          strcmp(optarg, "0") == 0 ? 0 : parse_size(optarg, "split-size");
+        break;
+      default:
+        usage(argv[0]);
+        break;
+    }
+  }
+  if(mode == MODE_NONE)
+    usage(argv[0]);
+  const char* copy_dst = NULL;
+  if(mode == MODE_COPY) {
+    if(argc - optind != 2)
+      usage(argv[0]);
+    copy_src = argv[optind];
+    while(copy_src.size() > 1 && copy_src[copy_src.size()-1] == '/')
+      copy_src.erase(copy_src.size()-1);
+    copy_dst = argv[optind+1];
+    walk_roots.push_back(copy_src);
+  } else if(optind != argc) {
+    if(mode != MODE_CREATE && mode != MODE_CREATE_TAR)
+      usage(argv[0]);
+    walk_roots.assign(argv + optind, argv + argc);
+  }
+  if(walk_roots.empty() && (!walk_includes.empty() || !walk_excludes.empty())) {
+    std::cerr << "-include and -exclude require directories to walk"
+              << std::endl;
+    exit(1);
+  }
+
+  if((journal_file && mode != MODE_EXTRACT) ||
+     ((manifest_file || since_file || index_file) && mode != MODE_CREATE)) {
+    std::cerr << "-journal requires -extract, -skip-manifest, -since and "
+                 "-write-index require -create" << std::endl;
+    exit(1);
+  }
+  if(options.compress_level && mode != MODE_CREATE) {
+    std::cerr << "-compress and -compress-level require -create" << std::endl;
+    exit(1);
+  }
+  // -create-tar and -copy have workers of their own that do not use io_uring
+  if(options.engine == ENGINE_URING && mode != MODE_CREATE) {
+    std::cerr << "-engine uring requires -create" << std::endl;
+    exit(1);
+  }
+  if(!options.checksum && mode != MODE_CREATE) {
+    std::cerr << "-no-checksum requires -create" << std::endl;
+    exit(1);
+  }
+  if(tar_index_file && mode != MODE_TAR && mode != MODE_CREATE_TAR) {
+    std::cerr << "-tar-index requires -tar or -create-tar" << std::endl;
+    exit(1);
+  }
+  const bool sending =
+    mode == MODE_CREATE || mode == MODE_CREATE_TAR || mode == MODE_COPY;
+  if((progress_interval > 0. || stats_file) && !sending) {
+    std::cerr << "-progress and -stats require -create, -create-tar or -copy"
+              << std::endl;
     exit(1);
   }
 
-  if(strcmp(argv[1], "-create") == 0)
+  if(options.auto_tune && options.max_threads < options.num_threads)
+    options.max_threads = options.num_threads;
+  // a byte budget is split evenly between all workers that may ever exist,
+  // each needs at least two packets to overlap reading and sending. -tar
+  // splits its budget itself, see maketar()
+  if(options.memory_budget && sending) {
+    const size_t max_threads =
+      options.auto_tune ? options.max_threads : options.num_threads;
+    options.num_packets =
+      int(std::max(size_t(2), options.memory_budget /
+                              (max_threads*files_per_worker()*
+                               options.chunk_size)));
+  }
+
+  // every free slot of a uring worker may tie up a packet in a WORK request
+  // that is never answered once the input is exhausted, so there must be
+  // more packets than slots for the remaining files to make progress
+  if(options.engine == ENGINE_URING && options.num_packets < 2)
+    options.num_packets = 2;
+
+  if(mode == MODE_CREATE_TAR) {
+    tar_fd = open(tarfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(tar_fd < 0) {
+      std::cerr << "Could not open " << tarfile << " for writing: "
+                << strerror(errno) << std::endl;
+      exit(1);
+    }
+  }
+
+  if(journal_file)
+    journal = new journal_t(journal_file);
+  if(manifest_file)
+    skip_manifest = new manifest_t(manifest_file);
+  if(since_file)
+    since_index = new file_index_t(since_file);
+  if(index_file)
+    new_index = new index_writer_t(index_file);
+  if(tar_index_file)
+    tar_index = new tar_index_writer_t(tar_index_file);
+
+  if(mode == MODE_COPY) {
+    if(mkdir(copy_dst, 0777) && errno != EEXIST) {
+      std::cerr << "failed to create directory '" << copy_dst << "': "
+                << strerror(errno) << std::endl;
+      exit(1);
+    }
+    copy_dirs = new dir_cache_t(copy_dst, max_dir_fds());
+  }
+
+  if(sending) {
+    if(progress_interval > 0. || stats_file)
+      run_stats = new stats_registry_t;
+    progress_reporter_t* progress = progress_interval > 0. ?
+      new progress_reporter_t(*run_stats, progress_interval) : NULL;
     sender();
-  else if(strcmp(argv[1], "-extract") == 0)
+    if(copy_dirs)
+      finish_copy_dirs(copy_dst);
+    delete progress;
+    if(stats_file)
+      run_stats->write_json(stats_file);
+  } else if(mode == MODE_EXTRACT)
     receiver();
-  else if(strcmp(argv[1], "-tar") == 0)
+  else if(mode == MODE_TAR)
     maketar();
+  else if(mode == MODE_VERIFY)
+    verify();
   else
     exit(1);
 
@@ -0,0 +1,186 @@
+// microbenchmark comparing the lock-free port used by parcp with the mutex
+// and condition variable based port it replaced. It mimics the traffic
+// pattern of parcp: each producer thread owns a fixed number of packets
+// which it pushes to a single master port, the master hands every packet it
+// pulls straight back to the producer's own port.
+//
+// usage: port_bench [packets per producer [round trips per producer]]
+
+#include <pthread.h>
+#include <time.h>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <queue>
+#include <vector>
+
+#include "mpsc_queue.h"
+
+// the port_t implementation parcp used before mpsc_queue_t
+template<class T>
+class locked_queue_t
+{
+  public:
+    locked_queue_t(size_t /* capacity */);
+    ~locked_queue_t();
+
+    void push(const T& value);
+    T pop();
+  private:
+    locked_queue_t(const locked_queue_t&);
+    locked_queue_t& operator=(const locked_queue_t&);
+
+    pthread_mutex_t lock;
+    pthread_cond_t wait;
+
+    std::queue<T> values;
+};
+
+template<class T>
+locked_queue_t<T>::locked_queue_t(size_t)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wait, NULL);
+}
+
+template<class T>
+locked_queue_t<T>::~locked_queue_t()
+{
+  pthread_cond_destroy(&wait);
+  pthread_mutex_destroy(&lock);
+}
+
+template<class T>
+void locked_queue_t<T>::push(const T& value)
+{
+  pthread_mutex_lock(&lock);
+  values.push(value);
+  pthread_cond_signal(&wait);
+  pthread_mutex_unlock(&lock);
+}
+
+template<class T>
+T locked_queue_t<T>::pop()
+{
+  pthread_mutex_lock(&lock);
+  while(values.empty())
+    pthread_cond_wait(&wait, &lock);
+  T retval = values.front();
+  values.pop();
+  pthread_mutex_unlock(&lock);
+
+  return retval;
+}
+
+template<class queue_t>
+struct producer_t;
+
+template<class queue_t>
+struct token_t
+{
+  producer_t<queue_t>* owner;
+};
+
+template<class queue_t>
+struct producer_t
+{
+  pthread_t thread;
+  queue_t* master;
+  queue_t* port;
+  int num_packets;
+  long round_trips;
+};
+
+template<class queue_t>
+static void* producer(void* callarg)
+{
+  producer_t<queue_t>* me = static_cast<producer_t<queue_t>*>(callarg);
+  std::vector<token_t<queue_t> > tokens(me->num_packets);
+  for(size_t i = 0 ; i < tokens.size() ; ++i) {
+    tokens[i].owner = me;
+    me->master->push(&tokens[i]);
+  }
+  for(long i = tokens.size() ; i < me->round_trips ; ++i) {
+    token_t<queue_t>* token = static_cast<token_t<queue_t>*>(me->port->pop());
+    me->master->push(token);
+  }
+  for(size_t i = 0 ; i < tokens.size() ; ++i)
+    me->port->pop();
+  return NULL;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return double(ts.tv_sec) + 1e-9*double(ts.tv_nsec);
+}
+
+// returns the number of packets per second the master handled
+template<class queue_t>
+static double run(int num_threads, int num_packets, long round_trips)
+{
+  queue_t master(num_threads*num_packets);
+  std::vector<queue_t*> ports(num_threads);
+  std::vector<producer_t<queue_t> > producers(num_threads);
+
+  const double start = now();
+  for(int i = 0 ; i < num_threads ; ++i) {
+    ports[i] = new queue_t(num_packets);
+    producers[i].master = &master;
+    producers[i].port = ports[i];
+    producers[i].num_packets = num_packets;
+    producers[i].round_trips = round_trips;
+    const int ierr = pthread_create(&producers[i].thread, NULL,
+                                    producer<queue_t>, &producers[i]);
+    if(ierr) {
+      fprintf(stderr, "Could not create thread %d: %s\n", i, strerror(ierr));
+      exit(1);
+    }
+  }
+
+  const long total = round_trips * num_threads;
+  for(long i = 0 ; i < total ; ++i) {
+    token_t<queue_t>* token = static_cast<token_t<queue_t>*>(master.pop());
+    token->owner->port->push(token);
+  }
+
+  for(int i = 0 ; i < num_threads ; ++i) {
+    pthread_join(producers[i].thread, NULL);
+    delete ports[i];
+  }
+  const double elapsed = now() - start;
+
+  return double(total) / elapsed;
+}
+
+// both queues hold opaque pointers so that token_t can refer to its own
+// queue type
+typedef locked_queue_t<void*> locked_t;
+typedef mpsc_queue_t<void*> lockfree_t;
+
+int main(int argc, char **argv)
+{
+  const int num_packets = argc > 1 ? atoi(argv[1]) : 10;
+  const long round_trips = argc > 2 ? atol(argv[2]) : 100000;
+  if(num_packets <= 0 || round_trips < num_packets) {
+    fprintf(stderr, "usage: %s [packets per producer [round trips per producer]]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  const int thread_counts[] = {4, 16, 64};
+  printf("%8s %16s %16s %8s\n", "threads", "mutex pkts/s", "lockfree pkts/s",
+         "speedup");
+  for(size_t i = 0 ; i < sizeof(thread_counts)/sizeof(thread_counts[0]) ; ++i) {
+    const int nt = thread_counts[i];
+    const double locked = run<locked_t>(nt, num_packets, round_trips);
+    const double lockfree = run<lockfree_t>(nt, num_packets, round_trips);
+    printf("%8d %16.0f %16.0f %8.2f\n", nt, locked, lockfree,
+           lockfree/locked);
+  }
+
+  return 0;
+}
@@ -0,0 +1,342 @@
+/* An LD_PRELOAD library that makes a local file system look like a slow
+   network one by sleeping before open, lstat, read and pread, so that
+   bench.sh can show how parcp and friends behave on NFS or Lustre without
+   one at hand.
+
+   SLOWFS_OPEN_US   microseconds added to each open, fopen and openat
+   SLOWFS_STAT_US   microseconds added to each lstat and fstatat
+   SLOWFS_READ_US   microseconds added to each read, pread and fread
+   SLOWFS_PATH      colon separated directories the latencies apply to, all
+                    files if unset
+
+   Reads are delayed only on descriptors opened below SLOWFS_PATH, so pipes
+   and the terminal stay fast. A relative name is taken relative to the
+   working directory, or to the directory a descriptor passed to openat or
+   fstatat refers to if that was itself opened below SLOWFS_PATH. Calls libc
+   makes internally and io_uring bypass the shim.
+
+   LD_PRELOAD=./slowfs.so SLOWFS_OPEN_US=500 SLOWFS_PATH=/tmp/tree cmd */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* descriptors beyond this are never delayed */
+#define MAX_FDS 65536
+#define MAX_PATHS 16
+
+static long open_us, stat_us, read_us;
+static char* paths[MAX_PATHS];
+static size_t num_paths;
+/* 1 for descriptors opened below one of the paths */
+static unsigned char slow_fds[MAX_FDS];
+
+static int (*real_open)(const char*, int, ...);
+static int (*real_open64)(const char*, int, ...);
+static int (*real_openat)(int, const char*, int, ...);
+static int (*real_openat64)(int, const char*, int, ...);
+static int (*real_open_2)(const char*, int);
+static int (*real_openat_2)(int, const char*, int);
+static FILE* (*real_fopen)(const char*, const char*);
+static FILE* (*real_fopen64)(const char*, const char*);
+static int (*real_close)(int);
+static int (*real_fclose)(FILE*);
+static int (*real_lstat)(const char*, struct stat*);
+static int (*real_lstat64)(const char*, struct stat64*);
+static int (*real_fstatat)(int, const char*, struct stat*, int);
+static int (*real_fstatat64)(int, const char*, struct stat64*, int);
+static ssize_t (*real_read)(int, void*, size_t);
+static ssize_t (*real_pread)(int, void*, size_t, off_t);
+static ssize_t (*real_pread64)(int, void*, size_t, off64_t);
+static size_t (*real_fread)(void*, size_t, size_t, FILE*);
+
+static long env_us(const char* name)
+{
+  const char* val = getenv(name);
+  return val ? atol(val) : 0;
+}
+
+static void init(void)
+{
+  real_open = dlsym(RTLD_NEXT, "open");
+  real_open64 = dlsym(RTLD_NEXT, "open64");
+  real_openat = dlsym(RTLD_NEXT, "openat");
+  real_openat64 = dlsym(RTLD_NEXT, "openat64");
+  real_open_2 = dlsym(RTLD_NEXT, "__open_2");
+  real_openat_2 = dlsym(RTLD_NEXT, "__openat_2");
+  real_fopen = dlsym(RTLD_NEXT, "fopen");
+  real_fopen64 = dlsym(RTLD_NEXT, "fopen64");
+  real_close = dlsym(RTLD_NEXT, "close");
+  real_fclose = dlsym(RTLD_NEXT, "fclose");
+  real_lstat = dlsym(RTLD_NEXT, "lstat");
+  real_lstat64 = dlsym(RTLD_NEXT, "lstat64");
+  real_fstatat = dlsym(RTLD_NEXT, "fstatat");
+  real_fstatat64 = dlsym(RTLD_NEXT, "fstatat64");
+  real_read = dlsym(RTLD_NEXT, "read");
+  real_pread = dlsym(RTLD_NEXT, "pread");
+  real_pread64 = dlsym(RTLD_NEXT, "pread64");
+  real_fread = dlsym(RTLD_NEXT, "fread");
+
+  open_us = env_us("SLOWFS_OPEN_US");
+  stat_us = env_us("SLOWFS_STAT_US");
+  read_us = env_us("SLOWFS_READ_US");
+
+  const char* env = getenv("SLOWFS_PATH");
+  if(env) {
+    char* list = strdup(env);
+    char* save = NULL;
+    for(char* dir = strtok_r(list, ":", &save) ;
+        dir && num_paths < MAX_PATHS ; dir = strtok_r(NULL, ":", &save)) {
+      char* resolved = realpath(dir, NULL);
+      paths[num_paths++] = resolved ? resolved : strdup(dir);
+    }
+  }
+}
+
+static void ensure_init(void)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init);
+}
+
+static void delay(long us)
+{
+  if(us <= 0)
+    return;
+  struct timespec ts;
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while(nanosleep(&ts, &ts) && errno == EINTR)
+    ;
+}
+
+static int is_slow_fd(int fd)
+{
+  return fd >= 0 && fd < MAX_FDS && slow_fds[fd];
+}
+
+static void mark_fd(int fd, int slow)
+{
+  if(fd >= 0 && fd < MAX_FDS)
+    slow_fds[fd] = (unsigned char)slow;
+}
+
+/* whether fn, relative to dirfd, lies below one of the paths */
+static int is_slow_path(int dirfd, const char* fn)
+{
+  if(num_paths == 0)
+    return 1;
+  if(fn[0] != '/' && dirfd != AT_FDCWD)
+    return is_slow_fd(dirfd);
+
+  char cwd[4096];
+  const char* path = fn;
+  char* joined = NULL;
+  if(fn[0] != '/') {
+    if(getcwd(cwd, sizeof(cwd)) == NULL)
+      return 0;
+    joined = malloc(strlen(cwd) + strlen(fn) + 2);
+    sprintf(joined, "%s/%s", cwd, fn);
+    path = joined;
+  }
+  int slow = 0;
+  for(size_t i = 0 ; i < num_paths && !slow ; ++i) {
+    const size_t len = strlen(paths[i]);
+    slow = strncmp(path, paths[i], len) == 0 &&
+           (path[len] == '/' || path[len] == '\0');
+  }
+  free(joined);
+  return slow;
+}
+
+/* the mode argument only exists with O_CREAT and O_TMPFILE */
+#define OPEN_MODE(flags, mode)                                  \
+  do {                                                          \
+    if((flags) & (O_CREAT|O_TMPFILE)) {                         \
+      va_list ap;                                               \
+      va_start(ap, flags);                                      \
+      mode = va_arg(ap, int);                                   \
+      va_end(ap);                                               \
+    }                                                           \
+  } while(0)
+
+static int slow_open(int dirfd, const char* fn, int flags, int mode,
+                     int (*real)(const char*, int, ...),
+                     int (*real_at)(int, const char*, int, ...))
+{
+  const int slow = is_slow_path(dirfd, fn);
+  if(slow)
+    delay(open_us);
+  const int fd = real ? real(fn, flags, mode)
+                      : real_at(dirfd, fn, flags, mode);
+  mark_fd(fd, slow);
+  return fd;
+}
+
+int open(const char* fn, int flags, ...)
+{
+  int mode = 0;
+  OPEN_MODE(flags, mode);
+  ensure_init();
+  return slow_open(AT_FDCWD, fn, flags, mode, real_open, NULL);
+}
+
+int open64(const char* fn, int flags, ...)
+{
+  int mode = 0;
+  OPEN_MODE(flags, mode);
+  ensure_init();
+  return slow_open(AT_FDCWD, fn, flags, mode, real_open64, NULL);
+}
+
+int openat(int dirfd, const char* fn, int flags, ...)
+{
+  int mode = 0;
+  OPEN_MODE(flags, mode);
+  ensure_init();
+  return slow_open(dirfd, fn, flags, mode, NULL, real_openat);
+}
+
+int openat64(int dirfd, const char* fn, int flags, ...)
+{
+  int mode = 0;
+  OPEN_MODE(flags, mode);
+  ensure_init();
+  return slow_open(dirfd, fn, flags, mode, NULL, real_openat64);
+}
+
+/* what open and openat turn into with _FORTIFY_SOURCE, as in GNU tar */
+int __open_2(const char* fn, int flags)
+{
+  ensure_init();
+  const int slow = is_slow_path(AT_FDCWD, fn);
+  if(slow)
+    delay(open_us);
+  const int fd = real_open_2(fn, flags);
+  mark_fd(fd, slow);
+  return fd;
+}
+
+int __openat_2(int dirfd, const char* fn, int flags)
+{
+  ensure_init();
+  const int slow = is_slow_path(dirfd, fn);
+  if(slow)
+    delay(open_us);
+  const int fd = real_openat_2(dirfd, fn, flags);
+  mark_fd(fd, slow);
+  return fd;
+}
+
+static FILE* slow_fopen(const char* fn, const char* how,
+                        FILE* (*real)(const char*, const char*))
+{
+  const int slow = is_slow_path(AT_FDCWD, fn);
+  if(slow)
+    delay(open_us);
+  FILE* fh = real(fn, how);
+  if(fh)
+    mark_fd(fileno(fh), slow);
+  return fh;
+}
+
+FILE* fopen(const char* fn, const char* how)
+{
+  ensure_init();
+  return slow_fopen(fn, how, real_fopen);
+}
+
+FILE* fopen64(const char* fn, const char* how)
+{
+  ensure_init();
+  return slow_fopen(fn, how, real_fopen64);
+}
+
+int close(int fd)
+{
+  ensure_init();
+  mark_fd(fd, 0);
+  return real_close(fd);
+}
+
+int fclose(FILE* fh)
+{
+  ensure_init();
+  mark_fd(fileno(fh), 0);
+  return real_fclose(fh);
+}
+
+int lstat(const char* fn, struct stat* statbuf)
+{
+  ensure_init();
+  if(is_slow_path(AT_FDCWD, fn))
+    delay(stat_us);
+  return real_lstat(fn, statbuf);
+}
+
+int lstat64(const char* fn, struct stat64* statbuf)
+{
+  ensure_init();
+  if(is_slow_path(AT_FDCWD, fn))
+    delay(stat_us);
+  return real_lstat64(fn, statbuf);
+}
+
+int fstatat(int dirfd, const char* fn, struct stat* statbuf, int flags)
+{
+  ensure_init();
+  if(is_slow_path(dirfd, fn))
+    delay(stat_us);
+  return real_fstatat(dirfd, fn, statbuf, flags);
+}
+
+int fstatat64(int dirfd, const char* fn, struct stat64* statbuf, int flags)
+{
+  ensure_init();
+  if(is_slow_path(dirfd, fn))
+    delay(stat_us);
+  return real_fstatat64(dirfd, fn, statbuf, flags);
+}
+
+ssize_t read(int fd, void* buf, size_t sz)
+{
+  ensure_init();
+  if(is_slow_fd(fd))
+    delay(read_us);
+  return real_read(fd, buf, sz);
+}
+
+ssize_t pread(int fd, void* buf, size_t sz, off_t offset)
+{
+  ensure_init();
+  if(is_slow_fd(fd))
+    delay(read_us);
+  return real_pread(fd, buf, sz, offset);
+}
+
+ssize_t pread64(int fd, void* buf, size_t sz, off64_t offset)
+{
+  ensure_init();
+  if(is_slow_fd(fd))
+    delay(read_us);
+  return real_pread64(fd, buf, sz, offset);
+}
+
+size_t fread(void* buf, size_t size, size_t count, FILE* fh)
+{
+  ensure_init();
+  if(is_slow_fd(fileno(fh)))
+    delay(read_us);
+  return real_fread(buf, size, count, fh);
+}
@@ -0,0 +1,390 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <string>
+
+// the operations whose latency is recorded
+enum stats_op_t { OP_LSTAT, OP_OPEN, OP_READ, OP_WRITE, NUM_OPS };
+
+static const char* const stats_op_names[NUM_OPS] = {
+  "lstat", "open", "read", "write"
+};
+
+static inline uint64_t stats_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec)*1000000000 + uint64_t(ts.tv_nsec);
+}
+
+// counters are only ever changed by the thread owning them, so a relaxed
+// load and store is enough for other threads to read them while they change
+// and is cheaper than an atomic add
+static inline void stats_add(uint64_t& counter, uint64_t val)
+{
+  __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + val,
+                   __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stats_get(const uint64_t& counter)
+{
+  return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
+
+// latencies of one kind of operation. Bucket i counts the operations that
+// took [2^i, 2^(i+1)) nanoseconds, bucket 0 also those that took none.
+struct histogram_t
+{
+  enum { NUM_BUCKETS = 64 };
+
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t bytes;
+  uint64_t buckets[NUM_BUCKETS];
+
+  histogram_t() : count(0), total_ns(0), max_ns(0), bytes(0)
+  {
+    memset(buckets, 0, sizeof(buckets));
+  };
+
+  void record(uint64_t ns, uint64_t sz = 0)
+  {
+    const int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    stats_add(buckets[bucket], 1);
+    stats_add(count, 1);
+    stats_add(total_ns, ns);
+    stats_add(bytes, sz);
+    if(ns > max_ns)
+      __atomic_store_n(&max_ns, ns, __ATOMIC_RELAXED);
+  };
+
+  void add(const histogram_t& other)
+  {
+    count += stats_get(other.count);
+    total_ns += stats_get(other.total_ns);
+    max_ns = std::max(max_ns, stats_get(other.max_ns));
+    bytes += stats_get(other.bytes);
+    for(int i = 0 ; i < NUM_BUCKETS ; ++i)
+      buckets[i] += stats_get(other.buckets[i]);
+  };
+
+  // upper bound of the bucket holding the p-th fraction of the operations
+  uint64_t percentile(double p) const
+  {
+    uint64_t seen = 0;
+    for(int i = 0 ; i < NUM_BUCKETS ; ++i) {
+      seen += buckets[i];
+      if(count && double(seen) >= p*double(count))
+        return (uint64_t(2) << i) - 1;
+    }
+    return 0;
+  };
+};
+
+// how many packets a thread found queued in its port when it pulled one
+struct depth_stats_t
+{
+  uint64_t pulls;
+  uint64_t total;
+  uint64_t max;
+
+  depth_stats_t() : pulls(0), total(0), max(0) {}
+
+  void record(size_t depth)
+  {
+    stats_add(pulls, 1);
+    stats_add(total, depth);
+    if(depth > max)
+      __atomic_store_n(&max, uint64_t(depth), __ATOMIC_RELAXED);
+  };
+};
+
+// the counters of one thread
+struct thread_stats_t
+{
+  std::string role;
+  uint64_t files;              // files the thread started on
+  histogram_t ops[NUM_OPS];
+  depth_stats_t queue;         // of the thread's port
+
+  thread_stats_t(const std::string& role_) : role(role_), files(0) {}
+};
+
+// the counters of all threads of a run, summed up for the -progress line
+// and written out as JSON for -stats. Threads register once and keep their
+// thread_stats_t for the rest of the run.
+class stats_registry_t
+{
+  public:
+    stats_registry_t();
+    ~stats_registry_t();
+
+    thread_stats_t* add_thread(const std::string& role);
+    // seconds since the registry was created
+    double elapsed() const;
+    // one line of rates since the previous call
+    std::string progress_line();
+    void write_json(const char* path);
+  private:
+    stats_registry_t(const stats_registry_t&);
+    stats_registry_t& operator=(const stats_registry_t&);
+
+    struct totals_t
+    {
+      uint64_t files;
+      histogram_t ops[NUM_OPS];
+      size_t workers;
+      depth_stats_t controller;
+    };
+    void sum(totals_t& totals);
+
+    pthread_mutex_t lock;
+    std::list<thread_stats_t*> threads;
+    uint64_t start_ns;
+    // state at the previous progress_line()
+    uint64_t last_ns;
+    uint64_t last_files;
+    uint64_t last_read;
+    uint64_t last_written;
+    uint64_t last_pulls;
+    uint64_t last_depth;
+};
+
+// prints the progress_line() of a registry to stderr every interval seconds
+// from a thread of its own until it is destroyed
+class progress_reporter_t
+{
+  public:
+    progress_reporter_t(stats_registry_t& stats, double interval);
+    ~progress_reporter_t();
+  private:
+    progress_reporter_t(const progress_reporter_t&);
+    progress_reporter_t& operator=(const progress_reporter_t&);
+
+    static void* run(void* callarg);
+
+    stats_registry_t& stats;
+    double interval;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+inline stats_registry_t::stats_registry_t() :
+  start_ns(stats_now_ns()), last_ns(start_ns), last_files(0), last_read(0),
+  last_written(0), last_pulls(0), last_depth(0)
+{
+  pthread_mutex_init(&lock, NULL);
+}
+
+inline stats_registry_t::~stats_registry_t()
+{
+  for(std::list<thread_stats_t*>::iterator it = threads.begin() ;
+      it != threads.end() ; ++it)
+    delete *it;
+  pthread_mutex_destroy(&lock);
+}
+
+inline thread_stats_t* stats_registry_t::add_thread(const std::string& role)
+{
+  thread_stats_t* stats = new thread_stats_t(role);
+  pthread_mutex_lock(&lock);
+  threads.push_back(stats);
+  pthread_mutex_unlock(&lock);
+  return stats;
+}
+
+inline double stats_registry_t::elapsed() const
+{
+  return 1e-9*double(stats_now_ns() - start_ns);
+}
+
+inline void stats_registry_t::sum(totals_t& totals)
+{
+  totals.files = 0;
+  totals.workers = 0;
+  pthread_mutex_lock(&lock);
+  for(std::list<thread_stats_t*>::const_iterator it = threads.begin() ;
+      it != threads.end() ; ++it) {
+    const thread_stats_t& stats = **it;
+    totals.files += stats_get(stats.files);
+    for(int op = 0 ; op < NUM_OPS ; ++op)
+      totals.ops[op].add(stats.ops[op]);
+    if(stats.role != "controller") {
+      totals.workers += 1;
+    } else {
+      totals.controller.pulls = stats_get(stats.queue.pulls);
+      totals.controller.total = stats_get(stats.queue.total);
+      totals.controller.max = stats_get(stats.queue.max);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+inline std::string stats_registry_t::progress_line()
+{
+  totals_t totals;
+  sum(totals);
+  const uint64_t now = stats_now_ns();
+  const double secs = std::max(1e-9*double(now - last_ns), 1e-9);
+  const uint64_t read = totals.ops[OP_READ].bytes;
+  const uint64_t written = totals.ops[OP_WRITE].bytes;
+  const uint64_t pulls = totals.controller.pulls - last_pulls;
+
+  char line[256];
+  snprintf(line, sizeof(line),
+           "%.0fs: %llu files (%.0f/s), read %.1f MB/s, wrote %.1f MB/s, "
+           "%zu workers, controller queue %.1f",
+           1e-9*double(now - start_ns), (unsigned long long)totals.files,
+           double(totals.files - last_files)/secs,
+           1e-6*double(read - last_read)/secs,
+           1e-6*double(written - last_written)/secs,
+           totals.workers,
+           pulls ? double(totals.controller.total - last_depth)/double(pulls)
+                 : 0.);
+
+  last_ns = now;
+  last_files = totals.files;
+  last_read = read;
+  last_written = written;
+  last_pulls = totals.controller.pulls;
+  last_depth = totals.controller.total;
+  return line;
+}
+
+inline void stats_registry_t::write_json(const char* path)
+{
+  FILE* fh = fopen(path, "w");
+  if(fh == NULL) {
+    std::cerr << "failed to create '" << path << "': " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+
+  totals_t totals;
+  sum(totals);
+  fprintf(fh, "{\n  \"elapsed_s\": %.6f,\n  \"files\": %llu,\n",
+          elapsed(), (unsigned long long)totals.files);
+
+  fprintf(fh, "  \"ops\": {");
+  for(int op = 0 ; op < NUM_OPS ; ++op) {
+    const histogram_t& hist = totals.ops[op];
+    fprintf(fh, "%s\n    \"%s\": {\"count\": %llu, \"bytes\": %llu, "
+            "\"total_s\": %.6f, \"max_ns\": %llu, \"p50_ns\": %llu, "
+            "\"p99_ns\": %llu, \"histogram_ns\": {",
+            op ? "," : "", stats_op_names[op],
+            (unsigned long long)hist.count, (unsigned long long)hist.bytes,
+            1e-9*double(hist.total_ns), (unsigned long long)hist.max_ns,
+            (unsigned long long)hist.percentile(0.5),
+            (unsigned long long)hist.percentile(0.99));
+    // buckets are keyed by their lower bound, empty ones are left out
+    bool first = true;
+    for(int i = 0 ; i < histogram_t::NUM_BUCKETS ; ++i) {
+      if(hist.buckets[i] == 0)
+        continue;
+      fprintf(fh, "%s\"%llu\": %llu", first ? "" : ", ",
+              i ? 1ULL << i : 0ULL, (unsigned long long)hist.buckets[i]);
+      first = false;
+    }
+    fprintf(fh, "}}");
+  }
+  fprintf(fh, "\n  },\n");
+
+  fprintf(fh, "  \"threads\": [");
+  pthread_mutex_lock(&lock);
+  bool first = true;
+  for(std::list<thread_stats_t*>::const_iterator it = threads.begin() ;
+      it != threads.end() ; ++it) {
+    const thread_stats_t& stats = **it;
+    fprintf(fh, "%s\n    {\"role\": \"%s\", \"files\": %llu",
+            first ? "" : ",", stats.role.c_str(),
+            (unsigned long long)stats_get(stats.files));
+    for(int op = 0 ; op < NUM_OPS ; ++op) {
+      const histogram_t& hist = stats.ops[op];
+      if(stats_get(hist.count) == 0)
+        continue;
+      fprintf(fh, ", \"%s\": {\"count\": %llu, \"bytes\": %llu, "
+              "\"total_s\": %.6f}", stats_op_names[op],
+              (unsigned long long)stats_get(hist.count),
+              (unsigned long long)stats_get(hist.bytes),
+              1e-9*double(stats_get(hist.total_ns)));
+    }
+    const uint64_t pulls = stats_get(stats.queue.pulls);
+    fprintf(fh, ", \"queue\": {\"pulls\": %llu, \"mean\": %.2f, "
+            "\"max\": %llu}", (unsigned long long)pulls,
+            pulls ? double(stats_get(stats.queue.total))/double(pulls) : 0.,
+            (unsigned long long)stats_get(stats.queue.max));
+    fprintf(fh, "}");
+    first = false;
+  }
+  pthread_mutex_unlock(&lock);
+  fprintf(fh, "\n  ]\n}\n");
+
+  if(ferror(fh) || fclose(fh)) {
+    std::cerr << "failed to write '" << path << "': " << strerror(errno)
+              << std::endl;
+    exit(1);
+  }
+}
+
+inline progress_reporter_t::progress_reporter_t(stats_registry_t& stats_,
+                                                double interval_) :
+  stats(stats_), interval(interval_), stop(false)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&cond, NULL);
+  const int ierr = pthread_create(&thread, NULL, run, this);
+  if(ierr) {
+    std::cerr << "Could not create progress thread: " << strerror(ierr)
+              << std::endl;
+    exit(1);
+  }
+}
+
+inline progress_reporter_t::~progress_reporter_t()
+{
+  pthread_mutex_lock(&lock);
+  stop = true;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+}
+
+inline void* progress_reporter_t::run(void* callarg)
+{
+  progress_reporter_t* me = static_cast<progress_reporter_t*>(callarg);
+  pthread_mutex_lock(&me->lock);
+  while(!me->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    const uint64_t ns = uint64_t(deadline.tv_nsec) + uint64_t(1e9*me->interval);
+    deadline.tv_sec += time_t(ns / 1000000000);
+    deadline.tv_nsec = long(ns % 1000000000);
+    while(!me->stop &&
+          pthread_cond_timedwait(&me->cond, &me->lock, &deadline) != ETIMEDOUT)
+      ;
+    // not std::cerr, which is tied to std::cout and would wait for a
+    // controller blocked writing the stream to stdout
+    if(!me->stop)
+      fputs(("parcp: " + me->stats.progress_line() + "\n").c_str(), stderr);
+  }
+  pthread_mutex_unlock(&me->lock);
+  return NULL;
+}
+
+#endif // STATS_H
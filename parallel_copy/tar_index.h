@@ -0,0 +1,204 @@
+#ifndef TAR_INDEX_H
+#define TAR_INDEX_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "file_index.h"
+
+// A tar index lists where each member of a tar file written by parcp -tar or
+// -create-tar starts, so that readers can list the tar file, extract single
+// members or split it among several extractors without reading every header.
+// It is a header, an array of fixed size records in the order of the members
+// in the tar file and the names themselves, all integers are little endian:
+//
+//   "PRTX", version (32 bit), number of records (64 bit)
+//   records of TAR_INDEX_RECORD_SIZE bytes: offset of the name in the file
+//   (64 bit), length of the name (32 bit), mode including the file type (32
+//   bit), offset of the first header of the member (64 bit), offset of its
+//   data (64 bit), bytes of data (64 bit), size of the file once extracted
+//   (64 bit)
+//   the names, without separators
+//
+// The headers of a member, including any PAX headers, lie between its header
+// and data offset. Only a sparse member's size differs from the size of the
+// extracted file, its data holds the extents without the holes and the map
+// of where they go is found at the end of its headers.
+#define TAR_INDEX_MAGIC "PRTX"
+#define TAR_INDEX_VERSION 1
+#define TAR_INDEX_HEADER_SIZE 16
+#define TAR_INDEX_RECORD_SIZE 48
+
+// where a member is found in the tar file
+struct tar_index_entry_t
+{
+  std::string name;
+  uint32_t mode;
+  uint64_t header_offset;
+  uint64_t data_offset;
+  uint64_t size;
+  uint64_t real_size;
+
+  tar_index_entry_t() :
+    mode(0), header_offset(0), data_offset(0), size(0), real_size(0) {}
+};
+
+// a tar index written alongside a tar file
+class tar_index_t
+{
+  public:
+    tar_index_t(const char* path);
+    ~tar_index_t();
+
+    size_t size() const { return count; };
+    tar_index_entry_t entry(size_t i) const;
+  private:
+    tar_index_t(const tar_index_t&);
+    tar_index_t& operator=(const tar_index_t&);
+
+    void corrupt() const;
+
+    std::string path;
+    const char* map;
+    size_t map_size;
+    size_t count;
+};
+
+// collects the members of a tar file as they are placed and writes the
+// index once the tar file is complete. Not thread safe, the members are
+// added by the thread that decides on their offsets.
+class tar_index_writer_t
+{
+  public:
+    tar_index_writer_t(const char* path);
+
+    void add(const tar_index_entry_t& entry) { entries.push_back(entry); };
+    // writes a temporary file that then replaces path
+    void write();
+  private:
+    tar_index_writer_t(const tar_index_writer_t&);
+    tar_index_writer_t& operator=(const tar_index_writer_t&);
+
+    std::string path;
+    std::vector<tar_index_entry_t> entries;
+};
+
+inline tar_index_t::tar_index_t(const char* path_) :
+  path(path_), map(NULL), map_size(0), count(0)
+{
+  const int fd = open(path_, O_RDONLY|O_CLOEXEC);
+  struct stat statbuf;
+  if(fd < 0 || fstat(fd, &statbuf)) {
+    std::cerr << "failed to open tar index '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  map_size = size_t(statbuf.st_size);
+  if(map_size < TAR_INDEX_HEADER_SIZE)
+    corrupt();
+  void* addr = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(addr == MAP_FAILED) {
+    std::cerr << "failed to map tar index '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+  close(fd);
+  map = static_cast<const char*>(addr);
+
+  if(memcmp(map, TAR_INDEX_MAGIC, 4) != 0 ||
+     index_get_le(map+4, 4) != TAR_INDEX_VERSION)
+    corrupt();
+  count = size_t(index_get_le(map+8, 8));
+  if(count > (map_size - TAR_INDEX_HEADER_SIZE) / TAR_INDEX_RECORD_SIZE)
+    corrupt();
+}
+
+inline tar_index_t::~tar_index_t()
+{
+  if(map)
+    munmap(const_cast<char*>(map), map_size);
+}
+
+inline void tar_index_t::corrupt() const
+{
+  std::cerr << "corrupt tar index '" << path << "'" << std::endl;
+  exit(1);
+}
+
+inline tar_index_entry_t tar_index_t::entry(size_t i) const
+{
+  const char* rec = map + TAR_INDEX_HEADER_SIZE + i*TAR_INDEX_RECORD_SIZE;
+  const uint64_t offset = index_get_le(rec, 8);
+  const uint64_t len = index_get_le(rec+8, 4);
+  if(offset > map_size || len > map_size - offset)
+    corrupt();
+  tar_index_entry_t entry;
+  entry.name.assign(map + offset, size_t(len));
+  entry.mode = uint32_t(index_get_le(rec+12, 4));
+  entry.header_offset = index_get_le(rec+16, 8);
+  entry.data_offset = index_get_le(rec+24, 8);
+  entry.size = index_get_le(rec+32, 8);
+  entry.real_size = index_get_le(rec+40, 8);
+  if(entry.data_offset < entry.header_offset)
+    corrupt();
+  return entry;
+}
+
+inline tar_index_writer_t::tar_index_writer_t(const char* path_) :
+  path(path_)
+{
+}
+
+inline void tar_index_writer_t::write()
+{
+  const std::string tmp = path + ".tmp";
+  FILE* fh = fopen(tmp.c_str(), "w");
+  if(fh == NULL) {
+    std::cerr << "failed to create tar index '" << tmp << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  char header[TAR_INDEX_HEADER_SIZE];
+  memcpy(header, TAR_INDEX_MAGIC, 4);
+  index_put_le(header+4, TAR_INDEX_VERSION, 4);
+  index_put_le(header+8, entries.size(), 8);
+  fwrite(header, sizeof(header), 1, fh);
+
+  uint64_t name_offset =
+    TAR_INDEX_HEADER_SIZE + entries.size()*TAR_INDEX_RECORD_SIZE;
+  for(size_t i = 0 ; i < entries.size() ; ++i) {
+    const tar_index_entry_t& entry = entries[i];
+    char rec[TAR_INDEX_RECORD_SIZE];
+    index_put_le(rec, name_offset, 8);
+    index_put_le(rec+8, entry.name.size(), 4);
+    index_put_le(rec+12, entry.mode, 4);
+    index_put_le(rec+16, entry.header_offset, 8);
+    index_put_le(rec+24, entry.data_offset, 8);
+    index_put_le(rec+32, entry.size, 8);
+    index_put_le(rec+40, entry.real_size, 8);
+    fwrite(rec, sizeof(rec), 1, fh);
+    name_offset += entry.name.size();
+  }
+  for(size_t i = 0 ; i < entries.size() ; ++i)
+    fwrite(entries[i].name.data(), 1, entries[i].name.size(), fh);
+
+  if(ferror(fh) || fclose(fh) || rename(tmp.c_str(), path.c_str())) {
+    std::cerr << "failed to write tar index '" << path << "': "
+              << strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+#endif // TAR_INDEX_H
@@ -0,0 +1,407 @@
+#ifndef TREE_WALKER_H
+#define TREE_WALKER_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+
+#include <stdint.h>
+
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mpsc_queue.h"
+
+// lists the regular files and symbolic links below a set of roots, like
+// "find ROOT... -type f -o -type l", using several threads. Each thread
+// keeps a deque of directories still to be read, it works depth first from
+// the back of its own deque and when that runs dry steals the oldest, and
+// usually largest, subtree from the front of another thread's deque.
+// Directories are read with getdents64, entries whose type the file system
+// does not report are classified with fstatat relative to the directory.
+//
+// Names are filtered like find does with -name and -path: a pattern without
+// a '/' is matched against the last component, one with a '/' against the
+// whole name. Directories matching an exclude pattern are not descended
+// into. If there are include patterns a file must match one of them.
+//
+// next() hands out the names in no particular order and blocks until a name
+// is available or the walk is complete. Walkers that get more than NAME_QUEUE
+// names ahead of next() park until it catches up.
+//
+// If a visitor is given it is told about each directory, including the roots,
+// before the directory is read. It is called from the walker threads, a
+// directory is always visited after its parent.
+class tree_walker_visitor_t
+{
+  public:
+    virtual ~tree_walker_visitor_t() {}
+    virtual void visit_dir(const std::string& dir,
+                           const struct stat& statbuf) = 0;
+};
+
+class tree_walker_t
+{
+  public:
+    tree_walker_t(const std::vector<std::string>& roots, int num_threads,
+                  const std::vector<std::string>& includes,
+                  const std::vector<std::string>& excludes,
+                  tree_walker_visitor_t* visitor = NULL);
+    ~tree_walker_t();
+
+    // returns false once all names have been handed out
+    bool next(std::string& name);
+  private:
+    tree_walker_t(const tree_walker_t&);
+    tree_walker_t& operator=(const tree_walker_t&);
+
+    struct walker_t {
+      tree_walker_t* walk;
+      size_t index;
+      pthread_t thread;
+      pthread_mutex_t lock;
+      std::deque<std::string> dirs;
+    };
+
+    // bytes of directory entries read per getdents64 call
+    enum { DIRENT_BUFFER = 64*1024 };
+    // names that may wait for next() before walkers park
+    enum { NAME_QUEUE = 4096 };
+
+    static void* walker(void* callarg);
+    void add_roots(walker_t* me);
+    void finish_dir();
+    bool take(walker_t* me, std::string& dir);
+    void push_dir(walker_t* me, const std::string& dir);
+    void read_dir(walker_t* me, const std::string& dir,
+                  std::vector<char>& buf);
+    void add(walker_t* me, const std::string& path, bool is_dir);
+    bool matches(const std::vector<std::string>& patterns,
+                 const std::string& path) const;
+
+    std::vector<std::string> roots;
+    std::vector<std::string> includes;
+    std::vector<std::string> excludes;
+    tree_walker_visitor_t* visitor;
+    std::vector<walker_t*> walkers;
+
+    // directories queued or being read, the walk is over when it drops to 0
+    long pending;
+    long queued; // directories in the deques
+    int idle;    // walkers waiting for directories
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_wait;
+    int running; // walkers that have not exited yet
+
+    // the queue has room for NAME_QUEUE names plus one per walker and the
+    // end marker, since a walker only parks after pushing its name
+    mpsc_queue_t<std::string*> names;
+    long queued_names;
+    int parked; // walkers waiting for next() to catch up
+    pthread_mutex_t park_lock;
+    pthread_cond_t park_wait;
+    bool done;
+};
+
+inline tree_walker_t::tree_walker_t(const std::vector<std::string>& roots_,
+                                    int num_threads,
+                                    const std::vector<std::string>& includes_,
+                                    const std::vector<std::string>& excludes_,
+                                    tree_walker_visitor_t* visitor_) :
+  roots(roots_), includes(includes_), excludes(excludes_), visitor(visitor_),
+  // the roots count as one pending directory until the first walker has
+  // looked at them, so that the other walkers do not quit early
+  pending(1), queued(0), idle(0),
+  running(num_threads), names(NAME_QUEUE + num_threads + 1),
+  queued_names(0), parked(0), done(false)
+{
+  pthread_mutex_init(&idle_lock, NULL);
+  pthread_cond_init(&idle_wait, NULL);
+  pthread_mutex_init(&park_lock, NULL);
+  pthread_cond_init(&park_wait, NULL);
+
+  for(int i = 0 ; i < num_threads ; ++i) {
+    walker_t* w = new walker_t;
+    w->walk = this;
+    w->index = size_t(i);
+    pthread_mutex_init(&w->lock, NULL);
+    walkers.push_back(w);
+  }
+
+  for(int i = 0 ; i < num_threads ; ++i) {
+    const int ierr = pthread_create(&walkers[i]->thread, NULL, walker,
+                                    walkers[i]);
+    if(ierr) {
+      std::cerr << "Could not create walker thread " << i << ": "
+                << strerror(ierr) << std::endl;
+      exit(1);
+    }
+  }
+}
+
+inline tree_walker_t::~tree_walker_t()
+{
+  // drain the names so that parked walkers can finish
+  std::string name;
+  while(next(name))
+    ;
+  for(size_t i = 0 ; i < walkers.size() ; ++i) {
+    pthread_join(walkers[i]->thread, NULL);
+    pthread_mutex_destroy(&walkers[i]->lock);
+    delete walkers[i];
+  }
+  pthread_cond_destroy(&park_wait);
+  pthread_mutex_destroy(&park_lock);
+  pthread_cond_destroy(&idle_wait);
+  pthread_mutex_destroy(&idle_lock);
+}
+
+inline bool tree_walker_t::next(std::string& name)
+{
+  if(done)
+    return false;
+  std::string* p = names.pop();
+  if(p == NULL) {
+    done = true;
+    return false;
+  }
+  name.swap(*p);
+  delete p;
+
+  // pairs with the check in add(): either a parked walker sees the room we
+  // made or we see that it is waiting
+  if(__sync_sub_and_fetch(&queued_names, 1) <= NAME_QUEUE &&
+     __sync_fetch_and_add(&parked, 0) > 0) {
+    pthread_mutex_lock(&park_lock);
+    pthread_cond_broadcast(&park_wait);
+    pthread_mutex_unlock(&park_lock);
+  }
+  return true;
+}
+
+inline bool tree_walker_t::matches(const std::vector<std::string>& patterns,
+                                   const std::string& path) const
+{
+  const size_t slash = path.rfind('/');
+  const char* base =
+    path.c_str() + (slash == std::string::npos ? 0 : slash+1);
+  for(size_t i = 0 ; i < patterns.size() ; ++i) {
+    const bool whole = patterns[i].find('/') != std::string::npos;
+    if(fnmatch(patterns[i].c_str(), whole ? path.c_str() : base, 0) == 0)
+      return true;
+  }
+  return false;
+}
+
+inline void tree_walker_t::add(walker_t* me, const std::string& path,
+                               bool is_dir)
+{
+  if(matches(excludes, path))
+    return;
+  if(is_dir) {
+    push_dir(me, path);
+  } else if(includes.empty() || matches(includes, path)) {
+    names.push(new std::string(path));
+    if(__sync_add_and_fetch(&queued_names, 1) > NAME_QUEUE) {
+      pthread_mutex_lock(&park_lock);
+      __sync_fetch_and_add(&parked, 1);
+      while(__sync_fetch_and_add(&queued_names, 0) > NAME_QUEUE)
+        pthread_cond_wait(&park_wait, &park_lock);
+      __sync_fetch_and_sub(&parked, 1);
+      pthread_mutex_unlock(&park_lock);
+    }
+  }
+}
+
+inline void tree_walker_t::push_dir(walker_t* me, const std::string& dir)
+{
+  __sync_fetch_and_add(&pending, 1);
+  pthread_mutex_lock(&me->lock);
+  me->dirs.push_back(dir);
+  pthread_mutex_unlock(&me->lock);
+  __sync_fetch_and_add(&queued, 1);
+
+  // pairs with the check in take(): either an idle walker sees the new
+  // directory or we see that it is waiting
+  if(__sync_fetch_and_add(&idle, 0) > 0) {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_wait);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+// get the next directory to read, returns false once the walk is complete
+inline bool tree_walker_t::take(walker_t* me, std::string& dir)
+{
+  while(true) {
+    // own work first, newest first
+    pthread_mutex_lock(&me->lock);
+    if(!me->dirs.empty()) {
+      dir.swap(me->dirs.back());
+      me->dirs.pop_back();
+      pthread_mutex_unlock(&me->lock);
+      __sync_fetch_and_sub(&queued, 1);
+      return true;
+    }
+    pthread_mutex_unlock(&me->lock);
+
+    // steal the oldest directory of someone else
+    for(size_t i = 1 ; i < walkers.size() ; ++i) {
+      walker_t* victim = walkers[(me->index + i) % walkers.size()];
+      pthread_mutex_lock(&victim->lock);
+      if(!victim->dirs.empty()) {
+        dir.swap(victim->dirs.front());
+        victim->dirs.pop_front();
+        pthread_mutex_unlock(&victim->lock);
+        __sync_fetch_and_sub(&queued, 1);
+        return true;
+      }
+      pthread_mutex_unlock(&victim->lock);
+    }
+
+    pthread_mutex_lock(&idle_lock);
+    __sync_fetch_and_add(&idle, 1);
+    while(__sync_fetch_and_add(&queued, 0) == 0 &&
+          __sync_fetch_and_add(&pending, 0) > 0)
+      pthread_cond_wait(&idle_wait, &idle_lock);
+    __sync_fetch_and_sub(&idle, 1);
+    const bool finished = __sync_fetch_and_add(&pending, 0) == 0;
+    pthread_mutex_unlock(&idle_lock);
+    if(finished)
+      return false;
+  }
+}
+
+// the layout of the records returned by getdents64
+struct tree_walker_dirent64_t
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+inline void tree_walker_t::read_dir(walker_t* me, const std::string& dir,
+                                    std::vector<char>& buf)
+{
+  const int fd = open(dir.c_str(),
+                      O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+  if(fd < 0) {
+    // like find, report the directory and go on with the rest
+    std::cerr << "failed to open directory '" << dir << "': "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  if(visitor) {
+    struct stat statbuf;
+    if(fstat(fd, &statbuf)) {
+      std::cerr << "failed to stat directory '" << dir << "': "
+                << strerror(errno) << std::endl;
+      close(fd);
+      return;
+    }
+    visitor->visit_dir(dir, statbuf);
+  }
+
+  const std::string prefix = dir == "/" ? dir : dir + "/";
+  while(true) {
+    const long nread = syscall(SYS_getdents64, fd, &buf[0], buf.size());
+    if(nread < 0) {
+      std::cerr << "failed to read directory '" << dir << "': "
+                << strerror(errno) << std::endl;
+      break;
+    }
+    if(nread == 0)
+      break;
+
+    for(long pos = 0 ; pos < nread ; ) {
+      const tree_walker_dirent64_t* entry =
+        reinterpret_cast<const tree_walker_dirent64_t*>(&buf[pos]);
+      pos += entry->d_reclen;
+      const char* name = entry->d_name;
+      if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+
+      unsigned char type = entry->d_type;
+      if(type == DT_UNKNOWN) {
+        struct stat statbuf;
+        if(fstatat(fd, name, &statbuf, AT_SYMLINK_NOFOLLOW)) {
+          std::cerr << "failed to stat '" << prefix << name << "': "
+                    << strerror(errno) << std::endl;
+          continue;
+        }
+        type = S_ISDIR(statbuf.st_mode) ? DT_DIR :
+               S_ISREG(statbuf.st_mode) ? DT_REG :
+               S_ISLNK(statbuf.st_mode) ? DT_LNK : DT_UNKNOWN;
+      }
+      if(type == DT_DIR || type == DT_REG || type == DT_LNK)
+        add(me, prefix + name, type == DT_DIR);
+    }
+  }
+  close(fd);
+}
+
+// the roots are handled like the entries of a directory, the others steal
+// from the first walker to get started
+inline void tree_walker_t::add_roots(walker_t* me)
+{
+  for(size_t i = 0 ; i < roots.size() ; ++i) {
+    std::string root = roots[i];
+    while(root.size() > 1 && root[root.size()-1] == '/')
+      root.erase(root.size()-1);
+    struct stat statbuf;
+    if(lstat(root.c_str(), &statbuf)) {
+      std::cerr << "failed to stat '" << root << "': " << strerror(errno)
+                << std::endl;
+      continue;
+    }
+    if(S_ISDIR(statbuf.st_mode))
+      push_dir(me, root);
+    else if(S_ISREG(statbuf.st_mode) || S_ISLNK(statbuf.st_mode))
+      add(me, root, false);
+  }
+  finish_dir();
+}
+
+// a directory has been read completely
+inline void tree_walker_t::finish_dir()
+{
+  if(__sync_sub_and_fetch(&pending, 1) == 0) {
+    // wake everybody so that they notice the end of the walk
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_broadcast(&idle_wait);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+inline void* tree_walker_t::walker(void* callarg)
+{
+  walker_t* me = static_cast<walker_t*>(callarg);
+  tree_walker_t* walk = me->walk;
+  std::vector<char> buf(DIRENT_BUFFER);
+  std::string dir;
+
+  if(me->index == 0)
+    walk->add_roots(me);
+  while(walk->take(me, dir)) {
+    walk->read_dir(me, dir, buf);
+    walk->finish_dir();
+  }
+
+  // the last walker out marks the end of the names
+  if(__sync_sub_and_fetch(&walk->running, 1) == 0)
+    walk->names.push(NULL);
+  return NULL;
+}
+
+#endif // TREE_WALKER_H
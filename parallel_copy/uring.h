@@ -0,0 +1,178 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+// a minimal io_uring submission and completion queue pair driven directly by
+// the system calls, so that no liburing is required. Only one thread may use
+// a ring at a time. If the kernel does not support io_uring valid() returns
+// false and error() holds the errno of the failed setup.
+class uring_t
+{
+  public:
+    uring_t(unsigned entries);
+    ~uring_t();
+
+    bool valid() const { return fd >= 0; };
+    int error() const { return setup_errno; };
+
+    // returns a zeroed submission entry or NULL if the queue is full
+    struct io_uring_sqe* get_sqe();
+    // hands all entries obtained from get_sqe() to the kernel and waits
+    // until at least wait_nr completions are available, returns a negative
+    // errno on failure
+    int submit(unsigned wait_nr);
+    // returns the oldest completion or NULL if there is none
+    struct io_uring_cqe* peek_cqe();
+    // releases the completion returned by peek_cqe()
+    void cqe_seen();
+  private:
+    uring_t(const uring_t&);
+    uring_t& operator=(const uring_t&);
+
+    int fd;
+    int setup_errno;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    unsigned sqe_head; // entries handed out by get_sqe() but not submitted
+    unsigned sqe_tail;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+inline uring_t::uring_t(unsigned entries) :
+  fd(-1), setup_errno(0), sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED),
+  cq_size(0), sqes(NULL), sqes_size(0), sqe_head(0), sqe_tail(0)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd = int(syscall(__NR_io_uring_setup, entries, &params));
+  if(fd < 0) {
+    setup_errno = errno;
+    return;
+  }
+
+  sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = std::max(sq_size, cq_size);
+
+  sq_ptr = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING);
+  if(sq_ptr == MAP_FAILED)
+    goto fail;
+  if(params.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ptr = sq_ptr;
+  } else {
+    cq_ptr = mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if(cq_ptr == MAP_FAILED)
+      goto fail;
+  }
+  sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+  sqes = static_cast<struct io_uring_sqe*>(
+    mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+         IORING_OFF_SQES));
+  if(sqes == MAP_FAILED) {
+    sqes = NULL;
+    goto fail;
+  }
+
+  {
+    char* sq = static_cast<char*>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+  return;
+
+  fail:
+  setup_errno = errno;
+  close(fd);
+  fd = -1;
+}
+
+inline uring_t::~uring_t()
+{
+  if(sqes)
+    munmap(sqes, sqes_size);
+  if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+    munmap(cq_ptr, cq_size);
+  if(sq_ptr != MAP_FAILED)
+    munmap(sq_ptr, sq_size);
+  if(fd >= 0)
+    close(fd);
+}
+
+inline struct io_uring_sqe* uring_t::get_sqe()
+{
+  const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if(sqe_tail - head >= sq_entries)
+    return NULL;
+  struct io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+  sqe_tail += 1;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+inline int uring_t::submit(unsigned wait_nr)
+{
+  unsigned tail = *sq_tail;
+  const unsigned to_submit = sqe_tail - sqe_head;
+  for( ; sqe_head != sqe_tail ; ++sqe_head, ++tail)
+    sq_array[tail & sq_mask] = sqe_head & sq_mask;
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+  if(to_submit == 0 && wait_nr == 0)
+    return 0;
+  int ret;
+  do {
+    ret = int(syscall(__NR_io_uring_enter, fd, to_submit, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+  } while(ret < 0 && errno == EINTR);
+  return ret < 0 ? -errno : ret;
+}
+
+inline struct io_uring_cqe* uring_t::peek_cqe()
+{
+  const unsigned head = *cq_head;
+  if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &cqes[head & cq_mask];
+}
+
+inline void uring_t::cqe_seen()
+{
+  __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // URING_H
@@ -0,0 +1,251 @@
+#ifndef WRITE_BEHIND_H
+#define WRITE_BEHIND_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "mpsc_queue.h"
+
+// collects writes to a file descriptor into large contiguous extents which
+// are written with a single pwritev each. A write that starts where an
+// unwritten extent ends is appended to it, so data arriving in file order is
+// coalesced no matter how small the individual writes are. An extent is
+// written once it holds flush_size bytes, once too many extents are open or
+// when flush() is called. Optionally a dedicated thread does the writing so
+// that the caller can go on reading its input.
+//
+// If fd cannot seek, e.g. because it is a pipe, the caller must write
+// sequentially starting at offset 0, extents are then written with writev.
+class write_behind_t
+{
+  public:
+    write_behind_t(int fd, buffer_pool_t* pool, size_t flush_size,
+                   bool use_thread);
+    ~write_behind_t();
+
+    // queue sz bytes from buf for writing at offset. Large writes take over
+    // buf, which is then replaced by a fresh buffer from the pool, small ones
+    // are copied.
+    void write(off_t offset, buffer_t& buf, size_t sz);
+    // write all queued data and wait for it to be written
+    void flush();
+    bool seekable() const { return can_seek; };
+  private:
+    write_behind_t(const write_behind_t&);
+    write_behind_t& operator=(const write_behind_t&);
+
+    struct extent_t {
+      off_t offset;
+      size_t size;
+      std::vector<buffer_t> bufs;
+      std::vector<size_t> used; // bytes used in each of bufs
+    };
+
+    // writes smaller than this are copied rather than taking over the buffer
+    enum { COPY_LIMIT = 16*1024 };
+    // at most this many extents are collected at once
+    enum { MAX_EXTENTS = 64 };
+
+    void append(extent_t* extent, buffer_t& buf, size_t sz);
+    void submit(extent_t* extent);
+    void write_extent(extent_t* extent);
+    static void* writer(void* callarg);
+
+    int fd;
+    buffer_pool_t* pool;
+    size_t flush_size;
+    size_t max_iov;
+    bool can_seek;
+    off_t next_offset; // where the next extent must start if !can_seek
+    // extents that are still being collected, by the offset they end at
+    std::map<off_t, extent_t*> extents;
+
+    bool use_thread;
+    pthread_t thread;
+    mpsc_queue_t<extent_t*>* queue; // extents for the writer thread
+    // signals the end of a flush by the writer thread
+    mpsc_queue_t<extent_t*>* done;
+};
+
+inline write_behind_t::write_behind_t(int fd_, buffer_pool_t* pool_,
+                                      size_t flush_size_, bool use_thread_) :
+  fd(fd_), pool(pool_), flush_size(flush_size_), next_offset(0),
+  use_thread(use_thread_), queue(NULL), done(NULL)
+{
+  can_seek = lseek(fd, 0, SEEK_CUR) >= 0;
+  const long iov_max = sysconf(_SC_IOV_MAX);
+  max_iov = iov_max > 0 ? size_t(iov_max) : 16;
+
+  if(use_thread) {
+    // every extent ever open may be queued plus the end of flush marker
+    queue = new mpsc_queue_t<extent_t*>(2*MAX_EXTENTS+1);
+    done = new mpsc_queue_t<extent_t*>(1);
+    const int ierr = pthread_create(&thread, NULL, writer, this);
+    if(ierr) {
+      std::cerr << "Could not create writer thread: " << strerror(ierr)
+                << std::endl;
+      exit(1);
+    }
+  }
+}
+
+inline write_behind_t::~write_behind_t()
+{
+  flush();
+  if(use_thread) {
+    queue->push(NULL);
+    done->pop();
+    pthread_join(thread, NULL);
+    delete done;
+    delete queue;
+  }
+}
+
+inline void write_behind_t::write(off_t offset, buffer_t& buf, size_t sz)
+{
+  if(sz == 0)
+    return;
+
+  extent_t* extent;
+  std::map<off_t, extent_t*>::iterator it = extents.find(offset);
+  if(it != extents.end()) {
+    extent = it->second;
+    extents.erase(it);
+  } else {
+    if(extents.size() >= MAX_EXTENTS) {
+      submit(extents.begin()->second);
+      extents.erase(extents.begin());
+    }
+    extent = new extent_t;
+    extent->offset = offset;
+    extent->size = 0;
+  }
+
+  append(extent, buf, sz);
+
+  if(extent->size >= flush_size || extent->bufs.size() >= max_iov)
+    submit(extent);
+  else
+    extents[extent->offset + off_t(extent->size)] = extent;
+}
+
+inline void write_behind_t::append(extent_t* extent, buffer_t& buf, size_t sz)
+{
+  if(sz >= COPY_LIMIT) {
+    extent->bufs.push_back(buf);
+    extent->used.push_back(sz);
+    buf = pool->get();
+  } else {
+    if(extent->bufs.empty() ||
+       extent->bufs.back().capacity - extent->used.back() < sz) {
+      extent->bufs.push_back(pool->get());
+      extent->used.push_back(0);
+    }
+    memcpy(extent->bufs.back().data + extent->used.back(), buf.data, sz);
+    extent->used.back() += sz;
+  }
+  extent->size += sz;
+}
+
+inline void write_behind_t::flush()
+{
+  for(std::map<off_t, extent_t*>::iterator it = extents.begin() ;
+      it != extents.end() ; ++it)
+    submit(it->second);
+  extents.clear();
+
+  if(use_thread) {
+    // an extent without data asks the writer to report back
+    extent_t* marker = new extent_t;
+    marker->offset = 0;
+    marker->size = 0;
+    queue->push(marker);
+    delete done->pop();
+  }
+}
+
+inline void write_behind_t::submit(extent_t* extent)
+{
+  if(use_thread)
+    queue->push(extent);
+  else
+    write_extent(extent);
+}
+
+// write an extent and return its buffers to the pool
+inline void write_behind_t::write_extent(extent_t* extent)
+{
+  std::vector<struct iovec> iov(extent->bufs.size());
+  for(size_t i = 0 ; i < iov.size() ; ++i) {
+    iov[i].iov_base = extent->bufs[i].data;
+    iov[i].iov_len = extent->used[i];
+  }
+
+  if(!can_seek) {
+    if(extent->offset != next_offset) {
+      std::cerr << "cannot write at offset " << extent->offset
+                << " to a pipe positioned at " << next_offset << std::endl;
+      exit(1);
+    }
+    next_offset += off_t(extent->size);
+  }
+
+  off_t offset = extent->offset;
+  size_t first = 0;
+  while(first < iov.size()) {
+    const int count = int(iov.size()-first);
+    const ssize_t written = can_seek ? pwritev(fd, &iov[first], count, offset)
+                                     : writev(fd, &iov[first], count);
+    if(written < 0) {
+      if(errno == EINTR)
+        continue;
+      std::cerr << "failed to write " << extent->size << " bytes at offset "
+                << extent->offset << ": " << strerror(errno) << std::endl;
+      exit(1);
+    }
+    offset += written;
+    // skip over what was written, which may end inside an iovec
+    for(size_t left = size_t(written) ; left > 0 ; ) {
+      if(left >= iov[first].iov_len) {
+        left -= iov[first].iov_len;
+        first += 1;
+      } else {
+        iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+        iov[first].iov_len -= left;
+        left = 0;
+      }
+    }
+  }
+
+  for(size_t i = 0 ; i < extent->bufs.size() ; ++i)
+    pool->put(extent->bufs[i]);
+  delete extent;
+}
+
+inline void* write_behind_t::writer(void* callarg)
+{
+  write_behind_t* me = static_cast<write_behind_t*>(callarg);
+  while(true) {
+    extent_t* extent = me->queue->pop();
+    if(extent == NULL) {
+      me->done->push(NULL);
+      break;
+    } else if(extent->size == 0) {
+      me->done->push(extent);
+    } else {
+      me->write_extent(extent);
+    }
+  }
+  return NULL;
+}
+
+#endif // WRITE_BEHIND_H
@@ -2,14 +2,23 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
 
 #include <cstdio>
 #include <queue>
+#include <deque>
+#include <map>
+#include <string>
 #include <cstring>
 #include <cerrno>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
+
+#include "dir_cache.h"
+#include "tar_index.h"
 
 #define NUM_PACKETS 10
 #define NUM_THREADS 4
@@ -20,8 +29,12 @@
 #define TAROPTS {(char*)ENVCOMMAND, (char*)"tar", (char*)"x", NULL}
 #define BUFFER_SIZE 1000000
 #define ROUNDUP(x) ((x + 511) & ~511)
+// directories the native engine keeps open
+#define MAX_DIR_FDS 1024
+// bytes the master reads at once while looking for headers
+#define SCAN_WINDOW (1024*1024)
 
-#define DEBUG
+// build with make CXXFLAGS=-DDEBUG to trace the requests on stderr
 
 template <class packet_t>
 class port_t
@@ -32,6 +45,8 @@ class port_t
 
     void push_packet(const packet_t &packet);
     packet_t pull_packet();
+    // like pull_packet() but returns false instead of blocking
+    bool try_pull_packet(packet_t &packet);
   private:
     port_t(const port_t&);
     port_t& operator=(const port_t&);
@@ -81,6 +96,20 @@ packet_t port_t<packet_t>::pull_packet()
   return retval;
 }
 
+template <class packet_t>
+bool port_t<packet_t>::try_pull_packet(packet_t& packet)
+{
+  pthread_mutex_lock(&lock);
+  const bool have = !packets.empty();
+  if(have) {
+    packet = packets.front();
+    packets.pop();
+  }
+  pthread_mutex_unlock(&lock);
+
+  return have;
+}
+
 struct tarentry_t {
   off_t offset;
   size_t length;
@@ -94,10 +123,543 @@ struct worker_t {
   pthread_t worker_thread;
   port_t<workrequest_t>* master_port;
   port_t<tarentry_t> worker_port;
-  int pipefd;
+  int pipefd; // -1 for the native engine
   pid_t tarpid;
 };
 
+struct posix_header
+{                              /* byte offset */
+  char name[100];               /*   0 */
+  char mode[8];                 /* 100 */
+  char uid[8];                  /* 108 */
+  char gid[8];                  /* 116 */
+  char size[12];                /* 124 */
+  char mtime[12];               /* 136 */
+  char chksum[8];               /* 148 */
+  char typeflag;                /* 156 */
+  char linkname[100];           /* 157 */
+  char magic[6];                /* 257 */
+  char version[2];              /* 263 */
+  char uname[32];               /* 265 */
+  char gname[32];               /* 297 */
+  char devmajor[8];             /* 329 */
+  char devminor[8];             /* 337 */
+  char prefix[155];             /* 345 */
+  char pad[12];                 /* 500 */
+};
+
+// the records of a PAX extended header by key
+typedef std::map<std::string, std::string> pax_records_t;
+
+// the native engine creates files below the current directory through this
+// cache, NULL when tar does the extracting
+static dir_cache_t* dirs = NULL;
+// the permission bits the native engine keeps, all of them for root and
+// those not in the umask otherwise, like tar does
+static mode_t mode_mask = 07777;
+static bool restore_owner = false;
+
+// the value of a numeric header field, octal or, if the top bit of its first
+// byte is set, base-256 as GNU tar writes sizes of 8GB and beyond
+static long long parse_number(const char *field, size_t len)
+{
+  if(field[0] & 0x80) {
+    long long val = field[0] & 0x3f;
+    for(size_t i = 1 ; i < len ; ++i)
+      val = (val << 8) | (unsigned char)field[i];
+    return val;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*s", (int)len, field);
+  return strtoll(buf, NULL, 8);
+}
+
+// reads size bytes at offset of the tar file, exits if it ends before
+static void read_archive(char *buf, size_t size, off_t offset)
+{
+  size_t have = 0;
+  while(have < size) {
+    ssize_t haveread = pread(0, buf + have, size - have, offset + have);
+    if(haveread == -1) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Could not read %zu bytes: %s\n", size - have,
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    } else if(haveread == 0) {
+      fprintf(stderr, "Unexpected end of file\n");
+      exit(EXIT_FAILURE);
+    }
+    have += (size_t)haveread;
+  }
+}
+
+// parses the length bytes of records of the PAX extended header whose data
+// starts at offset into records, later records override earlier ones. data
+// must be NUL terminated.
+static void parse_pax_records(const char *data, size_t length, off_t offset,
+                              pax_records_t& records)
+{
+  // each record is "length key=value\n", length counting the whole record
+  for(size_t pos = 0 ; pos < length ; ) {
+    char *end;
+    const long reclen = strtol(&data[pos], &end, 10);
+    const char *key = end + 1;
+    const char *last = &data[pos] + reclen - 1;
+    const char *eq = NULL;
+    if(reclen > 0 && (size_t)reclen <= length - pos && *end == ' ' &&
+       key < last && *last == '\n')
+      eq = (const char*)memchr(key, '=', (size_t)(last - key));
+    if(eq == NULL) {
+      fprintf(stderr, "Corrupt PAX header at %zd\n", (ssize_t)offset);
+      exit(EXIT_FAILURE);
+    }
+    records[std::string(key, eq)] = std::string(eq + 1, last);
+    pos += (size_t)reclen;
+  }
+}
+
+// reads the records of the PAX extended header whose data starts at offset
+// into records
+static void read_pax_records(off_t offset, size_t length,
+                             pax_records_t& records)
+{
+  std::vector<char> data(length + 1);
+  read_archive(&data[0], length, offset);
+  parse_pax_records(&data[0], length, offset, records);
+}
+
+// a member as the native engine extracts it, from its header and the PAX or
+// GNU long name headers in front of it
+struct member_t {
+  std::string name;
+  std::string linkname;
+  char typeflag;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec mtime;
+  long long size;      // bytes of data in the tar file
+  bool sparse;         // PAX sparse format 1.0, the data starts with a map
+  long long real_size; // of the extracted file
+};
+
+// directories get their mode and time once all files in them exist, hard
+// links are made once their targets exist, both after the workers are done
+static std::vector<member_t> deferred;
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a header field that need not be NUL terminated
+static std::string header_field(const char *field, size_t len)
+{
+  return std::string(field, strnlen(field, len));
+}
+
+static void fill_member(const posix_header& hdr, const pax_records_t& pax,
+                        const std::string& long_name,
+                        const std::string& long_link, member_t& member)
+{
+  pax_records_t::const_iterator it;
+  if((it = pax.find("GNU.sparse.name")) != pax.end() ||
+     (it = pax.find("path")) != pax.end()) {
+    member.name = it->second;
+  } else if(!long_name.empty()) {
+    member.name = long_name;
+  } else {
+    member.name = header_field(hdr.name, sizeof(hdr.name));
+    // only POSIX headers have a prefix, GNU ones keep other fields there
+    if(memcmp(hdr.magic, "ustar", sizeof(hdr.magic)) == 0 && hdr.prefix[0])
+      member.name = header_field(hdr.prefix, sizeof(hdr.prefix)) + "/" +
+                    member.name;
+  }
+  if((it = pax.find("linkpath")) != pax.end())
+    member.linkname = it->second;
+  else if(!long_link.empty())
+    member.linkname = long_link;
+  else
+    member.linkname = header_field(hdr.linkname, sizeof(hdr.linkname));
+
+  member.typeflag = hdr.typeflag;
+  member.mode = (mode_t)parse_number(hdr.mode, sizeof(hdr.mode)) & 07777;
+  it = pax.find("uid");
+  member.uid = it != pax.end() ? (uid_t)strtoul(it->second.c_str(), NULL, 10)
+                               : (uid_t)parse_number(hdr.uid, sizeof(hdr.uid));
+  it = pax.find("gid");
+  member.gid = it != pax.end() ? (gid_t)strtoul(it->second.c_str(), NULL, 10)
+                               : (gid_t)parse_number(hdr.gid, sizeof(hdr.gid));
+  member.mtime.tv_nsec = 0;
+  if((it = pax.find("mtime")) != pax.end()) {
+    // seconds with an optional fraction
+    char *end;
+    member.mtime.tv_sec = strtoll(it->second.c_str(), &end, 10);
+    if(*end == '.') {
+      long scale = 100000000;
+      for(const char *p = end + 1 ; *p >= '0' && *p <= '9' && scale ; ++p) {
+        member.mtime.tv_nsec += (*p - '0') * scale;
+        scale /= 10;
+      }
+    }
+  } else {
+    member.mtime.tv_sec = parse_number(hdr.mtime, sizeof(hdr.mtime));
+  }
+  it = pax.find("size");
+  member.size = it != pax.end() ? strtoll(it->second.c_str(), NULL, 10)
+                                : parse_number(hdr.size, sizeof(hdr.size));
+  it = pax.find("GNU.sparse.major");
+  member.sparse = it != pax.end() && it->second == "1";
+  it = pax.find("GNU.sparse.realsize");
+  member.real_size = it != pax.end() ? strtoll(it->second.c_str(), NULL, 10)
+                                     : member.size;
+}
+
+// copies size bytes at src of the tar file to dst of fd. copy_file_range
+// keeps the data in the kernel, file systems that do not support it between
+// the two files get a pread and pwrite through buf.
+static void copy_data(int fd, const std::string& fn, off_t src, off_t dst,
+                      long long size, char *buf)
+{
+  bool in_kernel = true;
+  while(size > 0) {
+    const size_t sz = (size_t)std::min(size, (long long)BUFFER_SIZE);
+    ssize_t copied;
+    if(in_kernel) {
+      loff_t in = src, out = dst;
+      copied = copy_file_range(0, &in, fd, &out, sz, 0);
+      if(copied < 0 && (errno == EXDEV || errno == EINVAL ||
+                        errno == ENOSYS || errno == EOPNOTSUPP)) {
+        in_kernel = false;
+        continue;
+      }
+    } else {
+      read_archive(buf, sz, src);
+      copied = pwrite(fd, buf, sz, dst);
+    }
+    if(copied < 0) {
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Could not write to %s: %s\n", fn.c_str(),
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    } else if(copied == 0) {
+      fprintf(stderr, "Unexpected end of file\n");
+      exit(EXIT_FAILURE);
+    }
+    src += copied;
+    dst += copied;
+    size -= copied;
+  }
+}
+
+struct extent_t {
+  long long offset;
+  long long size;
+};
+
+// reads the map of a sparse member at the start of its data at offset, a
+// count and offset and size pairs one per line in decimal padded to a full
+// block, and returns the size of the map
+static long long read_sparse_map(const member_t& member, off_t offset,
+                                 std::vector<extent_t>& extents)
+{
+  std::string map;
+  size_t lines = 0, needed = 1;
+  while(lines < needed) {
+    if((long long)map.size() >= member.size) {
+      fprintf(stderr, "Corrupt sparse map of %s\n", member.name.c_str());
+      exit(EXIT_FAILURE);
+    }
+    const size_t start = map.size();
+    map.resize(start + 512);
+    read_archive(&map[start], 512, offset + start);
+    for(size_t i = start ; i < map.size() && lines < needed ; ++i) {
+      if(map[i] == '\n' && ++lines == 1)
+        needed = 1 + 2*strtoul(map.c_str(), NULL, 10);
+    }
+  }
+
+  const char *p = map.c_str();
+  char *end;
+  extents.resize(strtoul(p, &end, 10));
+  for(size_t i = 0 ; i < extents.size() ; ++i) {
+    extents[i].offset = strtoll(end + 1, &end, 10);
+    extents[i].size = strtoll(end + 1, &end, 10);
+  }
+  return (long long)map.size();
+}
+
+// mode, owner and time of a file the native engine created
+static void set_attributes(int fd, const member_t& member)
+{
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = member.mtime;
+  if((restore_owner && fchown(fd, member.uid, member.gid)) ||
+     fchmod(fd, member.mode & mode_mask) || futimens(fd, times)) {
+    fprintf(stderr, "Could not set the attributes of %s: %s\n",
+            member.name.c_str(), strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// the directory holding a member's file, creating missing directories
+static dir_cache_t::dir_t* member_parent(const member_t& member,
+                                         std::string& leaf)
+{
+  dir_cache_t::dir_t* dir = dirs->parent_of(member.name, leaf);
+  if(dir == NULL) {
+    fprintf(stderr, "Invalid file name %s\n", member.name.c_str());
+    exit(EXIT_FAILURE);
+  }
+  return dir;
+}
+
+static void extract_file(const member_t& member, off_t offset, char *buf)
+{
+  std::string leaf;
+  dir_cache_t::dir_t* dir = member_parent(member, leaf);
+  const int dirfd = dir_cache_t::fd(dir);
+  // like tar, replace whatever is in the way, and never follow a symbolic
+  // link the archive may have planted
+  const int flags = O_WRONLY|O_CREAT|O_TRUNC|O_NOFOLLOW|O_CLOEXEC;
+  int fd = openat(dirfd, leaf.c_str(), flags, 0600);
+  if(fd < 0 && errno != ENOENT && unlinkat(dirfd, leaf.c_str(), 0) == 0)
+    fd = openat(dirfd, leaf.c_str(), flags, 0600);
+  if(fd < 0) {
+    fprintf(stderr, "Could not create %s: %s\n", member.name.c_str(),
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  dirs->release(dir);
+
+  if(member.sparse) {
+    // the extents are stored one after the other after the map
+    std::vector<extent_t> extents;
+    const long long map_size = read_sparse_map(member, offset, extents);
+    long long packed = map_size;
+    for(size_t i = 0 ; i < extents.size() ; ++i) {
+      if(packed + extents[i].size > member.size) {
+        fprintf(stderr, "Corrupt sparse map of %s\n", member.name.c_str());
+        exit(EXIT_FAILURE);
+      }
+      copy_data(fd, member.name, offset + packed, extents[i].offset,
+                extents[i].size, buf);
+      packed += extents[i].size;
+    }
+    if(ftruncate(fd, member.real_size)) {
+      fprintf(stderr, "Could not set the size of %s: %s\n",
+              member.name.c_str(), strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    copy_data(fd, member.name, offset, 0, member.size, buf);
+  }
+  set_attributes(fd, member);
+  if(close(fd)) {
+    fprintf(stderr, "Could not write to %s: %s\n", member.name.c_str(),
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void extract_symlink(const member_t& member)
+{
+  std::string leaf;
+  dir_cache_t::dir_t* dir = member_parent(member, leaf);
+  const int dirfd = dir_cache_t::fd(dir);
+  const char *target = member.linkname.c_str();
+  int ierr = symlinkat(target, dirfd, leaf.c_str());
+  if(ierr && errno == EEXIST && unlinkat(dirfd, leaf.c_str(), 0) == 0)
+    ierr = symlinkat(target, dirfd, leaf.c_str());
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_OMIT;
+  times[1] = member.mtime;
+  if(ierr ||
+     (restore_owner && fchownat(dirfd, leaf.c_str(), member.uid, member.gid,
+                                AT_SYMLINK_NOFOLLOW)) ||
+     utimensat(dirfd, leaf.c_str(), times, AT_SYMLINK_NOFOLLOW)) {
+    fprintf(stderr, "Could not create symbolic link %s to %s: %s\n",
+            member.name.c_str(), target, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  dirs->release(dir);
+}
+
+static void extract_directory(const member_t& member)
+{
+  // the current directory itself, as in "./", exists already
+  if(member.name.find_first_not_of("./") == std::string::npos &&
+     member.name.find("..") == std::string::npos) {
+    pthread_mutex_lock(&deferred_lock);
+    deferred.push_back(member);
+    pthread_mutex_unlock(&deferred_lock);
+    return;
+  }
+
+  std::string leaf;
+  dir_cache_t::dir_t* dir = member_parent(member, leaf);
+  // writable for now whatever its mode, files are still to be created in it
+  if(mkdirat(dir_cache_t::fd(dir), leaf.c_str(), 0700) && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory %s: %s\n",
+            member.name.c_str(), strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  dirs->release(dir);
+
+  pthread_mutex_lock(&deferred_lock);
+  deferred.push_back(member);
+  pthread_mutex_unlock(&deferred_lock);
+}
+
+// creates the member whose data starts at offset of the tar file
+static void extract_member(const member_t& member, off_t offset, char *buf)
+{
+  // like tar, refuse to write outside of the current directory
+  if(dir_cache_t::escapes(member.name) ||
+     (member.typeflag == '1' && dir_cache_t::escapes(member.linkname))) {
+    fprintf(stderr, "Skipping %s whose name contains '..'\n",
+            member.name.c_str());
+    return;
+  }
+  switch(member.typeflag) {
+    case '0': case '\0': case '7':
+      extract_file(member, offset, buf);
+      break;
+    case '1':
+      pthread_mutex_lock(&deferred_lock);
+      deferred.push_back(member);
+      pthread_mutex_unlock(&deferred_lock);
+      break;
+    case '2':
+      extract_symlink(member);
+      break;
+    case '5':
+      extract_directory(member);
+      break;
+    case 'S':
+      fprintf(stderr, "%s is an old GNU sparse member, which only "
+              "-engine tar extracts\n", member.name.c_str());
+      exit(EXIT_FAILURE);
+    default:
+      fprintf(stderr, "Skipping %s of unsupported type '%c'\n",
+              member.name.c_str(), member.typeflag);
+      break;
+  }
+}
+
+// extracts the members in [cur, end) of the tar file. The master only ends
+// a range after a regular member, so any PAX or GNU long name headers are in
+// the same range as the member they belong to.
+static void extract_range(off_t cur, off_t end, char *buf)
+{
+  pax_records_t pax;
+  std::string long_name, long_link;
+  while(cur < end) {
+    posix_header hdr;
+    read_archive((char*)&hdr, sizeof(hdr), cur);
+    const off_t data = cur + sizeof(hdr);
+    const long long size = parse_number(hdr.size, sizeof(hdr.size));
+    if(hdr.typeflag == 'x') {
+      read_pax_records(data, (size_t)size, pax);
+      cur = data + ROUNDUP(size);
+    } else if(hdr.typeflag == 'g') {
+      // global headers only hold defaults GNU tar itself does not write
+      cur = data + ROUNDUP(size);
+    } else if(hdr.typeflag == 'L' || hdr.typeflag == 'K') {
+      std::string& value = hdr.typeflag == 'L' ? long_name : long_link;
+      value.resize((size_t)size);
+      read_archive(&value[0], (size_t)size, data);
+      value.resize(strnlen(value.c_str(), (size_t)size));
+      cur = data + ROUNDUP(size);
+    } else {
+      member_t member;
+      fill_member(hdr, pax, long_name, long_link, member);
+      extract_member(member, data, buf);
+      cur = data + ROUNDUP(member.size);
+      pax.clear();
+      long_name.clear();
+      long_link.clear();
+    }
+  }
+}
+
+static bool deeper_first(const member_t& a, const member_t& b)
+{
+  return a.name > b.name;
+}
+
+// makes the hard links and sets the mode and time of the directories, once
+// all workers are done
+static void finish_deferred()
+{
+  for(size_t i = 0 ; i < deferred.size() ; ++i) {
+    const member_t& member = deferred[i];
+    if(member.typeflag != '1')
+      continue;
+    std::string leaf;
+    dir_cache_t::dir_t* dir = member_parent(member, leaf);
+    const int dirfd = dir_cache_t::fd(dir);
+    int ierr = linkat(AT_FDCWD, member.linkname.c_str(), dirfd, leaf.c_str(),
+                      0);
+    if(ierr && errno == EEXIST && unlinkat(dirfd, leaf.c_str(), 0) == 0)
+      ierr = linkat(AT_FDCWD, member.linkname.c_str(), dirfd, leaf.c_str(),
+                    0);
+    if(ierr) {
+      fprintf(stderr, "Could not link %s to %s: %s\n", member.name.c_str(),
+              member.linkname.c_str(), strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    dirs->release(dir);
+  }
+
+  // a directory's time changes as entries are added to it, so children go
+  // before their parents
+  std::sort(deferred.begin(), deferred.end(), deeper_first);
+  for(size_t i = 0 ; i < deferred.size() ; ++i) {
+    const member_t& member = deferred[i];
+    if(member.typeflag != '5')
+      continue;
+    const int fd = open(member.name.c_str(),
+                        O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(fd < 0) {
+      fprintf(stderr, "Could not open directory %s: %s\n",
+              member.name.c_str(), strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    set_attributes(fd, member);
+    close(fd);
+  }
+}
+
+// sends the byte range of the tar file in tarentry down the pipe to tar
+static void pipe_range(int pipefd, const tarentry_t& tarentry, char *buf)
+{
+  for(off_t cur = tarentry.offset, end = cur+tarentry.length ; cur < end ; ) {
+    size_t toread = cur + BUFFER_SIZE > end ? end-cur : BUFFER_SIZE;
+    ssize_t haveread = pread(0, buf, toread, cur);
+    if(haveread == -1) {
+      fprintf(stderr, "Could not read %zu bytes: %s\n", toread,
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    } else if(haveread == 0) {
+      fprintf(stderr, "Unexpected end of file\n");
+      exit(EXIT_FAILURE);
+    }
+    ssize_t havewritten = write(pipefd, buf, (size_t)haveread);
+    if(havewritten == -1) {
+      fprintf(stderr, "Could not write %zu bytes: %s\n", haveread,
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    } else if (havewritten != haveread) {
+      // TOOD: this can happen on signals it seems, likely need to loop
+      fprintf(stderr, "Could not write %zu bytes\n", haveread);
+      exit(EXIT_FAILURE);
+    }
+    cur += haveread;
+  }
+}
+
 void *worker(void *callarg)
 {
   worker_t *mydata = static_cast<worker_t*>(callarg);
@@ -117,40 +679,28 @@ void *worker(void *callarg)
   while(true) {
     tarentry_t tarentry = myport.pull_packet();
 #   ifdef DEBUG
-    fprintf(stderr, "Received request at %zd length %zu for pid %d\n",
-            tarentry.offset, tarentry.length, pid);
+    if(pipefd < 0)
+      fprintf(stderr, "Received request at %zd length %zu for native "
+              "extraction\n", tarentry.offset, tarentry.length);
+    else
+      fprintf(stderr, "Received request at %zd length %zu for pid %d\n",
+              tarentry.offset, tarentry.length, pid);
 #   endif
     if(tarentry.length == 0) // magic size to quit
       break;
 
-    for(off_t cur = tarentry.offset, end = cur+tarentry.length ; cur < end ; ) {
-      size_t toread = cur + BUFFER_SIZE > end ? end-cur : BUFFER_SIZE;
-      ssize_t haveread = pread(0, buf, toread, cur);
-      if(haveread == -1) {
-        fprintf(stderr, "Could not read %zu bytes: %s\n", toread,
-                strerror(errno));
-        exit(EXIT_FAILURE);
-      } else if(haveread == 0) {
-        fprintf(stderr, "Unexpected end of file\n");
-        exit(EXIT_FAILURE);
-      }
-      ssize_t havewritten = write(pipefd, buf, (size_t)haveread);
-      if(havewritten == -1) {
-        fprintf(stderr, "Could not write %zu bytes: %s\n", haveread,
-                strerror(errno));
-        exit(EXIT_FAILURE);
-      } else if (havewritten != haveread) {
-        // TOOD: this can happen on signals it seems, likely need to loop
-        fprintf(stderr, "Could not write %zu bytes\n", haveread);
-        exit(EXIT_FAILURE);
-      }
-      cur += haveread;
-    }
+    if(pipefd < 0)
+      extract_range(tarentry.offset, tarentry.offset + tarentry.length, buf);
+    else
+      pipe_range(pipefd, tarentry, buf);
 
     // get more work
     workrequest_t request = {&myport};
     master_port.push_packet(request);
   }
+  delete[] buf;
+  if(pipefd < 0)
+    return NULL;
 
   // close down tar file for tar
   static char zeros[2*512];
@@ -192,7 +742,20 @@ void *worker(void *callarg)
 void start_workers(port_t<workrequest_t>* master_port,
                    std::vector<worker_t>& workers)
 {
-  for(size_t i = 0 ; i < workers.size() ; ++i) {
+  for(size_t i = 0 ; i < workers.size() && dirs ; ++i) {
+    // the native engine's threads do the work themselves
+    workers[i].master_port = master_port;
+    workers[i].pipefd = -1;
+    workers[i].tarpid = 0;
+    const int ierr =
+      pthread_create(&workers[i].worker_thread, NULL, worker,
+                     static_cast<void*>(&workers[i]));
+    if(ierr) {
+      fprintf(stderr, "Could not create thread %zu: %s\n", i, strerror(ierr));
+      exit(EXIT_FAILURE);
+    }
+  }
+  for(size_t i = 0 ; i < workers.size() && !dirs ; ++i) {
     // spawn a worker tar to do the actual work
     int pipefd[2];
     if(pipe(pipefd) == -1) {
@@ -242,83 +805,292 @@ void start_workers(port_t<workrequest_t>* master_port,
   }
 }
 
-int main(int argc, char **argv)
+// reads the headers of the tar file on stdin in aligned windows of
+// SCAN_WINDOW bytes instead of one pread per header, and has the kernel read
+// the following window ahead while the current one is scanned. Small
+// members share a window, so on storage with a high latency the scan waits
+// for one round trip per window rather than per header.
+class header_scanner_t
 {
-  port_t<workrequest_t> master_port;
-  std::vector<worker_t> workers(NUM_THREADS);
-  start_workers(&master_port, workers);
+  public:
+    header_scanner_t();
+    ~header_scanner_t();
 
-  struct posix_header
-  {                              /* byte offset */
-    char name[100];               /*   0 */
-    char mode[8];                 /* 100 */
-    char uid[8];                  /* 108 */
-    char gid[8];                  /* 116 */
-    char size[12];                /* 124 */
-    char mtime[12];               /* 136 */
-    char chksum[8];               /* 148 */
-    char typeflag;                /* 156 */
-    char linkname[100];           /* 157 */
-    char magic[6];                /* 257 */
-    char version[2];              /* 263 */
-    char uname[32];               /* 265 */
-    char gname[32];               /* 297 */
-    char devmajor[8];             /* 329 */
-    char devminor[8];             /* 337 */
-    char prefix[155];             /* 345 */
-    char pad[12];                 /* 500 */
-  } hdr;
-  off_t cur = 0, entrystart = 0;
-  size_t num_entries = 0;
-  while(true) {
-    ssize_t haveread = pread(0, (void*)&hdr, sizeof(hdr), cur);
+    // size bytes at offset, NULL if the file ends before or size exceeds a
+    // window. Valid until the next call.
+    const char *read(off_t offset, size_t size);
+  private:
+    header_scanner_t(const header_scanner_t&);
+    header_scanner_t& operator=(const header_scanner_t&);
+
+    void load(off_t offset);
+
+    char *buf;
+    off_t start;  // offset of buf in the file
+    size_t have;  // bytes in buf
+};
+
+header_scanner_t::header_scanner_t() :
+  buf(new char[SCAN_WINDOW]), start(0), have(0)
+{
+  // the headers are read front to back
+  posix_fadvise(0, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+header_scanner_t::~header_scanner_t()
+{
+  delete[] buf;
+}
+
+void header_scanner_t::load(off_t offset)
+{
+  start = offset;
+  have = 0;
+  while(have < SCAN_WINDOW) {
+    ssize_t haveread = pread(0, buf + have, SCAN_WINDOW - have, start + have);
     if(haveread == -1) {
-      fprintf(stderr, "Could not read %zu bytes: %s\n", sizeof(hdr),
+      if(errno == EINTR)
+        continue;
+      fprintf(stderr, "Could not read %zu bytes: %s\n", SCAN_WINDOW - have,
               strerror(errno));
       exit(EXIT_FAILURE);
     } else if(haveread == 0) {
       break;
-    } else if(hdr.name[0] == 0) {
+    }
+    have += (size_t)haveread;
+  }
+  if(have == SCAN_WINDOW)
+    posix_fadvise(0, start + SCAN_WINDOW, SCAN_WINDOW, POSIX_FADV_WILLNEED);
+}
+
+const char *header_scanner_t::read(off_t offset, size_t size)
+{
+  if(size > SCAN_WINDOW)
+    return NULL;
+  const off_t end = offset + (off_t)size;
+  if(offset < start || end > start + (off_t)have) {
+    // a window is only ever loaded to get past the end of the previous one,
+    // so one that reaches the end of the file would have had it all
+    if(have < SCAN_WINDOW && offset >= start && have > 0)
+      return NULL;
+    off_t aligned = offset & ~(off_t)(SCAN_WINDOW - 1);
+    // what straddles two windows starts a window of its own
+    if(end > aligned + SCAN_WINDOW)
+      aligned = offset & ~(off_t)511;
+    load(aligned);
+    if(end > start + (off_t)have)
+      return NULL;
+  }
+  return buf + (offset - start);
+}
+
+// hands chunks to the workers that asked for work. Unless wait is set it
+// returns as soon as no worker is waiting, so that the master goes on
+// scanning while the workers are busy.
+static void dispatch(port_t<workrequest_t>& master_port,
+                     std::deque<tarentry_t>& pending, bool wait)
+{
+  while(!pending.empty()) {
+    workrequest_t workrequest;
+    if(wait)
+      workrequest = master_port.pull_packet();
+    else if(!master_port.try_pull_packet(workrequest))
+      break;
+#   ifdef DEBUG
+    fprintf(stderr, "Pushing request at %zd length %zu\n",
+            pending.front().offset, pending.front().length);
+#   endif
+    workrequest.requestor->push_packet(pending.front());
+    pending.pop_front();
+  }
+}
+
+// cuts the tar file into chunks by scanning its headers, a chunk ends after
+// a regular member once it holds enough members or bytes
+static void scan_headers(port_t<workrequest_t>& master_port,
+                         std::deque<tarentry_t>& pending)
+{
+  header_scanner_t scanner;
+  off_t cur = 0, entrystart = 0;
+  size_t num_entries = 0;
+  // the records of the PAX header of the member to come, its size overrides
+  // the one in the member's header
+  pax_records_t pax;
+  while(true) {
+    const posix_header *hdr =
+      (const posix_header*)scanner.read(cur, sizeof(posix_header));
+    if(hdr == NULL) {
+      break;
+    } else if(hdr->name[0] == 0) {
       // really this should check for 1024 bytes of zeros
       break;
     }
 
     // length of tar entry
-    char szbuf[13];
-    snprintf(szbuf, sizeof(szbuf), "%.12s", hdr.size);
-    long int size = ROUNDUP(strtol(szbuf, NULL, 8));
+    long long size = parse_number(hdr->size, sizeof(hdr->size));
+    const char typeflag = hdr->typeflag;
+    if(typeflag == 'x') {
+      const off_t data = cur + sizeof(posix_header);
+      const char *records = scanner.read(data, (size_t)size);
+      if(records) {
+        std::vector<char> copy(records, records + size);
+        copy.push_back('\0');
+        parse_pax_records(&copy[0], (size_t)size, data, pax);
+      } else {
+        read_pax_records(data, (size_t)size, pax);
+      }
+    } else if(!pax.empty()) {
+      pax_records_t::const_iterator it = pax.find("size");
+      if(it != pax.end())
+        size = strtoll(it->second.c_str(), NULL, 10);
+      pax.clear();
+    }
+    size = ROUNDUP(size);
 
-    if((hdr.typeflag == '0' || hdr.typeflag == 0) &&
+    cur = cur + sizeof(posix_header) + size;
+    if((typeflag == '0' || typeflag == 0) &&
       // wait until we have collected enough data to make this worthwhile
       (num_entries >= TARGET_NUM_FILES ||
-       cur + sizeof(hdr) + size - entrystart >= TARGET_NUM_BYTES)) {
-      struct tarentry_t tarentry = {
-        entrystart, (size_t)((cur - entrystart) + sizeof(hdr) + size)
-      };
-#     ifdef DEBUG
-      fprintf(stderr, "Master waiting for work request\n");
-#         endif
-      struct workrequest_t workrequest = master_port.pull_packet();
-#     ifdef DEBUG
-      fprintf(stderr, "Pushing request for '%s' at %zd length %ld\n",
-              hdr.name, entrystart, size);
-#     endif
-      workrequest.requestor->push_packet(tarentry);
-      entrystart = cur = cur + sizeof(hdr) + size;
+       cur - entrystart >= TARGET_NUM_BYTES)) {
+      tarentry_t tarentry = { entrystart, (size_t)(cur - entrystart) };
+      pending.push_back(tarentry);
+      dispatch(master_port, pending, false);
+      entrystart = cur;
       num_entries = 0;
     } else {
-      cur = cur + sizeof(hdr) + size;
       num_entries += 1;
     }
   }
   // take care of dangling entries at end of file
   if(entrystart != cur) {
-    struct tarentry_t tarentry = {
-      entrystart, (size_t)(cur - entrystart)
-    };
-    struct workrequest_t workrequest = master_port.pull_packet();
-    workrequest.requestor->push_packet(tarentry);
+    tarentry_t tarentry = { entrystart, (size_t)(cur - entrystart) };
+    pending.push_back(tarentry);
   }
+}
+
+// cuts the tar file into chunks using the index parcp -tar-index wrote for
+// it, without reading any headers
+static void scan_index(const tar_index_t& index,
+                       port_t<workrequest_t>& master_port,
+                       std::deque<tarentry_t>& pending)
+{
+  off_t entrystart = 0, cur = 0;
+  size_t num_entries = 0;
+  for(size_t i = 0 ; i < index.size() ; ++i) {
+    const tar_index_entry_t entry = index.entry(i);
+    // members are adjacent in a tar file parcp wrote, should they not be a
+    // chunk must not cover the gap
+    if((off_t)entry.header_offset != cur && cur != entrystart) {
+      tarentry_t tarentry = { entrystart, (size_t)(cur - entrystart) };
+      pending.push_back(tarentry);
+      num_entries = 0;
+    }
+    if((off_t)entry.header_offset != cur)
+      entrystart = (off_t)entry.header_offset;
+    cur = (off_t)(entry.data_offset + ROUNDUP(entry.size));
+    num_entries += 1;
+    if(num_entries >= TARGET_NUM_FILES || cur - entrystart >= TARGET_NUM_BYTES) {
+      tarentry_t tarentry = { entrystart, (size_t)(cur - entrystart) };
+      pending.push_back(tarentry);
+      entrystart = cur;
+      num_entries = 0;
+    }
+    dispatch(master_port, pending, false);
+  }
+  if(entrystart != cur) {
+    tarentry_t tarentry = { entrystart, (size_t)(cur - entrystart) };
+    pending.push_back(tarentry);
+  }
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-engine tar|native] [-threads N] [-index INDEX] "
+          "< FILE.tar\n"
+          "extracts FILE.tar into the current directory\n"
+          "  -engine E   tar: pipe parts of FILE.tar to one tar x per thread "
+          "(default)\n"
+          "              native: the threads create the files themselves\n"
+          "  -threads N  number of threads (default %d)\n"
+          "  -index INDEX\n"
+          "              find the members with the index parcp -tar-index "
+          "wrote for\n"
+          "              FILE.tar instead of reading its headers\n",
+          argv0, NUM_THREADS);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+  enum { OPT_ENGINE = 256, OPT_THREADS, OPT_INDEX };
+  static const struct option longopts[] = {
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"threads", required_argument, NULL, OPT_THREADS},
+    {"index", required_argument, NULL, OPT_INDEX},
+    {NULL, 0, NULL, 0}
+  };
+  bool native = false;
+  long num_threads = NUM_THREADS;
+  const char *index_file = NULL;
+  int opt;
+  while((opt = getopt_long_only(argc, argv, "", longopts, NULL)) != -1) {
+    switch(opt) {
+      case OPT_ENGINE:
+        if(strcmp(optarg, "tar") == 0) {
+          native = false;
+        } else if(strcmp(optarg, "native") == 0) {
+          native = true;
+        } else {
+          fprintf(stderr, "unknown engine '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_THREADS: {
+        char *end;
+        num_threads = strtol(optarg, &end, 10);
+        if(end == optarg || *end != '\0' || num_threads < 1 ||
+           num_threads > 4096)
+          usage(argv[0]);
+        break;
+      }
+      case OPT_INDEX:
+        index_file = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        break;
+    }
+  }
+  if(optind != argc)
+    usage(argv[0]);
+
+  if(native) {
+    dirs = new dir_cache_t(".", MAX_DIR_FDS);
+    restore_owner = geteuid() == 0;
+    if(!restore_owner) {
+      const mode_t mask = umask(0);
+      umask(mask);
+      mode_mask = 07777 & ~mask;
+    }
+  }
+
+  port_t<workrequest_t> master_port;
+  std::vector<worker_t> workers((size_t)num_threads);
+  start_workers(&master_port, workers);
+
+  // chunks that are ready while no worker asks for one, the scan goes on
+  std::deque<tarentry_t> pending;
+  if(index_file) {
+    const tar_index_t index(index_file);
+    scan_index(index, master_port, pending);
+  } else {
+    scan_headers(master_port, pending);
+  }
+# ifdef DEBUG
+  fprintf(stderr, "Master waiting for work requests\n");
+# endif
+  dispatch(master_port, pending, true);
 
 # ifdef DEBUG
   fprintf(stderr, "Master asking workers to finish up\n");
@@ -343,6 +1115,8 @@ int main(int argc, char **argv)
       exit(EXIT_FAILURE);
     }
   }
+  if(dirs)
+    finish_deferred();
 
   return EXIT_SUCCESS;
 }